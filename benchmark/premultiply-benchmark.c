@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/premultiply.h"
+
+// Cursor premultiplication loop that was used before vectorised kernels.
+static void premultiplyPixelsLegacy(uint8_t* dst, const uint8_t* src, uint32_t count) {
+    const uint32_t length = count * 4;
+
+    for (uint32_t j = 0; j < count; ++j) {
+        // Do a sanity check
+        if (j * 4 + 3 >= length) {
+            break;
+        }
+
+        double alpha = src[j * 4 + 3] / 255.;
+
+        dst[j * 4    ] = src[j * 4    ] * alpha;
+        dst[j * 4 + 1] = src[j * 4 + 1] * alpha;
+        dst[j * 4 + 2] = src[j * 4 + 2] * alpha;
+        dst[j * 4 + 3] = src[j * 4 + 3];
+    }
+}
+
+static uint64_t getTimeNs(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+// Returns average time of premultiplying |size|x|size| image, in nanoseconds.
+static double measure(PremultiplyFunction_t function, uint8_t* dst, const uint8_t* src, uint32_t size) {
+    // NB: Roughly the same amount of work for every size.
+    const uint32_t iterations = 64 * 1024 * 1024 / (size * size);
+
+    for (uint32_t i = 0; i < iterations / 16; ++i) {
+        for (uint32_t row = 0; row < size; ++row) {
+            function(&dst[row * size * 4], &src[row * size * 4], size);
+        }
+    }
+
+    const uint64_t start = getTimeNs();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        // NB: Cursor images are premultiplied row by row, since mapped buffer stride may differ from image one.
+        for (uint32_t row = 0; row < size; ++row) {
+            function(&dst[row * size * 4], &src[row * size * 4], size);
+        }
+    }
+
+    return (double) (getTimeNs() - start) / iterations;
+}
+
+int main(void) {
+    static const uint32_t sizes[] = { 64, 256 };
+
+    const struct {
+        const char* name;
+        PremultiplyFunction_t function;
+    } implementations[] = {
+        { "legacy", premultiplyPixelsLegacy },
+        { "scalar", premultiplyPixelsScalar },
+        { "sse2", getPremultiplyPixelsSse2() },
+        { "avx2", getPremultiplyPixelsAvx2() },
+        { "neon", getPremultiplyPixelsNeon() },
+        { "selected", premultiplyPixels }
+    };
+    const int implementationsCount = sizeof (implementations) / sizeof (implementations[0]);
+
+    int result = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        const uint32_t size = sizes[i];
+        const size_t length = size * size * 4;
+
+        uint8_t* src = malloc(length);
+        uint8_t* expected = malloc(length);
+        uint8_t* dst = malloc(length);
+        if (!src || !expected || !dst) {
+            fprintf(stderr, "Failed to allocate images\n");
+            return 1;
+        }
+
+        srand(size);
+        for (size_t j = 0; j < length; ++j) {
+            src[j] = rand();
+        }
+
+        premultiplyPixelsScalar(expected, src, size * size);
+
+        printf("%ux%u:\n", size, size);
+
+        double legacyNs = 0.;
+        for (int j = 0; j < implementationsCount; ++j) {
+            if (!implementations[j].function) {
+                printf("  %-8s  not supported\n", implementations[j].name);
+                continue;
+            }
+
+            const double ns = measure(implementations[j].function, dst, src, size);
+            if (!legacyNs) {
+                legacyNs = ns;
+            }
+
+            // NB: Legacy loop truncates instead of rounding, so its result is not compared.
+            const int mismatch = j > 0 && memcmp(dst, expected, length) != 0;
+            result |= mismatch;
+
+            printf("  %-8s %10.0f ns  %6.2fx%s\n",
+                   implementations[j].name, ns, legacyNs / ns, mismatch ? "  MISMATCH" : "");
+        }
+
+        free(dst);
+        free(expected);
+        free(src);
+    }
+
+    return result;
+}
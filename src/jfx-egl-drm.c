@@ -2,10 +2,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+
+#include <linux/netlink.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -13,15 +23,291 @@
 
 #include <gbm.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 
 #include <jni.h>
 
+#include "premultiply.h"
+#include "resample.h"
+
 typedef struct DrmProperties {
     drmModePropertyPtr* properties;
     uint32_t count;
+    // Ids of |usedPropertyNames| properties (zero for absent ones). Set when full properties are freed in low memory
+    //  mode.
+    uint32_t* usedIds;
 } DrmProperties_t;
 
+// Properties this library sets or reads after initialization.
+static const char* const usedPropertyNames[] = {
+    "ACTIVE",
+    "CRTC_H",
+    "CRTC_ID",
+    "CRTC_W",
+    "CRTC_X",
+    "CRTC_Y",
+    "FB_DAMAGE_CLIPS",
+    "FB_ID",
+    "MODE_ID",
+    "SRC_H",
+    "SRC_W",
+    "SRC_X",
+    "SRC_Y",
+    "alpha",
+    "link-status",
+    "pixel blend mode",
+    "rotation",
+    "zpos"
+};
+
+#define USED_PROPERTIES_COUNT (sizeof (usedPropertyNames) / sizeof (usedPropertyNames[0]))
+
+// Render size ladder for dynamic resolution scaling, in percents of the mode size.
+static const uint32_t dynamicResolutionLadder[] = { 100, 85, 70 };
+
+#define DYNAMIC_RESOLUTION_LEVELS (sizeof (dynamicResolutionLadder) / sizeof (dynamicResolutionLadder[0]))
+
+typedef struct DynamicResolution {
+    uint8_t enabled;
+    // Set once the renderer queries |doGetRenderScale|. A renderer that does not query it renders at full size, and
+    //  lowering the level would crop the screen instead of scaling it.
+    uint8_t rendererOptedIn;
+    // Index into |dynamicResolutionLadder| of the level the next frame is rendered at.
+    uint32_t level;
+    // Number of ladder levels the plane is able to scale. Shrinks when TEST_ONLY commit rejects a level.
+    uint32_t levelsCount;
+    uint32_t widths[DYNAMIC_RESOLUTION_LEVELS];
+    uint32_t heights[DYNAMIC_RESOLUTION_LEVELS];
+
+    // Time a frame may take: display refresh period or renderer frame period, whichever is longer.
+    uint64_t budgetNs;
+    // When the renderer queried render scale for the frame being rendered, or zero.
+    uint64_t frameStartNs;
+    uint32_t windowFrames;
+    uint32_t missedFrames;
+    uint32_t headroomFrames;
+} DynamicResolution_t;
+
+#define MAX_SWAPCHAIN_BUFFERS 4
+
+typedef struct SwapchainBuffer {
+    struct gbm_bo* bo;
+    EGLImageKHR image;
+    GLuint colorRenderbuffer;
+    GLuint framebuffer;
+} SwapchainBuffer_t;
+
+// Own swapchain of GBM buffer objects, scanned out instead of |gbm_surface| buffers. Buffers count, their usage flags
+//  and reuse order are fully under our control. The renderer still draws to the window surface (so framebuffer 0 it
+//  binds is the real one), and its front buffer is drawn to the swapchain back buffer on swap, see |ScanoutBlit_t|.
+//  Blocking commit returns once the previous buffer is off screen, so buffers need no release fences.
+typedef struct Swapchain {
+    // Zero when |gbm_surface| buffers are scanned out instead.
+    uint32_t buffersCount;
+    SwapchainBuffer_t buffers[MAX_SWAPCHAIN_BUFFERS];
+    // Buffer that is drawn to.
+    uint32_t backBuffer;
+    // Buffer that is scanned out, or |buffersCount| if there is no such buffer yet.
+    uint32_t frontBuffer;
+} Swapchain_t;
+
+// Window surface buffer sampled by scanout blit. Surface buffers live as long as the surface does, so their textures
+//  are kept.
+typedef struct ScanoutBlitSource {
+    struct gbm_bo* bo;
+    EGLImageKHR image;
+    GLuint texture;
+} ScanoutBlitSource_t;
+
+#define MAX_SCANOUT_BLIT_SOURCES 4
+
+// Draws window surface front buffer to own swapchain on swap, rotating it when UI plane is unable to rotate buffers.
+//  Swapchain framebuffers are bound during the blit only. Used whenever own swapchain is.
+typedef struct ScanoutBlit {
+    uint8_t created;
+    ScanoutBlitSource_t sources[MAX_SCANOUT_BLIT_SOURCES];
+    uint32_t nextSource;
+    GLuint program;
+} ScanoutBlit_t;
+
+#define MAX_DAMAGE_CLIPS 16
+
+// Region changed since the last swap, in framebuffer coordinates. Only tracked in front buffer rendering mode.
+typedef struct Damage {
+    struct drm_mode_rect clips[MAX_DAMAGE_CLIPS];
+    uint32_t count;
+    // Whole framebuffer is damaged when there are more rectangles than we're able to keep.
+    uint8_t overflow;
+} Damage_t;
+
+typedef enum PlaneOwner {
+    PLANE_OWNER_NONE = 0,
+    PLANE_OWNER_UI,
+    PLANE_OWNER_VIDEO,
+    PLANE_OWNER_CURSOR,
+    PLANE_OWNER_LAYER,
+    // Temporarily held while searching for a suitable plane.
+    PLANE_OWNER_PROBE
+} PlaneOwner_t;
+
+typedef enum PlaneBlendMode {
+    PLANE_BLEND_MODE_NONE = 0,
+    PLANE_BLEND_MODE_PREMULTIPLIED,
+    PLANE_BLEND_MODE_COVERAGE,
+    PLANE_BLEND_MODES_COUNT
+} PlaneBlendMode_t;
+
+// Names of "pixel blend mode" property enum values, indexed by |PlaneBlendMode_t|.
+static const char* const planeBlendModeNames[PLANE_BLEND_MODES_COUNT] = {
+    "None",
+    "Pre-multiplied",
+    "Coverage"
+};
+
+// Plane capabilities, collected once at initialization.
+typedef struct PlaneInfo {
+    uint32_t planeId;
+    // One of DRM_PLANE_TYPE_*.
+    uint64_t type;
+    // Mask of CRTC indices this plane can be used with.
+    uint32_t possibleCrtcs;
+    // CRTC the plane was bound to at initialization (by firmware or previous DRM master), or zero.
+    uint32_t crtcId;
+    uint32_t* formats;
+    uint32_t formatsCount;
+    // "IN_FORMATS" blob with format modifiers, or zero if plane has no such property.
+    uint32_t inFormatsBlobId;
+
+    uint8_t hasZpos;
+    uint8_t zposMutable;
+    uint64_t zposMin;
+    uint64_t zposMax;
+    uint64_t zpos;
+
+    // Mask of supported DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_* bits, or zero if plane has no "rotation" property.
+    uint64_t rotations;
+    // Whether plane type allows scaling at all, that is plane is not a cursor one. This is a guess, not a capability:
+    //  supported scaling ratios are only known from TEST_ONLY commit, so every scaled configuration is tested by one.
+    uint8_t mayScaleByType;
+    uint8_t hasAlpha;
+    // Mask of supported |PlaneBlendMode_t| modes and their "pixel blend mode" property values.
+    uint32_t blendModes;
+    uint64_t blendModeValues[PLANE_BLEND_MODES_COUNT];
+    // Blend mode at initialization, or |PLANE_BLEND_MODES_COUNT| if plane has no "pixel blend mode" property.
+    PlaneBlendMode_t blendMode;
+    uint8_t blendModeMutable;
+
+    DrmProperties_t properties;
+    PlaneOwner_t owner;
+    // Whether plane info was restored from topology cache and is not probed yet, see |probeCachedPlane|.
+    uint8_t cached;
+} PlaneInfo_t;
+
+typedef struct PlaneInventory {
+    PlaneInfo_t* planes;
+    uint32_t count;
+    // Device and its display id for messages, planes restored from topology cache are probed on their first use.
+    int fd;
+    const char* displayId;
+} PlaneInventory_t;
+
+// Dmabuf video frames shown on an overlay plane.
+typedef struct VideoLayer {
+    // NULL if there is no suitable plane found yet.
+    PlaneInfo_t* plane;
+    // Format the plane was chosen for.
+    uint32_t format;
+    // Zero if plane zpos should be left intact.
+    uint8_t setZpos;
+    uint64_t zpos;
+
+    // Framebuffer that is scanned out.
+    uint32_t framebufferId;
+    // Framebuffer that will be scanned out after the next commit.
+    uint32_t pendingFramebufferId;
+    uint32_t srcWidth;
+    uint32_t srcHeight;
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint8_t visible;
+    // Whether layer state was changed since the last commit.
+    uint8_t dirty;
+} VideoLayer_t;
+
+// Plane opacity animated by display hardware.
+typedef struct Opacity {
+    // Opacity in "alpha" property units, 0xffff is opaque.
+    uint16_t from;
+    uint16_t to;
+    uint64_t startNs;
+    uint64_t durationNs;
+} Opacity_t;
+
+#define OPAQUE 0xffff
+
+#define MAX_STATIC_LAYERS 4
+
+// Rarely updated image shown on its own plane, below or above UI plane.
+typedef struct StaticLayer {
+    // NULL if layer is not created.
+    PlaneInfo_t* plane;
+    uint8_t setZpos;
+    uint64_t zpos;
+
+    // Buffer that is scanned out.
+    struct gbm_bo* bo;
+    // Buffer that will be scanned out after the next commit.
+    struct gbm_bo* pendingBo;
+    uint32_t srcWidth;
+    uint32_t srcHeight;
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint8_t visible;
+    // Whether layer state was changed since the last commit.
+    uint8_t dirty;
+    Opacity_t opacity;
+} StaticLayer_t;
+
+// Displays driven by one device, including the main one.
+#define MAX_OUTPUTS 4
+
+// Additional display of the same device. It either extends the desktop to the right of the previous displays and scans
+//  out its own part of the buffers UI is rendered to, or mirrors the main display and scans out the whole buffers.
+typedef struct Output {
+    uint32_t connectorId;
+    DrmProperties_t connectorProperties;
+    drmModeModeInfo mode;
+
+    uint32_t crtcId;
+    uint32_t crtcIndex;
+    DrmProperties_t crtcProperties;
+
+    // Primary plane of |crtcId|.
+    PlaneInfo_t* plane;
+    // Position of the display on the desktop, which is also its position in UI buffers. Zero for mirroring display.
+    uint32_t x;
+    uint32_t y;
+    // Part of the display the picture is shown in. Mirrored picture is scaled to fit the display.
+    uint32_t crtcX;
+    uint32_t crtcY;
+    uint32_t crtcWidth;
+    uint32_t crtcHeight;
+
+    // Disconnected display keeps its place on the desktop, but its CRTC is disabled.
+    uint8_t connected;
+    // Whether CRTC should be set up (or disabled) by the next commit.
+    uint8_t doModeset;
+} Output_t;
+
 typedef struct DisplayHandle {
+    // Device path the display was opened by, for messages.
+    char displayId[64];
     uint32_t connectorId;
     DrmProperties_t connectorProperties;
     drmModeModeInfo mode;
@@ -29,42 +315,412 @@ typedef struct DisplayHandle {
     uint32_t encoderId;
 
     uint32_t crtcId;
+    uint32_t crtcIndex;
     DrmProperties_t crtcProperties;
 
+    PlaneInventory_t planes;
+    PlaneInfo_t* uiPlane;
+    // Cursor plane, or overlay plane cursor is shown on. NULL if legacy cursor API is used, or if overlay plane is not
+    //  taken yet.
+    PlaneInfo_t* cursorPlane;
+    // Set when cursor is shown on an overlay plane, as there is no cursor plane. The plane is taken when cursor is
+    //  shown, and handed over to video or static layers that are out of planes while cursor is hidden.
+    uint8_t cursorOnOverlay;
+    uint8_t cursorSetZpos;
+    uint64_t cursorZpos;
+    // Blend mode to set on cursor plane, or |PLANE_BLEND_MODES_COUNT| if it should be left intact.
+    PlaneBlendMode_t cursorBlendMode;
+    uint8_t premultiplyCursor;
+    // Hardware cursor size. Cursor buffer objects have this size unless cursor is shown on an overlay plane.
+    uint32_t cursorWidth;
+    uint32_t cursorHeight;
+    // Id and properties of |uiPlane|.
     uint32_t planeId;
-    DrmProperties_t planeProperties;
+    DrmProperties_t* planeProperties;
 
     int fd;
     struct gbm_device* device;
     struct gbm_surface* surface;
+    Swapchain_t swapchain;
+    // Value of plane "rotation" property, or zero if it should not be set.
+    uint64_t planeRotation;
+    // Screen rotation in degrees, counter-clockwise.
+    uint32_t rotation;
+    // Screen size as seen by the renderer, that is mode size with rotation applied.
+    uint32_t width;
+    uint32_t height;
+    // Size of buffers that are scanned out. With own swapchain, window surface is of this size with rotation applied.
+    uint32_t surfaceWidth;
+    uint32_t surfaceHeight;
+    ScanoutBlit_t scanoutBlit;
+    // Displays that extend the desktop or mirror the main display, and vertical position of the main display on the
+    //  desktop.
+    Output_t outputs[MAX_OUTPUTS - 1];
+    uint32_t outputsCount;
+    uint8_t cloneOutputs;
+    uint32_t offsetY;
     EGLDisplay display;
     struct gbm_bo* previousBo;
+    // Whether a display is connected to |connectorId|, as of the last hotplug.
+    uint8_t connected;
     uint8_t doModeset;
+    // Mode blobs of the next modeset commit, destroyed once it is done.
+    uint32_t modeBlobIds[MAX_OUTPUTS];
+    uint32_t modeBlobsCount;
+    // Framebuffer and its part scanned out by the last UI commit, or zero framebuffer id before the first one.
+    uint32_t scanoutFramebufferId;
+    uint32_t scanoutWidth;
+    uint32_t scanoutHeight;
+
+    uint64_t frameBudgetNs;
+    DynamicResolution_t dynamicResolution;
+    // Front buffer damage, added by |doAddDamageRect| from any thread. Guarded by |commitMutex|.
+    Damage_t damage;
+    // Set when driver does not need dirty framebuffer notifications, as its display scans out buffer memory directly.
+    uint8_t dirtyFramebufferUnsupported;
+    uint8_t lowMemory;
+
+    // Serializes atomic commits made by render thread and by other threads (like video one).
+    pthread_mutex_t commitMutex;
+    // Serializes video layer changes. Taken before |commitMutex|, and held while video commit is blocked without it.
+    pthread_mutex_t videoMutex;
+    uint64_t lastCommitNs;
+    VideoLayer_t video;
+    StaticLayer_t layers[MAX_STATIC_LAYERS];
+
+    // Opacity of all the planes of the display.
+    Opacity_t opacity;
+    // Whether opacity was changed since the last commit.
+    uint8_t opacityDirty;
+    // Commits opacity animation frames and cursor updates while UI is not being rendered.
+    pthread_t commitThread;
+    uint8_t commitThreadStarted;
+    uint8_t commitThreadStop;
+    // NB: Commit thread is woken through its own mutex, which is never held during DRM calls, so that input thread
+    //  can wake it without waiting for commits.
+    pthread_mutex_t wakeMutex;
+    pthread_cond_t commitCondition;
+    uint8_t wakeRequested;
+
+    // Reads kernel uevents and re-probes connectors after hotplug. Stopped by writing to |hotplugStopPipe|.
+    pthread_t hotplugThread;
+    uint8_t hotplugThreadStarted;
+    int hotplugSocket;
+    int hotplugStopPipe[2];
+    // Serializes connector re-probes made by hotplug thread and by |doHandleHotplug|.
+    pthread_mutex_t hotplugMutex;
 } DisplayHandle_t;
 
+// Amount of memory used by buffer objects that are scanned out. Updated from render, commit and video threads, so
+//  is only accessed atomically.
+static size_t displayBuffersBytes = 0;
+
+static void addDisplayBuffersBytes(size_t bytes) {
+    __atomic_fetch_add(&displayBuffersBytes, bytes, __ATOMIC_RELAXED);
+}
+
+static void subtractDisplayBuffersBytes(size_t bytes) {
+    __atomic_fetch_sub(&displayBuffersBytes, bytes, __ATOMIC_RELAXED);
+}
+
+static size_t getDisplayBuffersBytes() {
+    return __atomic_load_n(&displayBuffersBytes, __ATOMIC_RELAXED);
+}
+
 static DisplayHandle_t* currentDisplayHandle = NULL;
 
+// Cursor is shown on cursor plane, or on a free overlay plane on systems without cursor plane. DRM side cursor handling
+//  (legacy cursor API) is used only if there is no such plane either.
+static struct CursorState {
+    // Size of images set by |doSetCursorImage|.
+    uint32_t width;
+    uint32_t height;
+    // Size images are shown at, which is scaled by display scale (before rotation).
+    uint32_t scaledWidth;
+    uint32_t scaledHeight;
+    struct gbm_bo* cursorBo;
+    // Size of |cursorBo|, which differs from cursor size when screen is rotated by 90 or 270 degrees.
+    uint32_t boWidth;
+    uint32_t boHeight;
+    uint32_t boHandle;
+    uint8_t visible;
+    // Cursor position in screen coordinates (with rotation applied) and its buffer object that is scanned out. Only
+    //  used when cursor plane is driven by atomic commits.
+    int32_t x;
+    int32_t y;
+    struct gbm_bo* committedBo;
+    // Buffer object replaced by |cursorBo| through legacy cursor API, and when it was replaced. Legacy cursor updates
+    //  are not synchronized with vblank, so it may be scanned out until the next one.
+    struct gbm_bo* replacedBo;
+    uint64_t replacedNs;
+    // Whether cursor state was changed since the last commit.
+    uint8_t dirty;
+    // Latest position requested by |doSetLocation| (x in high 32 bits, y in low ones), and whether it was not taken by
+    //  commit thread or by UI commit yet. Accessed atomically, without commit mutex.
+    uint64_t pendingPosition;
+    uint8_t positionPending;
+} cursorState = {
+    .width = 0,
+    .height = 0,
+    .scaledWidth = 0,
+    .scaledHeight = 0,
+    .cursorBo = NULL,
+    .boWidth = 0,
+    .boHeight = 0,
+    .boHandle = 0,
+    .visible = 0,
+    .x = 0,
+    .y = 0,
+    .committedBo = NULL,
+    .replacedBo = NULL,
+    .replacedNs = 0,
+    .dirty = 0,
+    .pendingPosition = 0,
+    .positionPending = 0
+};
+
+static int isEnabled(const char* variable) {
+    const char* value = getenv(variable);
+    if (!value) {
+        return 0;
+    }
+
+    return strcmp(value, "1") == 0 || strcasecmp(value, "true") == 0 || strcasecmp(value, "on") == 0;
+}
+
+static int getEnvInt(const char* variable, int defaultValue) {
+    const char* value = getenv(variable);
+    if (!value || !*value) {
+        return defaultValue;
+    }
+
+    char* end;
+    long result = strtol(value, &end, 10);
+    if (*end) {
+        fprintf(stderr, "Ignoring invalid value \"%s\" of %s environment variable\n", value, variable);
+        return defaultValue;
+    }
+
+    return result;
+}
+
+static double getEnvDouble(const char* variable, double defaultValue) {
+    const char* value = getenv(variable);
+    if (!value || !*value) {
+        return defaultValue;
+    }
+
+    char* end;
+    double result = strtod(value, &end);
+    if (*end || result < 0.) {
+        fprintf(stderr, "Ignoring invalid value \"%s\" of %s environment variable\n", value, variable);
+        return defaultValue;
+    }
+
+    return result;
+}
+
+#define MAX_PROBE_THREADS 8
+
+// Task run for every index by |runParallel|.
+typedef void (*ParallelTask_t)(void* context, uint32_t index);
+
+typedef struct ParallelRun {
+    ParallelTask_t task;
+    void* context;
+    uint32_t count;
+    // Index of the next task to run.
+    uint32_t next;
+} ParallelRun_t;
+
+static void* parallelWorkerMain(void* data) {
+    ParallelRun_t* run = (ParallelRun_t*) data;
+
+    uint32_t index;
+    while ((index = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count) {
+        run->task(run->context, index);
+    }
+
+    return NULL;
+}
+
+// Runs |task| for every index in [0, |count|) on calling thread and up to JFX_EGL_DRM_PROBE_THREADS - 1 other ones.
+//  Returns once all the tasks are done.
+static void runParallel(ParallelTask_t task, void* context, uint32_t count) {
+    ParallelRun_t run = {
+        .task = task,
+        .context = context,
+        .count = count,
+        .next = 0
+    };
+
+    // NB: Startup probing is ioctl bound, there is no point in more threads than cores.
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadsCount = getEnvInt("JFX_EGL_DRM_PROBE_THREADS", cores < 4 ? (cores < 1 ? 1 : cores) : 4);
+    if (threadsCount < 1 || threadsCount > MAX_PROBE_THREADS) {
+        fprintf(stderr, "Probe threads count should be in [1, %i] range, using 1\n", MAX_PROBE_THREADS);
+        threadsCount = 1;
+    }
+    if ((uint32_t) threadsCount > count) {
+        threadsCount = count;
+    }
+
+    pthread_t threads[MAX_PROBE_THREADS];
+    int startedCount = 0;
+    while (startedCount < threadsCount - 1 &&
+            !pthread_create(&threads[startedCount], NULL, parallelWorkerMain, &run)) {
+        ++startedCount;
+    }
+
+    // NB: Calling thread takes the tasks other threads have no time for, or all of them if none was started.
+    parallelWorkerMain(&run);
+
+    for (int i = 0; i < startedCount; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static uint64_t getTimeNs(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
 static void freeDrmProperties(DrmProperties_t* properties) {
+    for (uint32_t i = 0; i < properties->count; ++i) {
+        drmModeFreeProperty(properties->properties[i]);
+    }
+
     if (properties->count) {
         free(properties->properties);
     }
+
+    free(properties->usedIds);
+
+    properties->count = 0;
+    properties->usedIds = NULL;
+}
+
+static uint32_t getPropertyId(DrmProperties_t* properties, const char* name);
+
+// Replaces full properties metadata with ids of properties listed in |usedPropertyNames|.
+static int compactDrmProperties(DrmProperties_t* properties) {
+    uint32_t* usedIds = calloc(USED_PROPERTIES_COUNT, sizeof (uint32_t));
+    if (!usedIds) {
+        fprintf(stderr, "Failed to allocate property ids array\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < USED_PROPERTIES_COUNT; ++i) {
+        usedIds[i] = getPropertyId(properties, usedPropertyNames[i]);
+    }
+
+    freeDrmProperties(properties);
+    properties->usedIds = usedIds;
+    return 0;
+}
+
+static size_t getDrmPropertiesSize(DrmProperties_t* properties) {
+    if (properties->usedIds) {
+        return USED_PROPERTIES_COUNT * sizeof (uint32_t);
+    }
+
+    size_t result = properties->count * sizeof (drmModePropertyPtr);
+
+    for (uint32_t i = 0; i < properties->count; ++i) {
+        drmModePropertyPtr property = properties->properties[i];
+
+        result += sizeof (drmModePropertyRes);
+        result += property->count_values * sizeof (uint64_t);
+        result += property->count_enums * sizeof (struct drm_mode_property_enum);
+        result += property->count_blobs * sizeof (uint32_t);
+    }
+
+    return result;
+}
+
+static void destroySwapchain(Swapchain_t* swapchain, EGLDisplay display);
+static void destroyScanoutBlit(ScanoutBlit_t* blit, EGLDisplay display);
+static void freePlaneInventory(PlaneInventory_t* inventory);
+static void freeCursorBos(DisplayHandle_t* handle);
+static void startHotplugMonitor(DisplayHandle_t* handle);
+static void stopHotplugMonitor(DisplayHandle_t* handle);
+static int isSameMode(const drmModeModeInfo* a, const drmModeModeInfo* b);
+
+// NB: Planes of outputs are owned by plane inventory.
+static void freeOutputs(Output_t* outputs, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        freeDrmProperties(&outputs[i].connectorProperties);
+        freeDrmProperties(&outputs[i].crtcProperties);
+    }
 }
 
 static void freeDisplayHandle(DisplayHandle_t* handle) {
-    if (currentDisplayHandle == handle) {
+    // NB: Cursor buffer objects belong to the current display.
+    const int current = currentDisplayHandle == handle;
+    if (current) {
         currentDisplayHandle = NULL;
     }
 
+    // NB: Hotplug thread makes commits, so it is stopped first.
+    stopHotplugMonitor(handle);
+
+    if (handle->commitThreadStarted) {
+        pthread_mutex_lock(&handle->commitMutex);
+        handle->commitThreadStop = 1;
+        pthread_mutex_unlock(&handle->commitMutex);
+
+        pthread_mutex_lock(&handle->wakeMutex);
+        handle->wakeRequested = 1;
+        pthread_cond_signal(&handle->commitCondition);
+        pthread_mutex_unlock(&handle->wakeMutex);
+
+        pthread_join(handle->commitThread, NULL);
+    }
+
+    if (current) {
+        freeCursorBos(handle);
+    }
+
+    destroySwapchain(&handle->swapchain, handle->display);
+    destroyScanoutBlit(&handle->scanoutBlit, handle->display);
+
     if (handle->display != EGL_NO_DISPLAY) {
         eglTerminate(handle->display);
     }
 
-    gbm_surface_destroy(handle->surface);
+    if (handle->surface) {
+        gbm_surface_destroy(handle->surface);
+    }
+    for (int i = 0; i < MAX_STATIC_LAYERS; ++i) {
+        if (handle->layers[i].bo) {
+            gbm_bo_destroy(handle->layers[i].bo);
+        }
+        if (handle->layers[i].pendingBo) {
+            gbm_bo_destroy(handle->layers[i].pendingBo);
+        }
+    }
     gbm_device_destroy(handle->device);
 
     freeDrmProperties(&handle->connectorProperties);
     freeDrmProperties(&handle->crtcProperties);
-    freeDrmProperties(&handle->planeProperties);
+
+    freeOutputs(handle->outputs, handle->outputsCount);
+
+    if (handle->video.framebufferId) {
+        drmModeRmFB(handle->fd, handle->video.framebufferId);
+    }
+    if (handle->video.pendingFramebufferId) {
+        drmModeRmFB(handle->fd, handle->video.pendingFramebufferId);
+    }
+
+    freePlaneInventory(&handle->planes);
+
+    pthread_cond_destroy(&handle->commitCondition);
+    pthread_mutex_destroy(&handle->wakeMutex);
+    pthread_mutex_destroy(&handle->videoMutex);
+    pthread_mutex_destroy(&handle->commitMutex);
+    pthread_mutex_destroy(&handle->hotplugMutex);
 
     close(handle->fd);
     free(handle);
@@ -77,6 +733,7 @@ static int getProperties(
         uint32_t objectType,
         DrmProperties_t* properties) {
     properties->count = 0;
+    properties->usedIds = NULL;
 
     drmModeObjectPropertiesPtr objectProperties = drmModeObjectGetProperties(fd, objectId, objectType);
     if (!objectProperties) {
@@ -91,7 +748,7 @@ static int getProperties(
     }
 
     properties->properties = malloc(sizeof (drmModePropertyPtr) * objectProperties->count_props);
-    if (!properties) {
+    if (!properties->properties) {
         fprintf(stderr, "Failed to allocate object properties array\n");
         goto err_properties;
     }
@@ -102,7 +759,7 @@ static int getProperties(
             fprintf(stderr, "Failed to get object property(display id: %s, object id: %i, property index: %i): %s\n",
                     displayId, objectId, i, strerror(errno));
 
-            for (i = i - 1; i >= 0; --i) {
+            while (i--) {
                 drmModeFreeProperty(properties->properties[i]);
             }
             goto err_malloc;
@@ -110,6 +767,7 @@ static int getProperties(
     }
 
     properties->count = objectProperties->count_props;
+    drmModeFreeObjectProperties(objectProperties);
     return 0;
 
 err_malloc:
@@ -119,53 +777,308 @@ err_properties:
     return -1;
 }
 
-static drmModeConnectorPtr findConnectedConnector(const char* displayId, int fd, drmModeResPtr resources) {
-    for (int i = 0; i < resources->count_connectors; i++) {
-        drmModeConnectorPtr connector = drmModeGetConnector(fd, resources->connectors[i]);
+// Whether |connector| is named |name|, like "HDMI-A-1" (names are the same as in kernel log and sysfs).
+static int isConnectorNamed(drmModeConnectorPtr connector, const char* name) {
+    const char* typeName = drmModeGetConnectorTypeName(connector->connector_type);
+
+    char connectorName[32];
+    snprintf(connectorName, sizeof (connectorName), "%s-%u", typeName ? typeName : "Unknown",
+             connector->connector_type_id);
+
+    return strcmp(connectorName, name) == 0;
+}
+
+// Finds up to |maxCount| connected connectors with at least one mode. Connectors named by comma separated
+//  JFX_EGL_DRM_CONNECTOR environment variable are returned in the same order, otherwise connectors are returned in
+//  the order they are enumerated in. Returns the number of connectors found.
+static int findConnectedConnectors(
+        const char* displayId,
+        int fd,
+        drmModeResPtr resources,
+        drmModeConnectorPtr* connectors,
+        int maxCount) {
+    char names[256] = "";
+    const char* value = getenv("JFX_EGL_DRM_CONNECTOR");
+    if (value) {
+        snprintf(names, sizeof (names), "%s", value);
+    }
+
+    const char* chosenNames[MAX_OUTPUTS];
+    int chosenCount = 0;
+    char* state = NULL;
+    char* name = strtok_r(names, ",", &state);
+    while (name && chosenCount < maxCount) {
+        chosenNames[chosenCount++] = name;
+        name = strtok_r(NULL, ",", &state);
+    }
+
+    // NB: Connector slots are chosen names indices, or just the order connectors are found in.
+    const int slotsCount = chosenCount ? chosenCount : maxCount;
+    for (int i = 0; i < slotsCount; i++) {
+        connectors[i] = NULL;
+    }
+    int nextSlot = 0;
+
+    if (!resources->count_connectors) {
+        return 0;
+    }
+
+    // NB: Connectors that need forced probe, which reads EDID over DDC and takes tens of milliseconds per connector.
+    uint32_t probeIds[resources->count_connectors];
+    int probeSlots[resources->count_connectors];
+    int probeCount = 0;
+
+    for (int i = 0; i < resources->count_connectors && (chosenCount || nextSlot < slotsCount); i++) {
+        // NB: Current connector state is known unless connector was never probed since boot.
+        drmModeConnectorPtr connector = drmModeGetConnectorCurrent(fd, resources->connectors[i]);
         if (!connector) {
-            fprintf(stderr, "drmModeGetConnector for %s and connector id %d failed: %s\n",
+            fprintf(stderr, "drmModeGetConnectorCurrent for %s and connector id %d failed: %s\n",
                     displayId, resources->connectors[i], strerror(errno));
             continue;
         }
 
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            // TODO: Should we blindly pick up first available connector? Maybe check for environment
-            //  variable or Java system property?
-            if (connector->count_modes > 0) {
-                // We're only intrested in connectors with at least one mode available.
-                return connector;
+        int slot = chosenCount ? -1 : nextSlot;
+        for (int j = 0; j < chosenCount && slot < 0; j++) {
+            if (isConnectorNamed(connector, chosenNames[j])) {
+                slot = j;
             }
         }
 
+        if (slot < 0 || connectors[slot]) {
+            drmModeFreeConnector(connector);
+            continue;
+        }
+
+        if (connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0) {
+            // We're only intrested in connectors with at least one mode available.
+            connectors[slot] = connector;
+            nextSlot += !chosenCount;
+            continue;
+        }
+
+        // NB: Explicitly chosen connector is probed even if it was disconnected last time.
+        if (connector->connection != DRM_MODE_DISCONNECTED || chosenCount) {
+            probeIds[probeCount] = connector->connector_id;
+            probeSlots[probeCount++] = slot;
+        }
+
         drmModeFreeConnector(connector);
     }
 
-    // TODO: check for DRM_MODE_UNKNOWNCONNECTION connectors.
-    return NULL;
+    for (int i = 0; i < probeCount; i++) {
+        const int slot = chosenCount ? probeSlots[i] : nextSlot;
+        if (slot >= slotsCount || connectors[slot]) {
+            continue;
+        }
+
+        drmModeConnectorPtr connector = drmModeGetConnector(fd, probeIds[i]);
+        if (!connector) {
+            fprintf(stderr, "drmModeGetConnector for %s and connector id %d failed: %s\n",
+                    displayId, probeIds[i], strerror(errno));
+            continue;
+        }
+
+        if (connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0) {
+            connectors[slot] = connector;
+            nextSlot += !chosenCount;
+            continue;
+        }
+
+        drmModeFreeConnector(connector);
+    }
+
+    int count = 0;
+    for (int i = 0; i < slotsCount; i++) {
+        if (connectors[i]) {
+            connectors[count++] = connectors[i];
+        } else if (chosenCount) {
+            fprintf(stderr, "Connector %s of display with id %s is not connected\n", chosenNames[i], displayId);
+        }
+    }
+
+    return count;
+}
+
+typedef enum ModePolicy {
+    // Mode marked as preferred by the display, then the largest and the fastest one.
+    MODE_POLICY_PREFERRED = 0,
+    // The largest mode, then the fastest one.
+    MODE_POLICY_RESOLUTION,
+    // The fastest mode, then the largest one.
+    MODE_POLICY_REFRESH,
+    // Mode with refresh rate closest to the target one, then the largest one.
+    MODE_POLICY_RATE
+} ModePolicy_t;
+
+// Mode selection settings. Zero limits are not applied.
+typedef struct ModeConstraints {
+    ModePolicy_t policy;
+    uint64_t targetRefreshMhz;
+    uint32_t maxWidth;
+    uint32_t maxHeight;
+    // Pixel clock in kHz, like |drmModeModeInfo.clock|.
+    uint64_t maxClock;
+    // Scanout bandwidth of 32 bpp UI plane in bytes per second.
+    uint64_t maxBandwidth;
+} ModeConstraints_t;
+
+static void getModeConstraints(ModeConstraints_t* constraints) {
+    memset(constraints, 0, sizeof (ModeConstraints_t));
+
+    const char* policy = getenv("JFX_EGL_DRM_MODE_POLICY");
+    if (!policy || strcmp(policy, "preferred") == 0) {
+        constraints->policy = MODE_POLICY_PREFERRED;
+    } else if (strcmp(policy, "resolution") == 0) {
+        constraints->policy = MODE_POLICY_RESOLUTION;
+    } else if (strcmp(policy, "refresh") == 0) {
+        constraints->policy = MODE_POLICY_REFRESH;
+    } else if (strcmp(policy, "rate") == 0) {
+        constraints->policy = MODE_POLICY_RATE;
+    } else {
+        fprintf(stderr, "Ignoring invalid value \"%s\" of JFX_EGL_DRM_MODE_POLICY environment variable\n", policy);
+    }
+
+    constraints->targetRefreshMhz = getEnvDouble("JFX_EGL_DRM_REFRESH_RATE", 60.) * 1000. + .5;
+    constraints->maxClock = getEnvDouble("JFX_EGL_DRM_MAX_PIXEL_CLOCK", 0.) * 1000.;
+    constraints->maxBandwidth = getEnvDouble("JFX_EGL_DRM_MAX_BANDWIDTH", 0.) * 1000000.;
+
+    const char* maxResolution = getenv("JFX_EGL_DRM_MAX_RESOLUTION");
+    if (maxResolution && sscanf(maxResolution, "%ux%u", &constraints->maxWidth, &constraints->maxHeight) != 2) {
+        fprintf(stderr, "Ignoring invalid value \"%s\" of JFX_EGL_DRM_MAX_RESOLUTION environment variable\n",
+                maxResolution);
+        constraints->maxWidth = 0;
+        constraints->maxHeight = 0;
+    }
+}
+
+// Actual refresh rate of |mode| in millihertz. Nominal |vrefresh| is rounded, so 59.94 Hz modes look like 60 Hz ones.
+static uint64_t getModeRefreshMhz(const drmModeModeInfo* mode) {
+    const uint64_t pixelsPerFrame = (uint64_t) mode->htotal * mode->vtotal;
+    if (!mode->clock || !pixelsPerFrame) {
+        return mode->vrefresh * 1000ull;
+    }
+
+    uint64_t result = mode->clock * 1000000ull / pixelsPerFrame;
+    if (mode->flags & DRM_MODE_FLAG_INTERLACE) {
+        result *= 2;
+    }
+    if (mode->flags & DRM_MODE_FLAG_DBLSCAN) {
+        result /= 2;
+    }
+    if (mode->vscan > 1) {
+        result /= mode->vscan;
+    }
+
+    return result;
+}
+
+static int isModeAllowed(const drmModeModeInfo* mode, const ModeConstraints_t* constraints) {
+    if (constraints->maxWidth && (mode->hdisplay > constraints->maxWidth || mode->vdisplay > constraints->maxHeight)) {
+        return 0;
+    }
+
+    if (constraints->maxClock && mode->clock > constraints->maxClock) {
+        return 0;
+    }
+
+    const uint64_t bandwidth = (uint64_t) mode->hdisplay * mode->vdisplay * 4 * getModeRefreshMhz(mode) / 1000;
+    return !constraints->maxBandwidth || bandwidth <= constraints->maxBandwidth;
+}
+
+// Positive if |mode| is better than |other| according to |constraints| policy, negative if it is worse.
+static int64_t compareModes(
+        const drmModeModeInfo* mode,
+        const drmModeModeInfo* other,
+        const ModeConstraints_t* constraints) {
+    const int64_t pixels = (int64_t) mode->hdisplay * mode->vdisplay - (int64_t) other->hdisplay * other->vdisplay;
+    const int64_t refresh = (int64_t) getModeRefreshMhz(mode) - (int64_t) getModeRefreshMhz(other);
+    const int64_t preferred =
+            !!(mode->type & DRM_MODE_TYPE_PREFERRED) - !!(other->type & DRM_MODE_TYPE_PREFERRED);
+
+    switch (constraints->policy) {
+    case MODE_POLICY_RESOLUTION:
+        return pixels ? pixels : refresh ? refresh : preferred;
+    case MODE_POLICY_REFRESH:
+        return refresh ? refresh : pixels ? pixels : preferred;
+    case MODE_POLICY_RATE: {
+        // NB: 59.94 Hz is not a match for 60 Hz content, and 50 Hz content judders on both.
+        const int64_t target = constraints->targetRefreshMhz;
+        const int64_t distance = llabs((int64_t) getModeRefreshMhz(mode) - target);
+        const int64_t otherDistance = llabs((int64_t) getModeRefreshMhz(other) - target);
+        return distance != otherDistance ? otherDistance - distance : pixels ? pixels : preferred;
+    }
+    case MODE_POLICY_PREFERRED:
+    default:
+        return preferred ? preferred : pixels ? pixels : refresh;
+    }
 }
 
+// Chooses mode of |connector| according to JFX_EGL_DRM_MODE_POLICY and mode limits. Connector has at least one mode.
 static drmModeModeInfoPtr findPreferredMode(drmModeConnectorPtr connector) {
-    // NB: Use mode with highest resolution if no preferred mode found.
-    int chosenPixelsCount = 0;
+    ModeConstraints_t constraints;
+    getModeConstraints(&constraints);
+
     drmModeModeInfoPtr chosenMode = NULL;
+    // NB: Mode that is the most likely to work when no mode fits the limits.
+    drmModeModeInfoPtr slowestMode = NULL;
 
     for (int i = 0; i < connector->count_modes; ++i) {
         drmModeModeInfoPtr mode = &connector->modes[i];
 
-        if (mode->type & DRM_MODE_TYPE_PREFERRED) {
-            return mode;
+        if (!slowestMode || mode->clock < slowestMode->clock) {
+            slowestMode = mode;
         }
 
-        const int pixelsCount = mode->hdisplay * mode->vdisplay;
-        if (pixelsCount > chosenPixelsCount) {
-            chosenPixelsCount = pixelsCount;
+        if (isModeAllowed(mode, &constraints) && (!chosenMode || compareModes(mode, chosenMode, &constraints) > 0)) {
             chosenMode = mode;
         }
     }
 
+    if (!chosenMode) {
+        fprintf(stderr, "No mode of connector with id %i fits mode limits, using %ux%u mode with the lowest "
+                "pixel clock\n", connector->connector_id, slowestMode->hdisplay, slowestMode->vdisplay);
+        return slowestMode;
+    }
+
     return chosenMode;
 }
 
+// Chooses mode of additional display |connector|. All the displays flip together with a single blocking commit, which
+//  waits for the slowest CRTC, so a mode of the chosen size that is at least as fast as |mainMode| is preferred.
+static drmModeModeInfoPtr findOutputMode(drmModeConnectorPtr connector, const drmModeModeInfo* mainMode) {
+    drmModeModeInfoPtr chosenMode = findPreferredMode(connector);
+
+    // NB: Slightly slower display (like 59.94 Hz one next to 60 Hz one) delays a frame every few seconds only.
+    const uint64_t minRefreshMhz = getModeRefreshMhz(mainMode) * 99 / 100;
+    if (getModeRefreshMhz(chosenMode) >= minRefreshMhz) {
+        return chosenMode;
+    }
+
+    ModeConstraints_t constraints;
+    getModeConstraints(&constraints);
+
+    drmModeModeInfoPtr fastMode = NULL;
+    for (int i = 0; i < connector->count_modes; ++i) {
+        drmModeModeInfoPtr mode = &connector->modes[i];
+        const uint64_t refreshMhz = getModeRefreshMhz(mode);
+
+        if (mode->hdisplay == chosenMode->hdisplay && mode->vdisplay == chosenMode->vdisplay &&
+                refreshMhz >= minRefreshMhz && isModeAllowed(mode, &constraints) &&
+                (!fastMode || refreshMhz < getModeRefreshMhz(fastMode))) {
+            fastMode = mode;
+        }
+    }
+
+    if (!fastMode) {
+        fprintf(stderr, "Display of connector with id %i has no %ux%u mode as fast as the main display, frame rate is "
+                "limited to its %.2f Hz\n", connector->connector_id, chosenMode->hdisplay, chosenMode->vdisplay,
+                getModeRefreshMhz(chosenMode) / 1000.);
+        return chosenMode;
+    }
+
+    return fastMode;
+}
+
 static drmModeEncoderPtr findEncoder(
         const char *displayId,
         int fd,
@@ -221,41 +1134,237 @@ static drmModeCrtcPtr findCrtc(
     return NULL;
 }
 
-static uint64_t getPropertyValue(
-        const char* displayId,
-        int fd,
-        uint32_t objectId,
-        uint32_t objectType,
-        DrmProperties_t* properties,
-        const char *name) {
-    for (uint32_t i = 0; i < properties->count; ++i) {
-        if (strcmp(properties->properties[i]->name, name) == 0) {
-            drmModeObjectPropertiesPtr objectProperties = drmModeObjectGetProperties(fd, objectId, objectType);
-            if (!objectProperties) {
-                fprintf(stderr, "Failed to get object properties(display id: %s, object id: %i): %s\n",
-                        displayId, objectId, strerror(errno));
-                return 0;
+// Finds index of a CRTC that can drive |connector| and is not in |usedCrtcs| mask. Returns -1 if there is none.
+static int findFreeCrtc(const char* displayId, int fd, drmModeResPtr resources, drmModeConnectorPtr connector,
+                        uint32_t usedCrtcs) {
+    // NB: CRTC that already drives the connector is preferred, it is likely to have the right clock set up.
+    drmModeEncoderPtr encoder = connector->encoder_id ? drmModeGetEncoder(fd, connector->encoder_id) : NULL;
+    if (encoder) {
+        for (int i = 0; i < resources->count_crtcs; ++i) {
+            if (resources->crtcs[i] == encoder->crtc_id && !(usedCrtcs & (1u << i))) {
+                drmModeFreeEncoder(encoder);
+                return i;
             }
+        }
+        drmModeFreeEncoder(encoder);
+    }
+
+    for (int i = 0; i < connector->count_encoders; ++i) {
+        encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+        if (!encoder) {
+            fprintf(stderr, "drmModeGetEncoder for %s and encoder id %d failed: %s\n",
+                    displayId, connector->encoders[i], strerror(errno));
+            continue;
+        }
 
-            uint64_t result = objectProperties->prop_values[i];
-            drmModeFreeObjectProperties(objectProperties);
-            return result;
+        const uint32_t possibleCrtcs = encoder->possible_crtcs & ~usedCrtcs;
+        drmModeFreeEncoder(encoder);
+
+        for (int j = 0; j < resources->count_crtcs && j < 32; ++j) {
+            if (possibleCrtcs & (1u << j)) {
+                return j;
+            }
         }
     }
 
-    return 0;
+    return -1;
 }
 
-typedef struct Modifiers {
-    uint64_t* modifiers;
-    unsigned int modifiersCount;
-} Modifiers_t;
+// Sets the part of |output| the picture is shown in. Mirrored |pictureWidth|x|pictureHeight| picture keeps its aspect
+//  ratio, CRTC background fills the rest of the display. Mirroring planes scan out the main display picture the way
+//  its plane does, so the picture is of the main display mode size even when the screen is rotated.
+static void placeOutputPicture(Output_t* output, int clone, uint32_t pictureWidth, uint32_t pictureHeight) {
+    const uint32_t width = output->mode.hdisplay;
+    const uint32_t height = output->mode.vdisplay;
 
-static Modifiers_t getPlaneFormatModifiers(int fd, uint32_t blobId, uint32_t drmFormat) {
-    drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blobId);
+    output->crtcWidth = width;
+    output->crtcHeight = height;
 
-    Modifiers_t result = {
-        .modifiers = NULL,
+    if (clone) {
+        if ((uint64_t) width * pictureHeight <= (uint64_t) height * pictureWidth) {
+            output->crtcHeight = (uint64_t) width * pictureHeight / pictureWidth;
+        } else {
+            output->crtcWidth = (uint64_t) height * pictureWidth / pictureHeight;
+        }
+    }
+
+    output->crtcX = (width - output->crtcWidth) / 2;
+    output->crtcY = (height - output->crtcHeight) / 2;
+}
+
+// Lays out |outputs| next to the main display of |mode|, and sets |desktopWidth|x|desktopHeight| desktop size.
+//  Displays are laid out left to right and aligned to the bottom of the desktop, which is GL viewport origin. Own
+//  swapchain buffers are laid out the same way window surface ones are. So every display scans out its own columns,
+//  ending at the last row of buffers. Mirroring displays scan out what the main display does.
+static void layOutOutputs(
+        Output_t* outputs,
+        uint32_t outputsCount,
+        int clone,
+        const drmModeModeInfo* mode,
+        uint32_t* desktopWidth,
+        uint32_t* desktopHeight) {
+    *desktopWidth = mode->hdisplay;
+    *desktopHeight = mode->vdisplay;
+
+    for (uint32_t i = 0; i < outputsCount; ++i) {
+        Output_t* output = &outputs[i];
+        placeOutputPicture(output, clone, mode->hdisplay, mode->vdisplay);
+
+        output->x = clone ? 0 : *desktopWidth;
+        output->y = 0;
+        if (!clone) {
+            *desktopWidth += output->mode.hdisplay;
+            if (*desktopHeight < output->mode.vdisplay) {
+                *desktopHeight = output->mode.vdisplay;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < outputsCount && !clone; ++i) {
+        outputs[i].y = *desktopHeight - outputs[i].mode.vdisplay;
+    }
+}
+
+static uint64_t getPropertyValue(
+        const char* displayId,
+        int fd,
+        uint32_t objectId,
+        uint32_t objectType,
+        DrmProperties_t* properties,
+        const char *name) {
+    const uint32_t propertyId = getPropertyId(properties, name);
+    if (!propertyId) {
+        return 0;
+    }
+
+    drmModeObjectPropertiesPtr objectProperties = drmModeObjectGetProperties(fd, objectId, objectType);
+    if (!objectProperties) {
+        fprintf(stderr, "Failed to get object properties(display id: %s, object id: %i): %s\n",
+                displayId, objectId, strerror(errno));
+        return 0;
+    }
+
+    uint64_t result = 0;
+    for (uint32_t i = 0; i < objectProperties->count_props; ++i) {
+        if (objectProperties->props[i] == propertyId) {
+            result = objectProperties->prop_values[i];
+            break;
+        }
+    }
+
+    drmModeFreeObjectProperties(objectProperties);
+    return result;
+}
+
+// NB: Full properties metadata is only available during initialization in low memory mode.
+static drmModePropertyPtr findProperty(DrmProperties_t* properties, const char* name) {
+    for (uint32_t i = 0; i < properties->count; ++i) {
+        if (strcmp(properties->properties[i]->name, name) == 0) {
+            return properties->properties[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns zero if there is no property with such name.
+static uint32_t getPropertyId(DrmProperties_t* properties, const char* name) {
+    if (properties->usedIds) {
+        for (uint32_t i = 0; i < USED_PROPERTIES_COUNT; ++i) {
+            if (strcmp(usedPropertyNames[i], name) == 0) {
+                return properties->usedIds[i];
+            }
+        }
+
+        return 0;
+    }
+
+    drmModePropertyPtr property = findProperty(properties, name);
+    return property ? property->prop_id : 0;
+}
+
+// Returns mask of bits supported by bitmask property (like "rotation"), or zero if there is no such property.
+static uint64_t getSupportedBits(DrmProperties_t* properties, const char* name) {
+    drmModePropertyPtr property = findProperty(properties, name);
+    if (!property || !(property->flags & DRM_MODE_PROP_BITMASK)) {
+        return 0;
+    }
+
+    uint64_t result = 0;
+    for (int i = 0; i < property->count_enums; ++i) {
+        result |= 1ull << property->enums[i].value;
+    }
+
+    return result;
+}
+
+// Returns "rotation" property value that rotates plane by |rotation| degrees counter-clockwise. Returns zero if plane
+//  is unable to do so.
+static uint64_t getPlaneRotation(PlaneInfo_t* plane, uint32_t rotation) {
+    const uint64_t rotate = DRM_MODE_ROTATE_0 << (rotation / 90);
+    return plane->rotations & rotate ? rotate : 0;
+}
+
+// Maps |width|x|height| rectangle at (|x|, |y|) of |screenWidth|x|screenHeight| area to the same area rotated by
+//  |rotation| degrees counter-clockwise.
+static void rotateRect(
+        uint32_t rotation,
+        uint32_t screenWidth,
+        uint32_t screenHeight,
+        int32_t* x,
+        int32_t* y,
+        uint32_t* width,
+        uint32_t* height) {
+    const int32_t rectX = *x;
+    const int32_t rectY = *y;
+    const uint32_t rectWidth = *width;
+    const uint32_t rectHeight = *height;
+
+    switch (rotation) {
+    case 90:
+        *x = rectY;
+        *y = (int32_t) screenWidth - rectX - (int32_t) rectWidth;
+        break;
+    case 180:
+        *x = (int32_t) screenWidth - rectX - (int32_t) rectWidth;
+        *y = (int32_t) screenHeight - rectY - (int32_t) rectHeight;
+        break;
+    case 270:
+        *x = (int32_t) screenHeight - rectY - (int32_t) rectHeight;
+        *y = rectX;
+        break;
+    default:
+        return;
+    }
+
+    if (rotation != 180) {
+        *width = rectHeight;
+        *height = rectWidth;
+    }
+}
+
+// Returns screen rotation set by |JFX_EGL_DRM_ROTATION| environment variable.
+static uint32_t getRequestedRotation(void) {
+    const int rotation = getEnvInt("JFX_EGL_DRM_ROTATION", 0);
+
+    if (rotation < 0 || rotation >= 360 || rotation % 90) {
+        fprintf(stderr, "Rotation should be one of 0, 90, 180 and 270 degrees, using 0\n");
+        return 0;
+    }
+
+    return rotation;
+}
+
+typedef struct Modifiers {
+    uint64_t* modifiers;
+    unsigned int modifiersCount;
+} Modifiers_t;
+
+static Modifiers_t getPlaneFormatModifiers(int fd, uint32_t blobId, uint32_t drmFormat) {
+    drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blobId);
+
+    Modifiers_t result = {
+        .modifiers = NULL,
         .modifiersCount = 0
     };
 
@@ -304,423 +1413,412 @@ out:
     return result;
 }
 
-/**
- * Get a handle to the native window (without specifying what window is)
- *
- * This one should return a handle (an opaque pointer) that will be passed to |doEglCreateWindowSurface| as third
- * argument.
- */
-jlong getNativeWindowHandle(const char* displayId) {
-    if (!displayId) {
-        goto err;
-    }
-
-    int fd = open(displayId, O_RDWR);
-
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open %s: %s\n", displayId, strerror(errno));
-        goto err;
-    }
+// Value of |properties| property |name| in |values| of the same object, or zero if there is no such property.
+static uint64_t findPropertyValue(
+        drmModeObjectPropertiesPtr values,
+        DrmProperties_t* properties,
+        const char* name) {
+    const uint32_t propertyId = getPropertyId(properties, name);
 
-    drmModeResPtr resources = drmModeGetResources(fd);
-    if (!resources) {
-        if (errno == EOPNOTSUPP) {
-            fprintf(stderr, "%s is not a valid display id: %s\n", displayId, strerror(errno));
-        } else {
-            fprintf(stderr, "drmModeGetResources for %s failed: %s\n", displayId, strerror(errno));
+    for (uint32_t i = 0; propertyId && i < values->count_props; ++i) {
+        if (values->props[i] == propertyId) {
+            return values->prop_values[i];
         }
-        goto err_close_fd;
     }
 
-    if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
-        fprintf(stderr, "Atomic modesetting is not supported by display with id %s\n", displayId);
-        goto err_close_fd;
-    }
-
-    drmModeConnectorPtr connector = findConnectedConnector(displayId, fd, resources);
-    if (!connector) {
-        goto err_free_resources;
-    }
-
-    drmModeModeInfoPtr mode = findPreferredMode(connector);
-    assert(mode);
+    return 0;
+}
 
-    DrmProperties_t connectorProperties;
-    if (getProperties(displayId, fd, connector->connector_id, DRM_MODE_OBJECT_CONNECTOR, &connectorProperties)) {
-        goto err_free_connector;
+// Collects capabilities of plane |planeId| into |info|. Returns non-zero if plane can't be used.
+static int probePlane(const char* displayId, int fd, uint32_t planeId, PlaneInfo_t* info) {
+    drmModePlanePtr plane = drmModeGetPlane(fd, planeId);
+    if (!plane) {
+        fprintf(stderr, "drmModeGetPlane for %s and plane id %d failed: %s\n", displayId, planeId, strerror(errno));
+        return -1;
     }
 
-    drmModeEncoderPtr encoder = findEncoder(displayId, fd, resources, connector);
-    if (!encoder) {
-        goto err_free_connector;
+    if (getProperties(displayId, fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, &info->properties)) {
+        goto err_free_plane;
     }
 
-    if (!encoder->crtc_id) {
-        fprintf(stderr, "No CRTC for encoder with id %d (display id: %s)\n", encoder->encoder_id, displayId);
-        goto err_free_encoder;
+    // NB: Property values are fetched once for all the properties read below.
+    drmModeObjectPropertiesPtr values = drmModeObjectGetProperties(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+    if (!values) {
+        fprintf(stderr, "Failed to get object properties(display id: %s, object id: %i): %s\n",
+                displayId, plane->plane_id, strerror(errno));
+        goto err_free_properties;
     }
 
-    drmModeCrtcPtr crtc = findCrtc(displayId, fd, resources, encoder);
-    if (!crtc) {
-        goto err_free_encoder;
+    info->formats = malloc(sizeof (uint32_t) * plane->count_formats);
+    if (!info->formats && plane->count_formats) {
+        fprintf(stderr, "Failed to allocate plane formats array\n");
+        goto err_free_values;
     }
 
-    DrmProperties_t crtcProperties;
-    if (getProperties(displayId, fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, &crtcProperties)) {
-        goto err_free_crtc;
+    memcpy(info->formats, plane->formats, sizeof (uint32_t) * plane->count_formats);
+    info->formatsCount = plane->count_formats;
+    info->planeId = plane->plane_id;
+    info->possibleCrtcs = plane->possible_crtcs;
+    info->crtcId = plane->crtc_id;
+
+    DrmProperties_t* properties = &info->properties;
+    info->type = findPropertyValue(values, properties, "type");
+    info->inFormatsBlobId = findPropertyValue(values, properties, "IN_FORMATS");
+
+    drmModePropertyPtr zpos = findProperty(properties, "zpos");
+    if (zpos) {
+        info->hasZpos = 1;
+        info->zposMutable = !(zpos->flags & DRM_MODE_PROP_IMMUTABLE);
+        info->zpos = findPropertyValue(values, properties, "zpos");
+        info->zposMin = zpos->count_values == 2 ? zpos->values[0] : info->zpos;
+        info->zposMax = zpos->count_values == 2 ? zpos->values[1] : info->zpos;
     }
 
-    drmModeFreeResources(resources);
+    info->rotations = getSupportedBits(properties, "rotation");
+    info->mayScaleByType = info->type != DRM_PLANE_TYPE_CURSOR;
+    info->hasAlpha = getPropertyId(properties, "alpha") != 0;
 
-    // TODO: We're choosing plane that is currently active. It is not quite correct.
-    drmModePlanePtr plane = NULL;
-    {
-        if (!crtc->buffer_id) {
-            fprintf(stderr, "No framebuffer for CRTC with id %d (display id: %s)\n", crtc->crtc_id, displayId);
-            goto err_free_crtc;
+    drmModePropertyPtr blendMode = findProperty(properties, "pixel blend mode");
+    for (int j = 0; blendMode && j < blendMode->count_enums; ++j) {
+        for (int k = 0; k < PLANE_BLEND_MODES_COUNT; ++k) {
+            if (strcmp(blendMode->enums[j].name, planeBlendModeNames[k]) == 0) {
+                info->blendModes |= 1 << k;
+                info->blendModeValues[k] = blendMode->enums[j].value;
+            }
         }
+    }
 
-        drmModePlaneResPtr planeResources = drmModeGetPlaneResources(fd);
-        if (!planeResources) {
-            fprintf(stderr, "drmModeGetPlaneResources for %s failed: %s\n", displayId, strerror(errno));
-            drmModeFreePlaneResources(planeResources);
-            goto err_free_crtc;
-        }
+    info->blendMode = PLANE_BLEND_MODES_COUNT;
+    if (blendMode) {
+        info->blendModeMutable = !(blendMode->flags & DRM_MODE_PROP_IMMUTABLE);
 
-        for (uint32_t i = 0; i < planeResources->count_planes; ++i) {
-            drmModePlanePtr currentPlane = drmModeGetPlane(fd, planeResources->planes[i]);
-            if (!currentPlane) {
-                fprintf(stderr, "drmModeGetPlane for %s and plane id %d failed: %s\n",
-                        displayId, planeResources->planes[i], strerror(errno));
-                continue;
+        const uint64_t value = findPropertyValue(values, properties, "pixel blend mode");
+        for (int k = 0; k < PLANE_BLEND_MODES_COUNT; ++k) {
+            if ((info->blendModes & (1 << k)) && info->blendModeValues[k] == value) {
+                info->blendMode = k;
             }
+        }
+    }
 
-            if (currentPlane->crtc_id == crtc->crtc_id &&
-                currentPlane->fb_id == crtc->buffer_id) {
-                    plane = currentPlane;
-                    break;
-            }
+    info->owner = PLANE_OWNER_NONE;
 
-            drmModeFreePlane(currentPlane);
-        }
+    drmModeFreeObjectProperties(values);
+    drmModeFreePlane(plane);
+    return 0;
 
-        drmModeFreePlaneResources(planeResources);
+err_free_values:
+    drmModeFreeObjectProperties(values);
+err_free_properties:
+    freeDrmProperties(&info->properties);
+err_free_plane:
+    drmModeFreePlane(plane);
+    return -1;
+}
 
-        if (!plane) {
-            fprintf(stderr, "Failed to find plane for framebuffer with id %d (display id: %s)\n",
-                    crtc->crtc_id, displayId);
-            goto err_free_crtc;
-        }
-    }
+typedef struct PlanesProbe {
+    const char* displayId;
+    int fd;
+    drmModePlaneResPtr planeResources;
+    PlaneInfo_t* planes;
+    // Non-zero for planes that can't be used.
+    int* results;
+} PlanesProbe_t;
+
+static void probePlaneTask(void* context, uint32_t index) {
+    PlanesProbe_t* probe = (PlanesProbe_t*) context;
+    probe->results[index] =
+            probePlane(probe->displayId, probe->fd, probe->planeResources->planes[index], &probe->planes[index]);
+}
 
-    DrmProperties_t planeProperties;
-    if (getProperties(displayId, fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, &planeProperties)) {
-        goto err_free_plane;
+static int buildPlaneInventory(const char* displayId, int fd, PlaneInventory_t* inventory) {
+    inventory->planes = NULL;
+    inventory->count = 0;
+    inventory->fd = fd;
+    inventory->displayId = displayId;
+
+    drmModePlaneResPtr planeResources = drmModeGetPlaneResources(fd);
+    if (!planeResources) {
+        fprintf(stderr, "drmModeGetPlaneResources for %s failed: %s\n", displayId, strerror(errno));
+        return -1;
     }
 
-    struct gbm_device* gbmDevice = gbm_create_device(fd);
-    if (!gbmDevice) {
-        fprintf(stderr, "Failed to create GBM device for display with id %s: %s\n",
-                displayId, strerror(errno));
-        goto err_free_plane;
+    inventory->planes = calloc(planeResources->count_planes, sizeof (PlaneInfo_t));
+    int* results = calloc(planeResources->count_planes, sizeof (int));
+    if ((!inventory->planes || !results) && planeResources->count_planes) {
+        fprintf(stderr, "Failed to allocate planes array\n");
+        free(results);
+        free(inventory->planes);
+        inventory->planes = NULL;
+        drmModeFreePlaneResources(planeResources);
+        return -1;
     }
 
-    uint64_t inFormatsId = getPropertyValue(
-                displayId,
-                fd,
-                plane->plane_id,
-                DRM_MODE_OBJECT_PLANE,
-                &planeProperties,
-                "IN_FORMATS"
-    );
-    Modifiers_t modifiers = {
-        .modifiers = NULL,
-        .modifiersCount = 0
+    // NB: Every plane costs a few dozens of ioctls, which do not contend with each other in the kernel.
+    PlanesProbe_t probe = {
+        .displayId = displayId,
+        .fd = fd,
+        .planeResources = planeResources,
+        .planes = inventory->planes,
+        .results = results
     };
+    runParallel(probePlaneTask, &probe, planeResources->count_planes);
 
-    if (inFormatsId) {
-        modifiers = getPlaneFormatModifiers(fd, inFormatsId, DRM_FORMAT_ARGB8888);
+    // NB: Planes keep their enumeration order, which allocation relies on.
+    for (uint32_t i = 0; i < planeResources->count_planes; ++i) {
+        if (!results[i]) {
+            inventory->planes[inventory->count++] = inventory->planes[i];
+        }
     }
 
-    struct gbm_surface* surface;
+    free(results);
+    drmModeFreePlaneResources(planeResources);
+    return 0;
+}
 
-    if (modifiers.modifiersCount) {
-        surface = gbm_surface_create_with_modifiers(
-                    gbmDevice,
-                    mode->hdisplay,
-                    mode->vdisplay,
-                    DRM_FORMAT_ARGB8888,
-                    modifiers.modifiers,
-                    modifiers.modifiersCount
-        );
-        free(modifiers.modifiers);
-    } else {
-        surface = gbm_surface_create(
-                    gbmDevice,
-                    mode->hdisplay,
-                    mode->vdisplay,
-                    DRM_FORMAT_ARGB8888,
-                    GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT
-        );
+static void freePlaneInventory(PlaneInventory_t* inventory) {
+    for (uint32_t i = 0; i < inventory->count; ++i) {
+        free(inventory->planes[i].formats);
+        freeDrmProperties(&inventory->planes[i].properties);
     }
 
-    if (!surface) {
-        fprintf(stderr, "Failed to create GBM surface for display with id %s: %s\n",
-                displayId, strerror(errno));
-        goto err_destroy_device;
+    free(inventory->planes);
+    inventory->planes = NULL;
+    inventory->count = 0;
+}
+
+static int isPlaneSuitable(const PlaneInfo_t* plane, uint32_t crtcIndex, uint64_t type, uint32_t format) {
+    if (plane->owner != PLANE_OWNER_NONE || plane->type != type || !(plane->possibleCrtcs & (1 << crtcIndex))) {
+        return 0;
     }
 
-    DisplayHandle_t* handle = malloc(sizeof (DisplayHandle_t));
-    if (!handle) {
-        fprintf(stderr, "Failed to allocate NativeWindowHandle struct\n");
-        goto err_destroy_surface;
+    for (uint32_t i = 0; i < plane->formatsCount; ++i) {
+        if (plane->formats[i] == format) {
+            return 1;
+        }
     }
 
-    handle->connectorId = connector->connector_id;
-    handle->connectorProperties = connectorProperties;
-    handle->encoderId = encoder->encoder_id;
-    handle->crtcId = crtc->crtc_id;
-    handle->crtcProperties = crtcProperties;
-    handle->planeId = plane->plane_id;
-    handle->planeProperties = planeProperties;
-    handle->fd = fd;
-    handle->device = gbmDevice;
-    handle->surface = surface;
-    handle->display = EGL_NO_DISPLAY;
-    handle->previousBo = NULL;
-    handle->doModeset = 1;
+    return 0;
+}
 
-    memcpy(&handle->mode, mode, sizeof (drmModeModeInfo));
+// Probes |plane| restored from topology cache, replacing its cached info. TEST_ONLY commit that validates the cache
+//  checks the main display plane only, so other planes are probed once they are chosen for something. Returns non-zero
+//  if plane can't be used anymore.
+static int probeCachedPlane(PlaneInventory_t* inventory, PlaneInfo_t* plane) {
+    PlaneInfo_t info;
+    memset(&info, 0, sizeof (PlaneInfo_t));
 
-    currentDisplayHandle = handle;
+    const int result = probePlane(inventory->displayId, inventory->fd, plane->planeId, &info);
 
-    drmModeFreePlane(plane);
-    drmModeFreeCrtc(crtc);
-    drmModeFreeEncoder(encoder);
-    drmModeFreeConnector(connector);
+    free(plane->formats);
+    freeDrmProperties(&plane->properties);
 
-    return (jlong) surface;
+    if (result) {
+        // NB: Plane stays in the inventory, it is just never suitable.
+        memset(plane, 0, sizeof (PlaneInfo_t));
+        return -1;
+    }
 
-err_destroy_surface:
-    gbm_surface_destroy(surface);
-err_destroy_device:
-    gbm_device_destroy(gbmDevice);
-err_free_plane:
-    drmModeFreePlane(plane);
-err_free_crtc:
-    drmModeFreeCrtc(crtc);
-err_free_encoder:
-    drmModeFreeEncoder(encoder);
-err_free_connector:
-    drmModeFreeConnector(connector);
-err_free_resources:
-    drmModeFreeResources(resources);
-err_close_fd:
-    close(fd);
-err:
-    return (jlong) NULL;
+    // NB: Capabilities are decoded already, and only ids of properties are used after initialization.
+    compactDrmProperties(&info.properties);
+    info.owner = plane->owner;
+    *plane = info;
+    return 0;
 }
 
-/**
- * Get a handle to the EGL display
- */
-jlong getEglDisplayHandle() {
-    DisplayHandle_t* handle = currentDisplayHandle;
+// Hands out a free plane of given type that can be used with CRTC |crtcId| at |crtcIndex| and supports given format.
+//  The plane already bound to the CRTC is preferred, as switching to it needs no plane reassignment by the driver and
+//  keeps firmware splash on the same plane.
+static PlaneInfo_t* allocatePlane(
+        PlaneInventory_t* inventory,
+        uint32_t crtcIndex,
+        uint32_t crtcId,
+        uint64_t type,
+        uint32_t format,
+        PlaneOwner_t owner) {
+    PlaneInfo_t* found;
+
+    // NB: Plane restored from topology cache is chosen by its cached info, and the choice is made again if probed info
+    //  differs.
+    do {
+        found = NULL;
+        for (uint32_t i = 0; i < inventory->count; ++i) {
+            PlaneInfo_t* plane = &inventory->planes[i];
+            if (!isPlaneSuitable(plane, crtcIndex, type, format)) {
+                continue;
+            }
 
-    if (!handle) {
-        return (jlong) NULL;
-    }
+            if (plane->crtcId == crtcId) {
+                found = plane;
+                break;
+            }
 
-    if (handle->display == EGL_NO_DISPLAY) {
-        handle->display = eglGetDisplay((EGLNativeDisplayType) currentDisplayHandle->device);
-    }
+            if (!found) {
+                found = plane;
+            }
+        }
+    } while (found && found->cached &&
+            (probeCachedPlane(inventory, found) || !isPlaneSuitable(found, crtcIndex, type, format)));
 
-    if (handle->display == EGL_NO_DISPLAY) {
-        fprintf(stderr, "Failed to get EGL display\n");
-        freeDisplayHandle(handle);
-        return (jlong) NULL;
+    if (found) {
+        found->owner = owner;
     }
 
-    return (jlong) handle;
+    return found;
 }
 
-/**
- * Initialize the EGL system with the specified handle
- */
-jboolean doEglInitialize(void* displayHandle) {
-    if (!displayHandle) {
-        return JNI_FALSE;
+static void releasePlane(PlaneInfo_t* plane) {
+    plane->owner = PLANE_OWNER_NONE;
+}
+
+static uint32_t getCursorCap(int fd, uint64_t capability) {
+    uint64_t value = 0;
+    // NB: Drivers that do not report cursor size support 64x64 cursors.
+    if (drmGetCap(fd, capability, &value) || !value) {
+        return 64;
     }
 
-    DisplayHandle_t* handle = (DisplayHandle_t*) displayHandle;
-    EGLBoolean result = eglInitialize(handle->display, NULL, NULL);
-
-    if (result == EGL_FALSE) {
-        fprintf(stderr, "EGL initialization failed\n");
-        freeDisplayHandle(handle);
-    }
-
-    return result;
+    return value;
 }
 
-/**
- * Bind a specific API to the EGL system
- */
-jboolean doEglBindApi(int api) {
-    EGLBoolean result = eglBindAPI(api);
+#ifdef PRE_MULTIPLY_CURSOR
+#define DEFAULT_PREMULTIPLY_CURSOR 1
+#else
+#define DEFAULT_PREMULTIPLY_CURSOR 0
+#endif
 
-    if (result == EGL_FALSE) {
-        fprintf(stderr, "Failed to bind EGL API\n");
+// Chooses how cursor plane blends cursor images, which come with straight alpha. Sets |premultiply| if images have to
+//  be premultiplied. Returns blend mode that should be set on the plane, or |PLANE_BLEND_MODES_COUNT| if plane blend
+//  mode should be left intact.
+static PlaneBlendMode_t chooseCursorBlendMode(PlaneInfo_t* plane, uint8_t* premultiply) {
+    // NB: Coverage blending needs no premultiplication at all.
+    PlaneBlendMode_t preferred = PLANE_BLEND_MODE_COVERAGE;
+    int forced = 0;
+
+    const char* value = getenv("JFX_EGL_DRM_CURSOR_BLEND_MODE");
+    if (value && strcasecmp(value, "premultiplied") == 0) {
+        preferred = PLANE_BLEND_MODE_PREMULTIPLIED;
+        forced = 1;
+    } else if (value && strcasecmp(value, "coverage") == 0) {
+        forced = 1;
+    } else if (value) {
+        fprintf(stderr, "Ignoring invalid value \"%s\" of JFX_EGL_DRM_CURSOR_BLEND_MODE environment variable\n", value);
     }
 
-    return result;
-}
-
-/**
- * Instruct the system to choose an EGL configuration matching the provided attributes
- */
-jlong doEglChooseConfig(jlong eglDisplay, int* attribs) {
-    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
-    if (!handle) {
-        return -1;
+    if (!plane || plane->blendMode == PLANE_BLEND_MODES_COUNT) {
+        // NB: Blending is driver specific without "pixel blend mode" property, so build time default is used unless
+        //  told otherwise.
+        *premultiply = forced ? preferred == PLANE_BLEND_MODE_PREMULTIPLIED : DEFAULT_PREMULTIPLY_CURSOR;
+        return PLANE_BLEND_MODES_COUNT;
     }
 
-    EGLDisplay display = handle->display;
-
-    EGLint configsCount;
-
-    if (!eglGetConfigs(display, NULL, 0, &configsCount)) {
-        fprintf(stderr, "Failed to get EGL configurations count\n");
-        goto err;
+    if (plane->blendMode != preferred && plane->blendModeMutable && (plane->blendModes & (1 << preferred))) {
+        *premultiply = preferred == PLANE_BLEND_MODE_PREMULTIPLIED;
+        return preferred;
     }
 
-    EGLConfig* configs = malloc(sizeof (EGLConfig) * configsCount);
-    if (!configs) {
-        fprintf(stderr, "Failed to allocate EGL configerations array\n");
-        goto err;
-    }
+    // NB: Images are adapted to the blend mode that can't be changed.
+    *premultiply = plane->blendMode == PLANE_BLEND_MODE_PREMULTIPLIED;
+    return PLANE_BLEND_MODES_COUNT;
+}
 
-    // See com.sun.prism.es2.GLPixelFormat.Attributes for attribs pointer indices mapping.
-    const EGLint configAttributes[] = {
-        EGL_SURFACE_TYPE, attribs[6] != 0 ? EGL_WINDOW_BIT : EGL_PBUFFER_BIT,
-        EGL_RED_SIZE, attribs[0],
-        EGL_GREEN_SIZE, attribs[1],
-        EGL_BLUE_SIZE, attribs[2],
-        EGL_ALPHA_SIZE, attribs[3],
-        EGL_DEPTH_SIZE, attribs[4],
-        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-        EGL_NONE
-    };
+// Chooses zpos that places plane below or above UI plane. Returns -1 if plane can't be placed this way.
+static int choosePlaneZpos(PlaneInfo_t* plane, PlaneInfo_t* uiPlane, int above, uint8_t* setZpos, uint64_t* zpos) {
+    *setZpos = 0;
 
-    EGLint chosenCount = 0;
-    if (eglChooseConfig(display, configAttributes, configs, configsCount, &chosenCount) == EGL_FALSE || !chosenCount) {
-        fprintf(stderr, "Failed to choose EGL configuration\n");
-        free(configs);
-        goto err;
+    if (!plane->hasZpos || !uiPlane->hasZpos) {
+        // NB: Overlay planes are stacked above primary one when there is no zpos.
+        return above && uiPlane->type == DRM_PLANE_TYPE_PRIMARY ? 0 : -1;
     }
 
-    EGLConfig config = NULL;
-
-    for (EGLint i = 0; i < chosenCount; ++i) {
-        EGLint nativeVisualId;
+    if (!plane->zposMutable) {
+        return (above ? plane->zpos > uiPlane->zpos : plane->zpos < uiPlane->zpos) ? 0 : -1;
+    }
 
-        if (eglGetConfigAttrib(display, configs[i], EGL_NATIVE_VISUAL_ID, &nativeVisualId) == EGL_FALSE) {
-                fprintf(stderr, "Failed to get EGL framebuffer configuration\n");
-                continue;
+    if (above) {
+        const uint64_t value = plane->zposMin > uiPlane->zpos ? plane->zposMin : uiPlane->zpos + 1;
+        if (value > plane->zposMax) {
+            return -1;
         }
 
-        if (nativeVisualId == DRM_FORMAT_ARGB8888) {
-            config = configs[i];
-            break;
+        *zpos = value;
+    } else {
+        if (plane->zposMin >= uiPlane->zpos) {
+            return -1;
         }
-    }
 
-    free(configs);
-
-    if (!config) {
-        fprintf(stderr, "Failed to find EGL configuration\n");
-        goto err;
+        *zpos = plane->zposMin;
     }
 
-    return (jlong) config;
-err:
-    freeDisplayHandle(handle);
-    return -1;
+    *setZpos = 1;
+    return 0;
 }
 
-/**
- * Create an EGL Surface for the given display, configuration and window
- */
-jlong doEglCreateWindowSurface(jlong eglDisplay, jlong eglConfig, jlong eglNativeWindow) {
-    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
-    if (!handle) {
-        return (jlong) EGL_NO_SURFACE;
-    }
-
-    EGLConfig config = (EGLConfig) eglConfig;
-    EGLNativeWindowType nativeWindow = (EGLNativeWindowType) eglNativeWindow;
+// Allocates overlay plane that can be placed below or above UI plane. Returns NULL if there is no such plane.
+static PlaneInfo_t* allocateOverlayPlane(
+        PlaneInventory_t* inventory,
+        uint32_t crtcIndex,
+        uint32_t crtcId,
+        PlaneInfo_t* uiPlane,
+        int above,
+        PlaneOwner_t owner,
+        uint8_t* setZpos,
+        uint64_t* zpos) {
+    // NB: Try all free overlay planes, not every plane can be placed below UI plane.
+    PlaneInfo_t* plane;
+    while ((plane = allocatePlane(inventory, crtcIndex, crtcId, DRM_PLANE_TYPE_OVERLAY, DRM_FORMAT_ARGB8888, owner))) {
+        if (!choosePlaneZpos(plane, uiPlane, above, setZpos, zpos)) {
+            break;
+        }
 
-    EGLSurface surface = eglCreateWindowSurface(handle->display, config, nativeWindow, NULL);
-    if (surface == EGL_NO_SURFACE) {
-        fprintf(stderr, "Failed to create EGL window surface\n");
-        freeDisplayHandle(handle);
+        // NB: Keep the plane owned until search is done, so that it is not handed out again.
+        plane->owner = PLANE_OWNER_PROBE;
     }
 
-    return (jlong) surface;
-}
-
-/**
- * Create an EGL Context for the given display and configuration
- */
-jlong doEglCreateContext(jlong eglDisplay, jlong eglConfig) {
-    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
-    if (!handle) {
-        return (jlong) EGL_NO_CONTEXT;
+    for (uint32_t i = 0; i < inventory->count; ++i) {
+        if (inventory->planes[i].owner == PLANE_OWNER_PROBE) {
+            releasePlane(&inventory->planes[i]);
+        }
     }
 
-    EGLConfig config = (EGLConfig) eglConfig;
-
-    static const EGLint contextAttributes[] = {
-            EGL_CONTEXT_CLIENT_VERSION, 2,
-            EGL_NONE
-    };
+    return plane;
+}
 
-    EGLContext context = eglCreateContext(handle->display, config, EGL_NO_CONTEXT, contextAttributes);
-    if (context == EGL_NO_CONTEXT) {
-        fprintf(stderr, "Failed to create EGL context\n");
-        freeDisplayHandle(handle);
+// Allocates overlay plane to show cursor on when there is no cursor plane. Returns NULL if there is no such plane.
+static PlaneInfo_t* allocateCursorOverlayPlane(
+        PlaneInventory_t* inventory,
+        uint32_t crtcIndex,
+        uint32_t crtcId,
+        PlaneInfo_t* uiPlane,
+        uint8_t* setZpos,
+        uint64_t* zpos) {
+    PlaneInfo_t* plane =
+            allocateOverlayPlane(inventory, crtcIndex, crtcId, uiPlane, 1, PLANE_OWNER_CURSOR, setZpos, zpos);
+
+    if (plane && *setZpos) {
+        // NB: Cursor should be above video and static layers as well.
+        *zpos = plane->zposMax;
     }
 
-    return (jlong) context;
+    return plane;
 }
 
-/**
- * Enable the specified EGL system
- */
-jboolean doEglMakeCurrent(jlong eglDisplay, jlong eglDrawSurface, jlong eglReadSurface, jlong eglContext) {
-    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
-    if (!handle) {
-        return JNI_FALSE;
-    }
+typedef struct BoAndFramebuffer {
+        struct gbm_bo *bo;
+        uint32_t framebufferId;
+        size_t size;
+} BoAndFramebuffer_t;
 
-    EGLSurface drawSurface = (EGLDisplay) eglDrawSurface;
-    EGLSurface readSurface = (EGLDisplay) eglReadSurface;
-    EGLContext context = (EGLContext) eglContext;
+static size_t getBoSize(struct gbm_bo* bo) {
+    size_t result = 0;
 
-    EGLBoolean result = eglMakeCurrent(handle->display, drawSurface, readSurface, context);
-    if (result == EGL_FALSE) {
-        fprintf(stderr, "eglMakeCurrent failed\n");
-        freeDisplayHandle(handle);
+    const int planesCount = gbm_bo_get_plane_count(bo);
+    for (int i = 0; i < planesCount; ++i) {
+        result += (size_t) gbm_bo_get_stride_for_plane(bo, i) * gbm_bo_get_height(bo);
     }
 
     return result;
 }
 
-typedef struct BoAndFramebuffer {
-        struct gbm_bo *bo;
-        uint32_t framebufferId;
-} BoAndFramebuffer_t;
-
 static void boAndFramebufferDestructor(struct gbm_bo* bo, void* data) {
     int drmFd = gbm_device_get_fd(gbm_bo_get_device(bo));
     BoAndFramebuffer_t* boAndFramebuffer = data;
@@ -729,6 +1827,7 @@ static void boAndFramebufferDestructor(struct gbm_bo* bo, void* data) {
         drmModeRmFB(drmFd, boAndFramebuffer->framebufferId);
     }
 
+    subtractDisplayBuffersBytes(boAndFramebuffer->size);
     free(boAndFramebuffer);
 }
 
@@ -778,146 +1877,4392 @@ static BoAndFramebuffer_t* getOrCreateBoAndFramebuffer(struct gbm_bo* bo) {
         return NULL;
     }
 
+    boAndFramebuffer->size = getBoSize(bo);
+    addDisplayBuffersBytes(boAndFramebuffer->size);
+
     gbm_bo_set_user_data(bo, boAndFramebuffer, boAndFramebufferDestructor);
 
     return boAndFramebuffer;
 }
 
+// NB: GBM_BO_USE_FRONT_RENDERING is an enum value that appeared in Mesa 22.0, so preprocessor can't check for it.
+#define GBM_BO_USE_FRONT_RENDERING_FLAG (1 << 6)
+
+static struct gbm_bo* createBo(
+        struct gbm_device* device,
+        uint32_t width,
+        uint32_t height,
+        Modifiers_t* modifiers,
+        uint32_t flags) {
+    if (modifiers->modifiersCount) {
+        return gbm_bo_create_with_modifiers2(
+                    device,
+                    width,
+                    height,
+                    DRM_FORMAT_ARGB8888,
+                    modifiers->modifiers,
+                    modifiers->modifiersCount,
+                    flags
+        );
+    }
+
+    return gbm_bo_create(device, width, height, DRM_FORMAT_ARGB8888, flags);
+}
+
+static int createSwapchain(
+        const char* displayId,
+        Swapchain_t* swapchain,
+        struct gbm_device* device,
+        uint32_t width,
+        uint32_t height,
+        Modifiers_t* modifiers,
+        uint32_t buffersCount,
+        uint32_t flags) {
+    memset(swapchain, 0, sizeof (Swapchain_t));
+
+    for (uint32_t i = 0; i < buffersCount; ++i) {
+        struct gbm_bo* bo = createBo(device, width, height, modifiers, flags);
+
+        if (!bo && (flags & GBM_BO_USE_FRONT_RENDERING_FLAG)) {
+            fprintf(stderr, "Front rendering buffer objects are not supported, using regular ones\n");
+            flags &= ~GBM_BO_USE_FRONT_RENDERING_FLAG;
+            bo = createBo(device, width, height, modifiers, flags);
+        }
+
+        if (!bo) {
+            fprintf(stderr, "Failed to create swapchain buffer object for display with id %s: %s\n",
+                    displayId, strerror(errno));
+            destroySwapchain(swapchain, EGL_NO_DISPLAY);
+            return -1;
+        }
+
+        swapchain->buffers[i].bo = bo;
+        swapchain->buffers[i].image = EGL_NO_IMAGE_KHR;
+        ++swapchain->buffersCount;
+
+        if (!getOrCreateBoAndFramebuffer(bo)) {
+            fprintf(stderr, "Failed to create framebuffer for swapchain buffer object (display id: %s)\n", displayId);
+            destroySwapchain(swapchain, EGL_NO_DISPLAY);
+            return -1;
+        }
+    }
+
+    swapchain->frontBuffer = swapchain->buffersCount;
+    return 0;
+}
+
 static int addProperty(
         drmModeAtomicReqPtr request,
         DrmProperties_t* properties,
         uint32_t objectId,
         const char *name,
-        uint64_t value) {
-    int propertyId = -1;
-
-    for (uint32_t i = 0; i < properties->count; ++i) {
-        if (strcmp(properties->properties[i]->name, name) == 0) {
-            propertyId = properties->properties[i]->prop_id;
-            break;
-        }
-    }
+        uint64_t value);
 
-    if (propertyId < 0) {
-        fprintf(stderr, "Failed to find property \"%s\" for object id %i\n", name, objectId);
+// Display pipeline that is not set up yet. Used to check plane configurations at initialization.
+typedef struct PipelineProbe {
+    int fd;
+    struct gbm_device* device;
+    Modifiers_t* modifiers;
+    uint32_t connectorId;
+    DrmProperties_t* connectorProperties;
+    uint32_t crtcId;
+    DrmProperties_t* crtcProperties;
+    drmModeModeInfoPtr mode;
+    PlaneInfo_t* plane;
+} PipelineProbe_t;
+
+// Checks with TEST_ONLY commit that plane is able to scan out a buffer with |planeRotation| "rotation" value. Zero
+//  value is not set, so that planes without "rotation" property can be checked as well.
+static int testPlaneRotation(PipelineProbe_t* probe, uint64_t planeRotation) {
+    const int swapSize = planeRotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+    const uint32_t width = swapSize ? probe->mode->vdisplay : probe->mode->hdisplay;
+    const uint32_t height = swapSize ? probe->mode->hdisplay : probe->mode->vdisplay;
+
+    // NB: Rotation support may depend on buffer layout, so buffer is created the same way real ones are.
+    struct gbm_bo* bo = createBo(probe->device, width, height, probe->modifiers,
+                                 GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+    if (!bo) {
         return -1;
     }
 
-    if (drmModeAtomicAddProperty(request, objectId, propertyId, value) < 0) {
-        fprintf(stderr, "Failed to set property \"%s\" (id: %i) for object id %i: %s\n",
-                name, propertyId, objectId, strerror(errno));
-        return -1;
+    int result = -1;
+
+    BoAndFramebuffer_t* boAndFramebuffer = getOrCreateBoAndFramebuffer(bo);
+    if (!boAndFramebuffer) {
+        goto out_destroy_bo;
     }
 
-    return 0;
-}
+    uint32_t blobId;
+    if (drmModeCreatePropertyBlob(probe->fd, probe->mode, sizeof (drmModeModeInfo), &blobId)) {
+        goto out_destroy_bo;
+    }
 
-/**
- * Swap buffers (and render frontbuffer)
- */
-jboolean doEglSwapBuffers(jlong eglDisplay, jlong eglSurface) {
-    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
-    if (!handle) {
-        return JNI_FALSE;
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+    if (!request) {
+        goto out_destroy_blob;
     }
 
-    EGLSurface surface = (EGLSurface) eglSurface;
-    if (eglSwapBuffers(handle->display, surface) == EGL_FALSE) {
-        fprintf(stderr, "eglSwapBuffers failed\n");
-        return JNI_FALSE;
+    DrmProperties_t* properties = &probe->plane->properties;
+    const uint32_t planeId = probe->plane->planeId;
+
+    // NB: CRTC may be inactive yet, so configuration is tested along with a modeset.
+    if (addProperty(request, probe->connectorProperties, probe->connectorId, "CRTC_ID", probe->crtcId) ||
+            addProperty(request, probe->crtcProperties, probe->crtcId, "MODE_ID", blobId) ||
+            addProperty(request, probe->crtcProperties, probe->crtcId, "ACTIVE", 1) ||
+            addProperty(request, properties, planeId, "FB_ID", boAndFramebuffer->framebufferId) ||
+            addProperty(request, properties, planeId, "CRTC_ID", probe->crtcId) ||
+            addProperty(request, properties, planeId, "SRC_X", 0) ||
+            addProperty(request, properties, planeId, "SRC_Y", 0) ||
+            addProperty(request, properties, planeId, "SRC_W", (uint64_t) width << 16) ||
+            addProperty(request, properties, planeId, "SRC_H", (uint64_t) height << 16) ||
+            addProperty(request, properties, planeId, "CRTC_X", 0) ||
+            addProperty(request, properties, planeId, "CRTC_Y", 0) ||
+            addProperty(request, properties, planeId, "CRTC_W", probe->mode->hdisplay) ||
+            addProperty(request, properties, planeId, "CRTC_H", probe->mode->vdisplay) ||
+            (planeRotation && addProperty(request, properties, planeId, "rotation", planeRotation))) {
+        goto out_free_request;
     }
 
-    struct gbm_bo* nextBo = gbm_surface_lock_front_buffer(handle->surface);
-    if (!nextBo) {
-        fprintf(stderr, "Failed to lock surface front buffer: %s\n", strerror(errno));
-        return JNI_FALSE;
+    result = drmModeAtomicCommit(
+                probe->fd, request, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL
+    );
+
+out_free_request:
+    drmModeAtomicFree(request);
+out_destroy_blob:
+    drmModeDestroyPropertyBlob(probe->fd, blobId);
+out_destroy_bo:
+    gbm_bo_destroy(bo);
+    return result;
+}
+
+// Returns "rotation" property value for UI plane (see |getPlaneRotation|) that passed TEST_ONLY commit, or zero.
+static uint64_t findPlaneRotation(PipelineProbe_t* probe, uint32_t rotation) {
+    const uint64_t planeRotation = getPlaneRotation(probe->plane, rotation);
+
+    // NB: Reported bits may still be rejected in some combinations (or with some buffer layouts).
+    if (planeRotation && testPlaneRotation(probe, planeRotation)) {
+        fprintf(stderr, "Plane with id %i rejected rotation 0x%llx\n",
+                probe->plane->planeId, (unsigned long long) planeRotation);
+        return 0;
     }
 
-    BoAndFramebuffer_t* boAndFramebuffer = getOrCreateBoAndFramebuffer(nextBo);
-    if (!boAndFramebuffer) {
-        fprintf(stderr, "Failed to get framebuffer for buffer object\n");
-        goto err_release_buffer;
+    return planeRotation;
+}
+
+// Checks with TEST_ONLY modeset that main display and |outputs| laid out on |desktopWidth|x|desktopHeight| desktop
+//  (see |layOutOutputs|) can be driven together, with the same "rotation" value on every plane.
+static int testOutputs(
+        PipelineProbe_t* probe,
+        Output_t* outputs,
+        uint32_t outputsCount,
+        int clone,
+        uint64_t planeRotation,
+        uint32_t desktopWidth,
+        uint32_t desktopHeight) {
+    // NB: Main display picture is of rotated size when plane rotates it. Rotation is used with mirroring only.
+    const int swapSize = planeRotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+    const uint32_t width = swapSize ? probe->mode->vdisplay : probe->mode->hdisplay;
+    const uint32_t height = swapSize ? probe->mode->hdisplay : probe->mode->vdisplay;
+    const uint32_t bufferWidth = swapSize ? width : desktopWidth;
+    const uint32_t bufferHeight = swapSize ? height : desktopHeight;
+
+    // NB: Bandwidth and plane limits depend on buffer size and layout, so buffer is created the same way real ones are.
+    struct gbm_bo* bo = createBo(probe->device, bufferWidth, bufferHeight, probe->modifiers,
+                                 GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+    if (!bo) {
+        return -1;
     }
 
-    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+    int result = -1;
+    uint32_t blobIds[MAX_OUTPUTS];
+    uint32_t blobsCount = 0;
+    drmModeAtomicReqPtr request = NULL;
 
-    int flags = 0;
-    if (handle->doModeset) {
-        flags &= DRM_MODE_ATOMIC_ALLOW_MODESET;
-        if (addProperty(request, &handle->connectorProperties, handle->connectorId, "CRTC_ID", handle->crtcId) < 0) {
-            goto err_free_request;
-        }
+    BoAndFramebuffer_t* boAndFramebuffer = getOrCreateBoAndFramebuffer(bo);
+    if (!boAndFramebuffer) {
+        goto out_destroy_bo;
+    }
 
-        uint32_t blobId;
-        if (drmModeCreatePropertyBlob(handle->fd, &handle->mode, sizeof (handle->mode), &blobId) != 0) {
-            goto err_free_request;
-        }
+    request = drmModeAtomicAlloc();
+    if (!request) {
+        goto out_destroy_bo;
+    }
 
-        if (addProperty(request, &handle->crtcProperties, handle->crtcId, "MODE_ID", blobId) < 0) {
-            goto err_free_request;
+    for (uint32_t i = 0; i <= outputsCount; ++i) {
+        Output_t* output = i ? &outputs[i - 1] : NULL;
+        drmModeModeInfoPtr mode = output ? &output->mode : probe->mode;
+        const uint32_t connectorId = output ? output->connectorId : probe->connectorId;
+        DrmProperties_t* connectorProperties = output ? &output->connectorProperties : probe->connectorProperties;
+        const uint32_t crtcId = output ? output->crtcId : probe->crtcId;
+        DrmProperties_t* crtcProperties = output ? &output->crtcProperties : probe->crtcProperties;
+        PlaneInfo_t* plane = output ? output->plane : probe->plane;
+
+        if (drmModeCreatePropertyBlob(probe->fd, mode, sizeof (drmModeModeInfo), &blobIds[blobsCount])) {
+            goto out_free_request;
         }
 
-        if (addProperty(request, &handle->crtcProperties, handle->crtcId, "ACTIVE", 1) < 0) {
-            goto err_free_request;
+        // NB: See |addPlaneProperties| and |addOutputsProperties|.
+        const uint32_t srcWidth = output && !clone ? mode->hdisplay : width;
+        const uint32_t srcHeight = output && !clone ? mode->vdisplay : height;
+        DrmProperties_t* properties = &plane->properties;
+        const uint32_t planeId = plane->planeId;
+        if (addProperty(request, connectorProperties, connectorId, "CRTC_ID", crtcId) ||
+                addProperty(request, crtcProperties, crtcId, "MODE_ID", blobIds[blobsCount++]) ||
+                addProperty(request, crtcProperties, crtcId, "ACTIVE", 1) ||
+                addProperty(request, properties, planeId, "FB_ID", boAndFramebuffer->framebufferId) ||
+                addProperty(request, properties, planeId, "CRTC_ID", crtcId) ||
+                addProperty(request, properties, planeId, "SRC_X", (uint64_t) (output ? output->x : 0) << 16) ||
+                addProperty(request, properties, planeId, "SRC_Y", (uint64_t) (bufferHeight - srcHeight) << 16) ||
+                addProperty(request, properties, planeId, "SRC_W", (uint64_t) srcWidth << 16) ||
+                addProperty(request, properties, planeId, "SRC_H", (uint64_t) srcHeight << 16) ||
+                addProperty(request, properties, planeId, "CRTC_X", output ? output->crtcX : 0) ||
+                addProperty(request, properties, planeId, "CRTC_Y", output ? output->crtcY : 0) ||
+                addProperty(request, properties, planeId, "CRTC_W", output ? output->crtcWidth : mode->hdisplay) ||
+                addProperty(request, properties, planeId, "CRTC_H", output ? output->crtcHeight : mode->vdisplay) ||
+                (planeRotation && addProperty(request, properties, planeId, "rotation", planeRotation))) {
+            goto out_free_request;
         }
     }
 
-    addProperty(request, &handle->planeProperties, handle->planeId, "FB_ID", boAndFramebuffer->framebufferId);
-    addProperty(request, &handle->planeProperties, handle->planeId, "CRTC_ID", handle->crtcId);
-    addProperty(request, &handle->planeProperties, handle->planeId, "SRC_X", 0);
-    addProperty(request, &handle->planeProperties, handle->planeId, "SRC_Y", 0);
-    addProperty(request, &handle->planeProperties, handle->planeId, "SRC_W", handle->mode.hdisplay << 16);
-    addProperty(request, &handle->planeProperties, handle->planeId, "SRC_H", handle->mode.vdisplay << 16);
-    addProperty(request, &handle->planeProperties, handle->planeId, "CRTC_X", 0);
-    addProperty(request, &handle->planeProperties, handle->planeId, "CRTC_Y", 0);
-    addProperty(request, &handle->planeProperties, handle->planeId, "CRTC_W", handle->mode.hdisplay);
-    addProperty(request, &handle->planeProperties, handle->planeId, "CRTC_H", handle->mode.vdisplay);
+    result = drmModeAtomicCommit(
+                probe->fd, request, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL
+    );
 
-    if (drmModeAtomicCommit(handle->fd, request, flags, NULL)) {
-        fprintf(stderr, "Failed to commit DRM mode: %s\n", strerror(errno));
-        goto err_free_request;
+out_free_request:
+    drmModeAtomicFree(request);
+    for (uint32_t i = 0; i < blobsCount; ++i) {
+        drmModeDestroyPropertyBlob(probe->fd, blobIds[i]);
     }
+out_destroy_bo:
+    gbm_bo_destroy(bo);
+    return result;
+}
 
-    handle->doModeset = 0;
+static void initDynamicResolution(
+        DynamicResolution_t* dynamicResolution,
+        uint32_t width,
+        uint32_t height,
+        uint64_t frameDurationNs) {
+    memset(dynamicResolution, 0, sizeof (DynamicResolution_t));
+
+    // NB: Render surface is always allocated at full mode size. Lower levels use bottom-left part of it (this is where
+    //  glViewport origin is), and plane scales that part up to the whole CRTC. So, switching levels is just a plane
+    //  SRC_* change, and no modeset or surface reallocation is required.
+    for (uint32_t i = 0; i < DYNAMIC_RESOLUTION_LEVELS; ++i) {
+        dynamicResolution->widths[i] = width * dynamicResolutionLadder[i] / 100;
+        dynamicResolution->heights[i] = height * dynamicResolutionLadder[i] / 100;
+    }
 
-    drmModeAtomicFree(request);
+    dynamicResolution->levelsCount = DYNAMIC_RESOLUTION_LEVELS;
+    dynamicResolution->enabled = isEnabled("JFX_EGL_DRM_DYNAMIC_RESOLUTION");
 
-    if (handle->previousBo) {
-        gbm_surface_release_buffer(handle->surface, handle->previousBo);
+    // NB: Prism renders on its pulse (60 Hz by default), so on faster displays a frame may take longer than a refresh.
+    double frameRate = getEnvDouble("JFX_EGL_DRM_DYNAMIC_RESOLUTION_RATE", 60.);
+    if (frameRate < 1.) {
+        fprintf(stderr, "Dynamic resolution frame rate should be at least 1 Hz, using 60 Hz\n");
+        frameRate = 60.;
     }
-    handle->previousBo = nextBo;
-    return JNI_TRUE;
 
-err_free_request:
-    drmModeAtomicFree(request);
-err_release_buffer:
-    gbm_surface_release_buffer(handle->surface, nextBo);
-    return JNI_FALSE;
+    const uint64_t framePeriodNs = 1000000000. / frameRate;
+    dynamicResolution->budgetNs = framePeriodNs > frameDurationNs ? framePeriodNs : frameDurationNs;
 }
 
-/**
- * Get the number of native screens in the current configuration
- */
-jint doGetNumberOfScreens() {
-    // Only one screen is upported for now.
-    return 1;
-}
+static uint64_t getFrameDurationNs(drmModeModeInfoPtr mode) {
+    const uint64_t pixelsPerFrame = (uint64_t) mode->htotal * mode->vtotal;
+    if (mode->clock && pixelsPerFrame) {
+        return pixelsPerFrame * 1000000ull / mode->clock;
+    }
 
-/**
- * Get screen handle
- */
-jlong doGetHandle(jint idx) {
-    // This one is used to determine screen uniqueness. We can use this to expose pointer to |DisplayHandle_t| to Java
-    //  and pass it around. This also can be used to implement display hotplug support. Just return display index as
-    //  handle for now.
-    return idx;
+    return 1000000000ull / (mode->vrefresh ? mode->vrefresh : 60);
 }
 
-/**
+// GBM device and EGL display created while KMS objects are being probed. Loading and initializing the GPU driver takes
+//  longer than the whole KMS probing.
+typedef struct DeviceInit {
+    int fd;
+    pthread_t thread;
+    uint8_t started;
+    // NULL (EGL_NO_DISPLAY) once taken by the caller.
+    struct gbm_device* device;
+    EGLDisplay display;
+    // Error of GBM device creation.
+    int error;
+} DeviceInit_t;
+
+static void* deviceInitMain(void* data) {
+    DeviceInit_t* init = (DeviceInit_t*) data;
+
+    init->device = gbm_create_device(init->fd);
+    if (!init->device) {
+        init->error = errno;
+        return NULL;
+    }
+
+    // NB: Display is initialized here, so that Monocle's eglInitialize call is a no-op.
+    init->display = eglGetDisplay((EGLNativeDisplayType) init->device);
+    if (init->display != EGL_NO_DISPLAY && eglInitialize(init->display, NULL, NULL) == EGL_FALSE) {
+        init->display = EGL_NO_DISPLAY;
+    }
+
+    return NULL;
+}
+
+static void startDeviceInit(DeviceInit_t* init, int fd) {
+    init->fd = fd;
+    init->device = NULL;
+    init->display = EGL_NO_DISPLAY;
+    init->error = 0;
+
+    // NB: Without a thread device is created when it is needed.
+    init->started = !pthread_create(&init->thread, NULL, deviceInitMain, init);
+}
+
+static void finishDeviceInit(DeviceInit_t* init) {
+    if (init->started) {
+        pthread_join(init->thread, NULL);
+        init->started = 0;
+    } else if (!init->device) {
+        deviceInitMain(init);
+    }
+}
+
+// Destroys objects that were not taken by the caller.
+static void cancelDeviceInit(DeviceInit_t* init) {
+    if (init->started) {
+        pthread_join(init->thread, NULL);
+        init->started = 0;
+    }
+
+    if (init->display != EGL_NO_DISPLAY) {
+        eglTerminate(init->display);
+    }
+    if (init->device) {
+        gbm_device_destroy(init->device);
+    }
+}
+
+#define TOPOLOGY_CACHE_MAGIC 0x4f50544aU
+#define TOPOLOGY_CACHE_VERSION 3
+#define TOPOLOGY_CACHE_MAX_MODIFIERS 32
+#define TOPOLOGY_CACHE_MAX_PLANES 128
+#define TOPOLOGY_CACHE_MAX_FORMATS 8192
+
+// Main display pipeline chosen by the last cold start, stored in JFX_EGL_DRM_TOPOLOGY_CACHE file. It is only valid for
+//  the same |key| and the same display attached to the connector.
+typedef struct TopologyCache {
+    uint32_t magic;
+    uint32_t version;
+    // See |getTopologyKey|.
+    uint64_t key;
+
+    uint32_t connectorId;
+    uint32_t edidPropertyId;
+    // See |getConnectorEdidHash|.
+    uint64_t edidHash;
+    uint32_t encoderId;
+    uint32_t crtcId;
+    uint32_t crtcIndex;
+    uint32_t planeId;
+    drmModeModeInfo mode;
+    // Ids of |usedPropertyNames| properties, like |DrmProperties_t.usedIds|.
+    uint32_t connectorPropertyIds[USED_PROPERTIES_COUNT];
+    uint32_t crtcPropertyIds[USED_PROPERTIES_COUNT];
+
+    uint64_t planeRotation;
+    // Format modifiers of UI plane for DRM_FORMAT_ARGB8888, decoded from its "IN_FORMATS" blob.
+    uint32_t modifiersCount;
+    uint64_t modifiers[TOPOLOGY_CACHE_MAX_MODIFIERS];
+
+    // Plane inventory follows: |planesCount| |CachedPlane_t| records, then formats of all the planes in the same order.
+    uint32_t planesCount;
+    uint32_t formatsCount;
+} TopologyCache_t;
+
+// |PlaneInfo_t| as stored in topology cache.
+typedef struct CachedPlane {
+    uint32_t planeId;
+    uint32_t possibleCrtcs;
+    uint64_t type;
+    uint32_t crtcId;
+    uint32_t formatsCount;
+
+    uint32_t hasZpos;
+    uint32_t zposMutable;
+    uint64_t zposMin;
+    uint64_t zposMax;
+    uint64_t zpos;
+
+    uint64_t rotations;
+    uint32_t hasAlpha;
+    uint32_t blendModes;
+    uint64_t blendModeValues[PLANE_BLEND_MODES_COUNT];
+    uint32_t blendMode;
+    uint32_t blendModeMutable;
+    // Ids of |usedPropertyNames| properties, like |DrmProperties_t.usedIds|.
+    uint32_t propertyIds[USED_PROPERTIES_COUNT];
+} CachedPlane_t;
+
+#define HASH_OFFSET_BASIS 0xcbf29ce484222325ull
+
+// Continues 64-bit FNV-1a |hash| over |size| bytes of |data|.
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*) data;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static uint64_t hashString(uint64_t hash, const char* value) {
+    // NB: Terminating zero is hashed too, so that "ab", "c" and "a", "bc" differ, and so does unset value.
+    return value ? hashBytes(hash, value, strlen(value) + 1) : hashBytes(hash, "\xff", 1);
+}
+
+// Hash of everything pipeline choice depends on, except for the display attached: display id, DRM driver and its
+//  version, kernel build, this library's property list and the environment variables that affect the choice.
+static uint64_t getTopologyKey(const char* displayId, int fd) {
+    static const char* const variables[] = {
+        "JFX_EGL_DRM_CONNECTOR",
+        "JFX_EGL_DRM_LOW_MEMORY",
+        "JFX_EGL_DRM_MAX_BANDWIDTH",
+        "JFX_EGL_DRM_MAX_PIXEL_CLOCK",
+        "JFX_EGL_DRM_MAX_RESOLUTION",
+        "JFX_EGL_DRM_MODE_POLICY",
+        "JFX_EGL_DRM_REFRESH_RATE",
+        "JFX_EGL_DRM_ROTATION",
+        "JFX_EGL_DRM_SWAPCHAIN"
+    };
+
+    uint64_t key = hashString(HASH_OFFSET_BASIS, displayId);
+
+    drmVersionPtr version = drmGetVersion(fd);
+    if (version) {
+        const int numbers[] = { version->version_major, version->version_minor, version->version_patchlevel };
+        key = hashBytes(key, numbers, sizeof (numbers));
+        key = hashBytes(key, version->name, version->name_len);
+        key = hashBytes(key, version->date, version->date_len);
+        drmFreeVersion(version);
+    }
+
+    // NB: Driver version is rarely bumped, while driver behaviour changes with every kernel.
+    struct utsname system;
+    if (!uname(&system)) {
+        key = hashString(key, system.release);
+        key = hashString(key, system.version);
+    }
+
+    for (uint32_t i = 0; i < USED_PROPERTIES_COUNT; ++i) {
+        key = hashString(key, usedPropertyNames[i]);
+    }
+
+    for (uint32_t i = 0; i < sizeof (variables) / sizeof (variables[0]); ++i) {
+        key = hashString(key, getenv(variables[i]));
+    }
+
+    return key;
+}
+
+// Hash of EDID blob of |connector|, which tells one display from another. Zero if there is no EDID.
+static uint64_t getConnectorEdidHash(int fd, drmModeConnectorPtr connector, uint32_t edidPropertyId) {
+    for (int i = 0; edidPropertyId && i < connector->count_props; ++i) {
+        if (connector->props[i] != edidPropertyId || !connector->prop_values[i]) {
+            continue;
+        }
+
+        drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, connector->prop_values[i]);
+        if (!blob) {
+            return 0;
+        }
+
+        const uint64_t hash = hashBytes(HASH_OFFSET_BASIS, blob->data, blob->length);
+        drmModeFreePropertyBlob(blob);
+        return hash;
+    }
+
+    return 0;
+}
+
+static int restoreDrmProperties(DrmProperties_t* properties, const uint32_t* usedIds) {
+    properties->count = 0;
+    properties->usedIds = malloc(USED_PROPERTIES_COUNT * sizeof (uint32_t));
+    if (!properties->usedIds) {
+        fprintf(stderr, "Failed to allocate property ids array\n");
+        return -1;
+    }
+
+    memcpy(properties->usedIds, usedIds, USED_PROPERTIES_COUNT * sizeof (uint32_t));
+    return 0;
+}
+
+// Restores plane inventory of |fd| device from |planesCount| cached |planes| and |formatsCount| |formats| that follow
+//  them in topology cache. Planes are probed on their first use, see |probeCachedPlane|.
+static int restorePlaneInventory(
+        const char* displayId,
+        int fd,
+        const CachedPlane_t* planes,
+        uint32_t planesCount,
+        const uint32_t* formats,
+        uint32_t formatsCount,
+        PlaneInventory_t* inventory) {
+    inventory->count = 0;
+    inventory->fd = fd;
+    inventory->displayId = displayId;
+    inventory->planes = calloc(planesCount, sizeof (PlaneInfo_t));
+    if (!inventory->planes && planesCount) {
+        fprintf(stderr, "Failed to allocate planes array\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < planesCount; ++i) {
+        const CachedPlane_t* cached = &planes[i];
+        PlaneInfo_t* plane = &inventory->planes[i];
+
+        if (cached->formatsCount > formatsCount || cached->blendMode > PLANE_BLEND_MODES_COUNT) {
+            goto err_free_inventory;
+        }
+
+        plane->formats = malloc(sizeof (uint32_t) * cached->formatsCount);
+        if (!plane->formats && cached->formatsCount) {
+            fprintf(stderr, "Failed to allocate plane formats array\n");
+            goto err_free_inventory;
+        }
+        if (restoreDrmProperties(&plane->properties, cached->propertyIds)) {
+            free(plane->formats);
+            goto err_free_inventory;
+        }
+
+        memcpy(plane->formats, formats, sizeof (uint32_t) * cached->formatsCount);
+        formats += cached->formatsCount;
+        formatsCount -= cached->formatsCount;
+
+        plane->formatsCount = cached->formatsCount;
+        plane->planeId = cached->planeId;
+        plane->possibleCrtcs = cached->possibleCrtcs;
+        plane->type = cached->type;
+        plane->crtcId = cached->crtcId;
+        plane->hasZpos = cached->hasZpos;
+        plane->zposMutable = cached->zposMutable;
+        plane->zposMin = cached->zposMin;
+        plane->zposMax = cached->zposMax;
+        plane->zpos = cached->zpos;
+        plane->rotations = cached->rotations;
+        plane->mayScaleByType = cached->type != DRM_PLANE_TYPE_CURSOR;
+        plane->hasAlpha = cached->hasAlpha;
+        plane->blendModes = cached->blendModes;
+        memcpy(plane->blendModeValues, cached->blendModeValues, sizeof (plane->blendModeValues));
+        plane->blendMode = cached->blendMode;
+        plane->blendModeMutable = cached->blendModeMutable;
+        // NB: Blob ids are not kept between starts, modifiers of UI plane are cached already decoded.
+        plane->inFormatsBlobId = 0;
+        plane->owner = PLANE_OWNER_NONE;
+        plane->cached = 1;
+
+        ++inventory->count;
+    }
+
+    if (formatsCount) {
+        goto err_free_inventory;
+    }
+
+    return 0;
+
+err_free_inventory:
+    freePlaneInventory(inventory);
+    return -1;
+}
+
+// Returns non-zero if there is no cache for |key| at |path|. Plane inventory of |fd| device is restored from the cache
+//  to |planes| otherwise.
+static int readTopologyCache(
+        const char* path,
+        uint64_t key,
+        const char* displayId,
+        int fd,
+        TopologyCache_t* cache,
+        PlaneInventory_t* planes) {
+    int cacheFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cacheFd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open topology cache %s: %s\n", path, strerror(errno));
+        }
+        return -1;
+    }
+
+    const ssize_t size = read(cacheFd, cache, sizeof (TopologyCache_t));
+
+    if (size != sizeof (TopologyCache_t) || cache->magic != TOPOLOGY_CACHE_MAGIC ||
+            cache->version != TOPOLOGY_CACHE_VERSION || cache->modifiersCount > TOPOLOGY_CACHE_MAX_MODIFIERS ||
+            cache->planesCount > TOPOLOGY_CACHE_MAX_PLANES || cache->formatsCount > TOPOLOGY_CACHE_MAX_FORMATS) {
+        fprintf(stderr, "Ignoring invalid topology cache %s\n", path);
+        close(cacheFd);
+        return -1;
+    }
+
+    if (cache->key != key) {
+        fprintf(stderr, "Topology cache %s is for another driver, kernel or settings, probing displays\n", path);
+        close(cacheFd);
+        return -1;
+    }
+
+    const size_t planesSize = sizeof (CachedPlane_t) * cache->planesCount;
+    const size_t formatsSize = sizeof (uint32_t) * cache->formatsCount;
+    uint8_t* data = malloc(planesSize + formatsSize + 1);
+    const int valid = data && read(cacheFd, data, planesSize + formatsSize + 1) == (ssize_t) (planesSize + formatsSize);
+    close(cacheFd);
+
+    // NB: Formats follow plane records, which are 8 bytes aligned.
+    int result = -1;
+    if (!valid || restorePlaneInventory(displayId, fd, (const CachedPlane_t*) data, cache->planesCount,
+                                        (const uint32_t*) (data + planesSize), cache->formatsCount, planes)) {
+        fprintf(stderr, "Ignoring invalid topology cache %s\n", path);
+    } else {
+        result = 0;
+    }
+
+    free(data);
+    return result;
+}
+
+// Writes |cache| for the pipeline and plane inventory of |handle|, whose connector properties are not compacted yet.
+//  Modifiers are already set by the caller.
+static void writeTopologyCache(
+        const char* path,
+        uint64_t key,
+        TopologyCache_t* cache,
+        DisplayHandle_t* handle,
+        drmModeConnectorPtr connector) {
+    if (cache->modifiersCount > TOPOLOGY_CACHE_MAX_MODIFIERS) {
+        fprintf(stderr, "Plane with id %i has too many format modifiers to be cached\n", handle->planeId);
+        return;
+    }
+
+    const PlaneInventory_t* planes = &handle->planes;
+    uint32_t formatsCount = 0;
+    for (uint32_t i = 0; i < planes->count; ++i) {
+        formatsCount += planes->planes[i].formatsCount;
+    }
+
+    if (planes->count > TOPOLOGY_CACHE_MAX_PLANES || formatsCount > TOPOLOGY_CACHE_MAX_FORMATS) {
+        fprintf(stderr, "Display with id %s has too many planes or plane formats to be cached\n", handle->displayId);
+        return;
+    }
+
+    cache->magic = TOPOLOGY_CACHE_MAGIC;
+    cache->version = TOPOLOGY_CACHE_VERSION;
+    cache->key = key;
+    cache->connectorId = handle->connectorId;
+    cache->edidPropertyId = getPropertyId(&handle->connectorProperties, "EDID");
+    cache->edidHash = getConnectorEdidHash(handle->fd, connector, cache->edidPropertyId);
+    cache->encoderId = handle->encoderId;
+    cache->crtcId = handle->crtcId;
+    cache->crtcIndex = handle->crtcIndex;
+    cache->planeId = handle->planeId;
+    memcpy(&cache->mode, &handle->mode, sizeof (drmModeModeInfo));
+
+    for (uint32_t i = 0; i < USED_PROPERTIES_COUNT; ++i) {
+        cache->connectorPropertyIds[i] = getPropertyId(&handle->connectorProperties, usedPropertyNames[i]);
+        cache->crtcPropertyIds[i] = getPropertyId(&handle->crtcProperties, usedPropertyNames[i]);
+    }
+
+    cache->planeRotation = handle->planeRotation;
+    cache->planesCount = planes->count;
+    cache->formatsCount = formatsCount;
+
+    const size_t planesSize = sizeof (CachedPlane_t) * planes->count;
+    const size_t size = sizeof (TopologyCache_t) + planesSize + sizeof (uint32_t) * formatsCount;
+    uint8_t* data = calloc(1, size);
+    if (!data) {
+        fprintf(stderr, "Failed to allocate topology cache\n");
+        return;
+    }
+
+    memcpy(data, cache, sizeof (TopologyCache_t));
+    CachedPlane_t* cachedPlanes = (CachedPlane_t*) (data + sizeof (TopologyCache_t));
+    uint32_t* formats = (uint32_t*) (data + sizeof (TopologyCache_t) + planesSize);
+
+    for (uint32_t i = 0; i < planes->count; ++i) {
+        PlaneInfo_t* plane = &planes->planes[i];
+        CachedPlane_t* cached = &cachedPlanes[i];
+
+        cached->planeId = plane->planeId;
+        cached->possibleCrtcs = plane->possibleCrtcs;
+        cached->type = plane->type;
+        cached->crtcId = plane->crtcId;
+        cached->formatsCount = plane->formatsCount;
+        cached->hasZpos = plane->hasZpos;
+        cached->zposMutable = plane->zposMutable;
+        cached->zposMin = plane->zposMin;
+        cached->zposMax = plane->zposMax;
+        cached->zpos = plane->zpos;
+        cached->rotations = plane->rotations;
+        cached->hasAlpha = plane->hasAlpha;
+        cached->blendModes = plane->blendModes;
+        memcpy(cached->blendModeValues, plane->blendModeValues, sizeof (cached->blendModeValues));
+        cached->blendMode = plane->blendMode;
+        cached->blendModeMutable = plane->blendModeMutable;
+
+        for (uint32_t j = 0; j < USED_PROPERTIES_COUNT; ++j) {
+            cached->propertyIds[j] = getPropertyId(&plane->properties, usedPropertyNames[j]);
+        }
+
+        memcpy(formats, plane->formats, sizeof (uint32_t) * plane->formatsCount);
+        formats += plane->formatsCount;
+    }
+
+    // NB: Cache is replaced atomically, so that power loss leaves either the old cache or the new one.
+    char temporaryPath[PATH_MAX];
+    snprintf(temporaryPath, sizeof (temporaryPath), "%s.tmp", path);
+
+    int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create topology cache %s: %s\n", temporaryPath, strerror(errno));
+        free(data);
+        return;
+    }
+
+    const int written = write(fd, data, size) == (ssize_t) size && !fsync(fd);
+    close(fd);
+    free(data);
+
+    if (!written || rename(temporaryPath, path)) {
+        fprintf(stderr, "Failed to write topology cache %s: %s\n", path, strerror(errno));
+        unlink(temporaryPath);
+    }
+}
+
+// Restores main display pipeline from |cache| if the same display is still attached to the connector and pipeline
+//  passes TEST_ONLY commit. Only the cached connector is looked at, and it is only probed if its state is unknown.
+//  Connector and CRTC properties are restored as property ids (see |compactDrmProperties|). Returns non-zero if
+//  displays have to be probed.
+static int restoreTopology(
+        int fd,
+        drmModeResPtr resources,
+        struct gbm_device* device,
+        PlaneInventory_t* planes,
+        TopologyCache_t* cache,
+        drmModeConnectorPtr* connector,
+        drmModeModeInfoPtr* mode,
+        DrmProperties_t* connectorProperties,
+        DrmProperties_t* crtcProperties,
+        PlaneInfo_t** uiPlane) {
+    if (cache->crtcIndex >= (uint32_t) resources->count_crtcs || resources->crtcs[cache->crtcIndex] != cache->crtcId) {
+        return -1;
+    }
+
+    *connector = drmModeGetConnectorCurrent(fd, cache->connectorId);
+    if (*connector && ((*connector)->connection != DRM_MODE_CONNECTED || !(*connector)->count_modes)) {
+        drmModeFreeConnector(*connector);
+        *connector = drmModeGetConnector(fd, cache->connectorId);
+    }
+
+    if (!*connector || (*connector)->connection != DRM_MODE_CONNECTED ||
+            getConnectorEdidHash(fd, *connector, cache->edidPropertyId) != cache->edidHash) {
+        goto err_free_connector;
+    }
+
+    *mode = NULL;
+    for (int i = 0; i < (*connector)->count_modes && !*mode; ++i) {
+        if (isSameMode(&(*connector)->modes[i], &cache->mode)) {
+            *mode = &(*connector)->modes[i];
+        }
+    }
+
+    *uiPlane = NULL;
+    for (uint32_t i = 0; i < planes->count && *mode && !*uiPlane; ++i) {
+        PlaneInfo_t* plane = &planes->planes[i];
+
+        // NB: Cached UI plane is not probed, the TEST_ONLY commit below validates it together with the pipeline.
+        if (plane->planeId == cache->planeId && plane->owner == PLANE_OWNER_NONE &&
+                plane->type == DRM_PLANE_TYPE_PRIMARY && (plane->possibleCrtcs & (1 << cache->crtcIndex))) {
+            plane->owner = PLANE_OWNER_UI;
+            plane->cached = 0;
+            *uiPlane = plane;
+        }
+    }
+
+    if (!*uiPlane) {
+        goto err_free_connector;
+    }
+
+    if (restoreDrmProperties(connectorProperties, cache->connectorPropertyIds)) {
+        goto err_release_plane;
+    }
+    if (restoreDrmProperties(crtcProperties, cache->crtcPropertyIds)) {
+        goto err_free_connector_properties;
+    }
+
+    Modifiers_t modifiers = {
+        .modifiers = cache->modifiers,
+        .modifiersCount = cache->modifiersCount
+    };
+
+    PipelineProbe_t probe = {
+        .fd = fd,
+        .device = device,
+        .modifiers = &modifiers,
+        .connectorId = cache->connectorId,
+        .connectorProperties = connectorProperties,
+        .crtcId = cache->crtcId,
+        .crtcProperties = crtcProperties,
+        .mode = *mode,
+        .plane = *uiPlane
+    };
+
+    // NB: The only commit that checks the whole cached pipeline, including its mode, modifiers and rotation.
+    if (testPlaneRotation(&probe, cache->planeRotation)) {
+        goto err_free_crtc_properties;
+    }
+
+    return 0;
+
+err_free_crtc_properties:
+    freeDrmProperties(crtcProperties);
+err_free_connector_properties:
+    freeDrmProperties(connectorProperties);
+err_release_plane:
+    releasePlane(*uiPlane);
+    *uiPlane = NULL;
+err_free_connector:
+    drmModeFreeConnector(*connector);
+    return -1;
+}
+
+/**
+ * Get a handle to the native window (without specifying what window is)
+ *
+ * This one should return a handle (an opaque pointer) that will be passed to |doEglCreateWindowSurface| as third
+ * argument.
+ */
+jlong getNativeWindowHandle(const char* displayId) {
+    if (!displayId) {
+        goto err;
+    }
+
+    int fd = open(displayId, O_RDWR);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", displayId, strerror(errno));
+        goto err;
+    }
+
+    drmModeResPtr resources = drmModeGetResources(fd);
+    if (!resources) {
+        if (errno == EOPNOTSUPP) {
+            fprintf(stderr, "%s is not a valid display id: %s\n", displayId, strerror(errno));
+        } else {
+            fprintf(stderr, "drmModeGetResources for %s failed: %s\n", displayId, strerror(errno));
+        }
+        goto err_close_fd;
+    }
+
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        fprintf(stderr, "Atomic modesetting is not supported by display with id %s\n", displayId);
+        goto err_close_fd;
+    }
+
+    DeviceInit_t deviceInit;
+    startDeviceInit(&deviceInit, fd);
+
+    // NB: Additional displays are only used when requested, the first connector found drives the main one.
+    const char* displays = getenv("JFX_EGL_DRM_DISPLAYS");
+    const int clone = displays && strcmp(displays, "clone") == 0;
+    const int extend = clone || (displays && strcmp(displays, "extend") == 0);
+
+    PlaneInventory_t planes;
+    memset(&planes, 0, sizeof (PlaneInventory_t));
+
+    // NB: Topology cache describes the main display only.
+    const char* cachePath = extend ? NULL : getenv("JFX_EGL_DRM_TOPOLOGY_CACHE");
+    if (cachePath && !*cachePath) {
+        cachePath = NULL;
+    }
+    const uint64_t topologyKey = cachePath ? getTopologyKey(displayId, fd) : 0;
+
+    TopologyCache_t cache;
+    memset(&cache, 0, sizeof (TopologyCache_t));
+
+    drmModeConnectorPtr connectors[MAX_OUTPUTS];
+    int connectorsCount = 0;
+    drmModeModeInfoPtr mode = NULL;
+    DrmProperties_t connectorProperties;
+    DrmProperties_t crtcProperties;
+    PlaneInfo_t* uiPlane = NULL;
+
+    // NB: Planes do not depend on the chosen connector, topology cache restores them along with the pipeline.
+    int cacheHit = 0;
+    if (cachePath && !readTopologyCache(cachePath, topologyKey, displayId, fd, &cache, &planes)) {
+        // NB: Cached pipeline is checked with a real buffer, which needs GBM device right away.
+        finishDeviceInit(&deviceInit);
+
+        cacheHit = deviceInit.device && !restoreTopology(fd, resources, deviceInit.device, &planes, &cache,
+                                                         &connectors[0], &mode, &connectorProperties,
+                                                         &crtcProperties, &uiPlane);
+        if (!cacheHit) {
+            fprintf(stderr, "Topology cache %s does not match display with id %s anymore, probing displays\n",
+                    cachePath, displayId);
+            freePlaneInventory(&planes);
+        }
+    }
+
+    if (!cacheHit && buildPlaneInventory(displayId, fd, &planes)) {
+        goto err_free_resources;
+    }
+
+    uint32_t encoderId;
+    uint32_t crtcId;
+    uint32_t crtcIndex;
+
+    if (cacheHit) {
+        connectorsCount = 1;
+        encoderId = cache.encoderId;
+        crtcId = cache.crtcId;
+        crtcIndex = cache.crtcIndex;
+    } else {
+        connectorsCount = findConnectedConnectors(displayId, fd, resources, connectors, extend ? MAX_OUTPUTS : 1);
+        if (!connectorsCount) {
+            goto err_free_planes;
+        }
+
+        mode = findPreferredMode(connectors[0]);
+        assert(mode);
+
+        if (getProperties(
+                    displayId, fd, connectors[0]->connector_id, DRM_MODE_OBJECT_CONNECTOR, &connectorProperties)) {
+            goto err_free_connector;
+        }
+
+        drmModeEncoderPtr encoder = findEncoder(displayId, fd, resources, connectors[0]);
+        if (!encoder) {
+            goto err_free_connector;
+        }
+
+        if (!encoder->crtc_id) {
+            fprintf(stderr, "No CRTC for encoder with id %d (display id: %s)\n", encoder->encoder_id, displayId);
+            drmModeFreeEncoder(encoder);
+            goto err_free_connector;
+        }
+
+        drmModeCrtcPtr crtc = findCrtc(displayId, fd, resources, encoder);
+        encoderId = encoder->encoder_id;
+        drmModeFreeEncoder(encoder);
+        if (!crtc) {
+            goto err_free_connector;
+        }
+
+        crtcId = crtc->crtc_id;
+        drmModeFreeCrtc(crtc);
+
+        if (getProperties(displayId, fd, crtcId, DRM_MODE_OBJECT_CRTC, &crtcProperties)) {
+            goto err_free_connector;
+        }
+
+        // NB: Planes refer to CRTCs by index in |possible_crtcs| mask.
+        crtcIndex = 0;
+        while (resources->crtcs[crtcIndex] != crtcId) {
+            ++crtcIndex;
+        }
+    }
+
+    drmModeConnectorPtr connector = connectors[0];
+    Output_t outputs[MAX_OUTPUTS - 1];
+    uint32_t outputsCount = 0;
+
+    uint32_t usedCrtcs = 1u << crtcIndex;
+    for (int i = 1; i < connectorsCount; ++i) {
+        const int outputCrtcIndex = findFreeCrtc(displayId, fd, resources, connectors[i], usedCrtcs);
+        if (outputCrtcIndex < 0) {
+            fprintf(stderr, "No free CRTC for connector with id %d (display id: %s)\n",
+                    connectors[i]->connector_id, displayId);
+            continue;
+        }
+
+        Output_t* output = &outputs[outputsCount];
+        output->connectorId = connectors[i]->connector_id;
+        output->crtcId = resources->crtcs[outputCrtcIndex];
+        output->crtcIndex = outputCrtcIndex;
+        output->plane = NULL;
+        memcpy(&output->mode, findOutputMode(connectors[i], mode), sizeof (drmModeModeInfo));
+
+        if (getProperties(
+                    displayId, fd, output->connectorId, DRM_MODE_OBJECT_CONNECTOR, &output->connectorProperties)) {
+            continue;
+        }
+        if (getProperties(displayId, fd, output->crtcId, DRM_MODE_OBJECT_CRTC, &output->crtcProperties)) {
+            freeDrmProperties(&output->connectorProperties);
+            continue;
+        }
+
+        usedCrtcs |= 1u << outputCrtcIndex;
+        ++outputsCount;
+    }
+
+    for (int i = 1; i < connectorsCount; ++i) {
+        drmModeFreeConnector(connectors[i]);
+    }
+
+    drmModeFreeResources(resources);
+    // NB: Connectors of additional displays are freed along with resources, error path relies on that.
+    resources = NULL;
+
+    if (!uiPlane) {
+        uiPlane =
+                allocatePlane(&planes, crtcIndex, crtcId, DRM_PLANE_TYPE_PRIMARY, DRM_FORMAT_ARGB8888, PLANE_OWNER_UI);
+    }
+    if (!uiPlane) {
+        fprintf(stderr, "Failed to find primary plane for CRTC with id %d (display id: %s)\n", crtcId, displayId);
+        goto err_free_outputs;
+    }
+
+    // NB: Cursor plane is driven by atomic commits. Without cursor plane, cursor is shown on a free overlay plane, so
+    //  that moving it does not require rendering. Legacy cursor API is used if there is no such plane either. Overlay
+    //  plane is only looked for here, it is taken once cursor is shown (see |acquireCursorOverlayPlane|).
+    uint8_t cursorSetZpos = 0;
+    uint64_t cursorZpos = 0;
+    PlaneInfo_t* cursorPlane =
+            allocatePlane(&planes, crtcIndex, crtcId, DRM_PLANE_TYPE_CURSOR, DRM_FORMAT_ARGB8888, PLANE_OWNER_CURSOR);
+    PlaneInfo_t* cursorOverlayPlane = NULL;
+    if (!cursorPlane) {
+        cursorOverlayPlane =
+                allocateCursorOverlayPlane(&planes, crtcIndex, crtcId, uiPlane, &cursorSetZpos, &cursorZpos);
+    }
+    if (cursorOverlayPlane) {
+        releasePlane(cursorOverlayPlane);
+    }
+
+    finishDeviceInit(&deviceInit);
+    struct gbm_device* gbmDevice = deviceInit.device;
+    EGLDisplay eglDisplay = deviceInit.display;
+    deviceInit.device = NULL;
+    deviceInit.display = EGL_NO_DISPLAY;
+    if (!gbmDevice) {
+        fprintf(stderr, "Failed to create GBM device for display with id %s: %s\n",
+                displayId, strerror(deviceInit.error));
+        goto err_free_outputs;
+    }
+
+    Modifiers_t modifiers = {
+        .modifiers = NULL,
+        .modifiersCount = 0
+    };
+
+    if (cacheHit && cache.modifiersCount) {
+        modifiers.modifiers = malloc(sizeof (uint64_t) * cache.modifiersCount);
+        if (!modifiers.modifiers) {
+            fprintf(stderr, "Failed to allocate modifiers array\n");
+            goto err_destroy_device;
+        }
+
+        memcpy(modifiers.modifiers, cache.modifiers, sizeof (uint64_t) * cache.modifiersCount);
+        modifiers.modifiersCount = cache.modifiersCount;
+    } else if (uiPlane->inFormatsBlobId) {
+        modifiers = getPlaneFormatModifiers(fd, uiPlane->inFormatsBlobId, DRM_FORMAT_ARGB8888);
+    }
+
+    // NB: Modifiers are freed once buffers are created, cache keeps a copy to be written on success.
+    if (cachePath && !cacheHit) {
+        cache.modifiersCount = modifiers.modifiersCount;
+        if (modifiers.modifiersCount <= TOPOLOGY_CACHE_MAX_MODIFIERS) {
+            for (uint32_t i = 0; i < modifiers.modifiersCount; ++i) {
+                cache.modifiers[i] = modifiers.modifiers[i];
+            }
+        }
+    }
+
+    struct gbm_surface* surface = NULL;
+    Swapchain_t swapchain = {
+        .buffersCount = 0
+    };
+
+    const int lowMemory = isEnabled("JFX_EGL_DRM_LOW_MEMORY");
+
+    // NB: Low memory mode keeps gbm_surface by default. It holds 2 buffers at most, as the previous front buffer is
+    //  released once the next one is committed.
+    const char* swapchainType = getenv("JFX_EGL_DRM_SWAPCHAIN");
+
+    const int frontBufferRendering = swapchainType && strcmp(swapchainType, "front") == 0;
+    const int swapchainRequested = frontBufferRendering || (swapchainType && strcmp(swapchainType, "bo") == 0);
+
+    PipelineProbe_t probe = {
+        .fd = fd,
+        .device = gbmDevice,
+        .modifiers = &modifiers,
+        .connectorId = connector->connector_id,
+        .connectorProperties = &connectorProperties,
+        .crtcId = crtcId,
+        .crtcProperties = &crtcProperties,
+        .mode = mode,
+        .plane = uiPlane
+    };
+
+    const uint32_t rotation = getRequestedRotation();
+    // NB: Cached rotation has passed TEST_ONLY commit already.
+    uint64_t planeRotation = cacheHit ? cache.planeRotation : 0;
+
+    // NB: Own swapchain is filled by scanout blit, which rotates frames along the way.
+    if (rotation && !swapchainRequested && !cacheHit) {
+        // NB: Rotating by plane saves a full screen copy per frame.
+        planeRotation = findPlaneRotation(&probe, rotation);
+    }
+
+    const int useSwapchain = swapchainRequested || (rotation && !planeRotation);
+    if (rotation && !planeRotation && !swapchainRequested) {
+        fprintf(stderr, "Plane with id %i can't rotate buffers by %i degrees, rotating them with GPU\n",
+                uiPlane->planeId, rotation);
+    }
+
+    // NB: Front buffer damage is flushed to the main display only. Mirroring displays are rotated the same way the main
+    //  one is, but rotated desktop would have to be split into differently transformed parts.
+    if (outputsCount && ((rotation && !clone) || frontBufferRendering)) {
+        fprintf(stderr, "Additional displays are not supported with %s, using the main display only\n",
+                frontBufferRendering ? "front buffer rendering" : "screen rotation");
+        freeOutputs(outputs, outputsCount);
+        outputsCount = 0;
+    }
+
+    // Screen size as seen by the renderer.
+    const uint32_t screenWidth = rotation % 180 ? mode->vdisplay : mode->hdisplay;
+    const uint32_t screenHeight = rotation % 180 ? mode->hdisplay : mode->vdisplay;
+
+    uint32_t planesFound = 0;
+    for (uint32_t i = 0; i < outputsCount; ++i) {
+        Output_t* output = &outputs[i];
+        PlaneInfo_t* plane = allocatePlane(
+                    &planes, output->crtcIndex, output->crtcId, DRM_PLANE_TYPE_PRIMARY, DRM_FORMAT_ARGB8888,
+                    PLANE_OWNER_UI);
+
+        if (plane && planeRotation && (plane->rotations & planeRotation) != planeRotation) {
+            fprintf(stderr, "Plane with id %i can't rotate buffers as the main display plane does\n",
+                    plane->planeId);
+            releasePlane(plane);
+            plane = NULL;
+        }
+
+        const uint32_t width = output->mode.hdisplay;
+        const uint32_t height = output->mode.vdisplay;
+        if (plane && clone && (width != mode->hdisplay || height != mode->vdisplay) && !plane->mayScaleByType) {
+            fprintf(stderr, "Plane with id %i can't scale %ux%u picture to %ux%u display\n",
+                    plane->planeId, mode->hdisplay, mode->vdisplay, width, height);
+            releasePlane(plane);
+            plane = NULL;
+        }
+
+        if (!plane) {
+            fprintf(stderr, "Failed to find primary plane for CRTC with id %d, display of connector with id %d "
+                    "is not used (display id: %s)\n", output->crtcId, output->connectorId, displayId);
+            freeOutputs(output, 1);
+            continue;
+        }
+
+        output->plane = plane;
+        output->connected = 1;
+        output->doModeset = 1;
+        outputs[planesFound++] = *output;
+    }
+    outputsCount = planesFound;
+
+    uint32_t desktopWidth;
+    uint32_t desktopHeight;
+    layOutOutputs(outputs, outputsCount, clone, mode, &desktopWidth, &desktopHeight);
+
+    // NB: Every display may be fine on its own, while CRTCs, planes, clocks or memory bandwidth are not enough for all
+    //  of them together. Displays are added one at a time then, and the ones that don't fit are not used.
+    if (outputsCount && testOutputs(&probe, outputs, outputsCount, clone, planeRotation, desktopWidth, desktopHeight)) {
+        uint32_t outputsFit = 0;
+        for (uint32_t i = 0; i < outputsCount; ++i) {
+            outputs[outputsFit] = outputs[i];
+            layOutOutputs(outputs, outputsFit + 1, clone, mode, &desktopWidth, &desktopHeight);
+
+            if (testOutputs(&probe, outputs, outputsFit + 1, clone, planeRotation, desktopWidth, desktopHeight)) {
+                fprintf(stderr, "Display of connector with id %d can't be driven along with the other ones, it is "
+                        "not used (display id: %s)\n", outputs[outputsFit].connectorId, displayId);
+                releasePlane(outputs[outputsFit].plane);
+                freeOutputs(&outputs[outputsFit], 1);
+            } else {
+                ++outputsFit;
+            }
+        }
+
+        outputsCount = outputsFit;
+        layOutOutputs(outputs, outputsCount, clone, mode, &desktopWidth, &desktopHeight);
+    }
+
+    // NB: Buffers are of rotated size when plane rotates them, and of mode size when scanout blit draws to them.
+    const int swapSize = rotation % 180 && !useSwapchain;
+    const uint32_t surfaceWidth = swapSize ? mode->vdisplay : desktopWidth;
+    const uint32_t surfaceHeight = swapSize ? mode->hdisplay : desktopHeight;
+
+    if (useSwapchain) {
+        int buffersCount = 2;
+        uint32_t flags = GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT;
+
+        if (frontBufferRendering) {
+            // NB: The only buffer is scanned out while scanout blit draws to it.
+            buffersCount = 1;
+            flags |= GBM_BO_USE_FRONT_RENDERING_FLAG;
+        } else if (swapchainRequested) {
+            buffersCount = getEnvInt("JFX_EGL_DRM_SWAPCHAIN_BUFFERS", 2);
+            if (buffersCount < 2 || buffersCount > MAX_SWAPCHAIN_BUFFERS) {
+                fprintf(stderr, "Swapchain buffers count should be in [2, %i] range, using 2\n",
+                        MAX_SWAPCHAIN_BUFFERS);
+                buffersCount = 2;
+            }
+
+            if (lowMemory && buffersCount > 2) {
+                fprintf(stderr, "Swapchain is limited to 2 buffers in low memory mode\n");
+                buffersCount = 2;
+            }
+        }
+
+        // NB: Window surface is only sampled by scanout blit, so it is not scanned out, and it is of rotated size.
+        surface = gbm_surface_create(
+                    gbmDevice,
+                    rotation % 180 ? surfaceHeight : surfaceWidth,
+                    rotation % 180 ? surfaceWidth : surfaceHeight,
+                    DRM_FORMAT_ARGB8888,
+                    GBM_BO_USE_RENDERING
+        );
+        if (surface && createSwapchain(
+                    displayId,
+                    &swapchain,
+                    gbmDevice,
+                    surfaceWidth,
+                    surfaceHeight,
+                    &modifiers,
+                    buffersCount,
+                    flags)) {
+            free(modifiers.modifiers);
+            goto err_destroy_surface;
+        }
+        free(modifiers.modifiers);
+    } else if (modifiers.modifiersCount) {
+        surface = gbm_surface_create_with_modifiers(
+                    gbmDevice,
+                    surfaceWidth,
+                    surfaceHeight,
+                    DRM_FORMAT_ARGB8888,
+                    modifiers.modifiers,
+                    modifiers.modifiersCount
+        );
+        free(modifiers.modifiers);
+    } else {
+        surface = gbm_surface_create(
+                    gbmDevice,
+                    surfaceWidth,
+                    surfaceHeight,
+                    DRM_FORMAT_ARGB8888,
+                    GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT
+        );
+    }
+
+    if (!surface) {
+        fprintf(stderr, "Failed to create GBM surface for display with id %s: %s\n",
+                displayId, strerror(errno));
+        goto err_destroy_device;
+    }
+
+    DisplayHandle_t* handle = malloc(sizeof (DisplayHandle_t));
+    if (!handle) {
+        fprintf(stderr, "Failed to allocate NativeWindowHandle struct\n");
+        goto err_destroy_surface;
+    }
+
+    snprintf(handle->displayId, sizeof (handle->displayId), "%s", displayId);
+    handle->connectorId = connector->connector_id;
+    handle->connectorProperties = connectorProperties;
+    handle->encoderId = encoderId;
+    handle->crtcId = crtcId;
+    handle->crtcIndex = crtcIndex;
+    handle->crtcProperties = crtcProperties;
+    handle->planes = planes;
+    // NB: Planes restored from topology cache are probed later, after the caller's display id is gone.
+    handle->planes.displayId = handle->displayId;
+    handle->uiPlane = uiPlane;
+    handle->cursorPlane = cursorPlane;
+    handle->cursorOnOverlay = cursorOverlayPlane != NULL;
+    handle->cursorSetZpos = cursorSetZpos;
+    handle->cursorZpos = cursorZpos;
+    // NB: Overlay plane that is taken later is chosen the same way, so cursor images are prepared for it right away.
+    handle->cursorBlendMode =
+            chooseCursorBlendMode(cursorPlane ? cursorPlane : cursorOverlayPlane, &handle->premultiplyCursor);
+    handle->cursorWidth = getCursorCap(fd, DRM_CAP_CURSOR_WIDTH);
+    handle->cursorHeight = getCursorCap(fd, DRM_CAP_CURSOR_HEIGHT);
+    handle->planeId = uiPlane->planeId;
+    handle->planeProperties = &uiPlane->properties;
+    handle->fd = fd;
+    handle->device = gbmDevice;
+    handle->surface = surface;
+    handle->swapchain = swapchain;
+    handle->planeRotation = planeRotation;
+    handle->rotation = rotation;
+    handle->width = screenWidth;
+    handle->height = screenHeight;
+    handle->surfaceWidth = surfaceWidth;
+    handle->surfaceHeight = surfaceHeight;
+    handle->display = eglDisplay;
+    handle->previousBo = NULL;
+    handle->connected = 1;
+    handle->doModeset = 1;
+    handle->modeBlobsCount = 0;
+    handle->scanoutFramebufferId = 0;
+    handle->damage.count = 0;
+    handle->damage.overflow = 0;
+    handle->dirtyFramebufferUnsupported = 0;
+    handle->lowMemory = lowMemory;
+    handle->lastCommitNs = 0;
+
+    memset(&handle->scanoutBlit, 0, sizeof (ScanoutBlit_t));
+
+    memcpy(handle->outputs, outputs, sizeof (Output_t) * outputsCount);
+    handle->outputsCount = outputsCount;
+    handle->cloneOutputs = clone;
+    handle->offsetY = desktopHeight - mode->vdisplay;
+
+    memset(&handle->video, 0, sizeof (VideoLayer_t));
+    memset(handle->layers, 0, sizeof (handle->layers));
+    pthread_mutex_init(&handle->commitMutex, NULL);
+    pthread_mutex_init(&handle->videoMutex, NULL);
+    pthread_mutex_init(&handle->hotplugMutex, NULL);
+
+    memset(&handle->opacity, 0, sizeof (Opacity_t));
+    handle->opacity.from = OPAQUE;
+    handle->opacity.to = OPAQUE;
+    handle->opacityDirty = 0;
+    handle->commitThreadStarted = 0;
+    handle->commitThreadStop = 0;
+    handle->wakeRequested = 0;
+    pthread_mutex_init(&handle->wakeMutex, NULL);
+
+    // NB: Commit thread waits with timeout measured by |getTimeNs| clock.
+    pthread_condattr_t conditionAttributes;
+    pthread_condattr_init(&conditionAttributes);
+    pthread_condattr_setclock(&conditionAttributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&handle->commitCondition, &conditionAttributes);
+    pthread_condattr_destroy(&conditionAttributes);
+
+    memcpy(&handle->mode, mode, sizeof (drmModeModeInfo));
+
+    handle->frameBudgetNs = getFrameDurationNs(&handle->mode);
+    initDynamicResolution(&handle->dynamicResolution, handle->width, handle->height, handle->frameBudgetNs);
+
+    // NB: Extending displays would show parts of the frame rendered at the lowered resolution. Mirroring ones scale
+    //  the rendered part just like the main display does, if their planes can scale at all.
+    int outputsScale = handle->cloneOutputs;
+    for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+        outputsScale &= handle->outputs[i].plane->mayScaleByType;
+    }
+
+    if (handle->outputsCount && !outputsScale && handle->dynamicResolution.enabled) {
+        fprintf(stderr, "Dynamic resolution is not supported with additional displays\n");
+        handle->dynamicResolution.enabled = 0;
+    }
+
+    currentDisplayHandle = handle;
+
+    if (cachePath && !cacheHit) {
+        writeTopologyCache(cachePath, topologyKey, &cache, handle, connector);
+    }
+
+    if (lowMemory) {
+        // NB: Properties metadata is not needed anymore, keep property ids only.
+        compactDrmProperties(&handle->connectorProperties);
+        compactDrmProperties(&handle->crtcProperties);
+
+        for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+            compactDrmProperties(&handle->outputs[i].connectorProperties);
+            compactDrmProperties(&handle->outputs[i].crtcProperties);
+        }
+
+        for (uint32_t i = 0; i < handle->planes.count; ++i) {
+            compactDrmProperties(&handle->planes.planes[i].properties);
+        }
+    }
+
+    drmModeFreeConnector(connector);
+
+    // NB: Started once properties are compacted, hotplug thread uses them.
+    startHotplugMonitor(handle);
+
+    return (jlong) surface;
+
+err_destroy_surface:
+    if (surface) {
+        gbm_surface_destroy(surface);
+    }
+    destroySwapchain(&swapchain, EGL_NO_DISPLAY);
+err_destroy_device:
+    if (eglDisplay != EGL_NO_DISPLAY) {
+        eglTerminate(eglDisplay);
+    }
+    gbm_device_destroy(gbmDevice);
+err_free_outputs:
+    freeOutputs(outputs, outputsCount);
+err_free_connector:
+    drmModeFreeConnector(connectors[0]);
+    for (int i = 1; resources && i < connectorsCount; ++i) {
+        drmModeFreeConnector(connectors[i]);
+    }
+err_free_planes:
+    freePlaneInventory(&planes);
+err_free_resources:
+    drmModeFreeResources(resources);
+    cancelDeviceInit(&deviceInit);
+err_close_fd:
+    close(fd);
+err:
+    return (jlong) NULL;
+}
+
+/**
+ * Get a handle to the EGL display
+ */
+jlong getEglDisplayHandle() {
+    DisplayHandle_t* handle = currentDisplayHandle;
+
+    if (!handle) {
+        return (jlong) NULL;
+    }
+
+    if (handle->display == EGL_NO_DISPLAY) {
+        handle->display = eglGetDisplay((EGLNativeDisplayType) currentDisplayHandle->device);
+    }
+
+    if (handle->display == EGL_NO_DISPLAY) {
+        fprintf(stderr, "Failed to get EGL display\n");
+        freeDisplayHandle(handle);
+        return (jlong) NULL;
+    }
+
+    return (jlong) handle;
+}
+
+/**
+ * Initialize the EGL system with the specified handle
+ */
+jboolean doEglInitialize(void* displayHandle) {
+    if (!displayHandle) {
+        return JNI_FALSE;
+    }
+
+    DisplayHandle_t* handle = (DisplayHandle_t*) displayHandle;
+    EGLBoolean result = eglInitialize(handle->display, NULL, NULL);
+
+    if (result == EGL_FALSE) {
+        fprintf(stderr, "EGL initialization failed\n");
+        freeDisplayHandle(handle);
+    }
+
+    return result;
+}
+
+/**
+ * Bind a specific API to the EGL system
+ */
+jboolean doEglBindApi(int api) {
+    EGLBoolean result = eglBindAPI(api);
+
+    if (result == EGL_FALSE) {
+        fprintf(stderr, "Failed to bind EGL API\n");
+    }
+
+    return result;
+}
+
+/**
+ * Instruct the system to choose an EGL configuration matching the provided attributes
+ */
+jlong doEglChooseConfig(jlong eglDisplay, int* attribs) {
+    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
+    if (!handle) {
+        return -1;
+    }
+
+    EGLDisplay display = handle->display;
+
+    EGLint configsCount;
+
+    if (!eglGetConfigs(display, NULL, 0, &configsCount)) {
+        fprintf(stderr, "Failed to get EGL configurations count\n");
+        goto err;
+    }
+
+    EGLConfig* configs = malloc(sizeof (EGLConfig) * configsCount);
+    if (!configs) {
+        fprintf(stderr, "Failed to allocate EGL configerations array\n");
+        goto err;
+    }
+
+    // See com.sun.prism.es2.GLPixelFormat.Attributes for attribs pointer indices mapping.
+    const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE, attribs[6] != 0 ? EGL_WINDOW_BIT : EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, attribs[0],
+        EGL_GREEN_SIZE, attribs[1],
+        EGL_BLUE_SIZE, attribs[2],
+        EGL_ALPHA_SIZE, attribs[3],
+        EGL_DEPTH_SIZE, attribs[4],
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE
+    };
+
+    EGLint chosenCount = 0;
+    if (eglChooseConfig(display, configAttributes, configs, configsCount, &chosenCount) == EGL_FALSE || !chosenCount) {
+        fprintf(stderr, "Failed to choose EGL configuration\n");
+        free(configs);
+        goto err;
+    }
+
+    EGLConfig config = NULL;
+
+    for (EGLint i = 0; i < chosenCount; ++i) {
+        EGLint nativeVisualId;
+
+        if (eglGetConfigAttrib(display, configs[i], EGL_NATIVE_VISUAL_ID, &nativeVisualId) == EGL_FALSE) {
+                fprintf(stderr, "Failed to get EGL framebuffer configuration\n");
+                continue;
+        }
+
+        if (nativeVisualId == DRM_FORMAT_ARGB8888) {
+            config = configs[i];
+            break;
+        }
+    }
+
+    free(configs);
+
+    if (!config) {
+        fprintf(stderr, "Failed to find EGL configuration\n");
+        goto err;
+    }
+
+    return (jlong) config;
+err:
+    freeDisplayHandle(handle);
+    return -1;
+}
+
+static int hasExtension(const char* extensions, const char* name) {
+    const size_t length = strlen(name);
+
+    for (const char* position = extensions; position && (position = strstr(position, name)); position += length) {
+        if ((position == extensions || position[-1] == ' ') && (position[length] == ' ' || !position[length])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create an EGL Surface for the given display, configuration and window
+ */
+jlong doEglCreateWindowSurface(jlong eglDisplay, jlong eglConfig, jlong eglNativeWindow) {
+    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
+    if (!handle) {
+        return (jlong) EGL_NO_SURFACE;
+    }
+
+    EGLConfig config = (EGLConfig) eglConfig;
+    EGLNativeWindowType nativeWindow = (EGLNativeWindowType) eglNativeWindow;
+
+    EGLSurface surface = eglCreateWindowSurface(handle->display, config, nativeWindow, NULL);
+    if (surface == EGL_NO_SURFACE) {
+        fprintf(stderr, "Failed to create EGL window surface\n");
+        freeDisplayHandle(handle);
+    }
+
+    return (jlong) surface;
+}
+
+/**
+ * Create an EGL Context for the given display and configuration
+ */
+jlong doEglCreateContext(jlong eglDisplay, jlong eglConfig) {
+    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
+    if (!handle) {
+        return (jlong) EGL_NO_CONTEXT;
+    }
+
+    EGLConfig config = (EGLConfig) eglConfig;
+
+    static const EGLint contextAttributes[] = {
+            EGL_CONTEXT_CLIENT_VERSION, 2,
+            EGL_NONE
+    };
+
+    EGLContext context = eglCreateContext(handle->display, config, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Failed to create EGL context\n");
+        freeDisplayHandle(handle);
+    }
+
+    return (jlong) context;
+}
+
+static struct SwapchainFunctions {
+    PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
+    PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
+    PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC glEGLImageTargetRenderbufferStorageOES;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+} swapchainFunctions = {
+    .eglCreateImageKHR = NULL,
+    .eglDestroyImageKHR = NULL,
+    .glEGLImageTargetRenderbufferStorageOES = NULL,
+    .glEGLImageTargetTexture2DOES = NULL
+};
+
+static EGLImageKHR createEglImage(EGLDisplay display, struct gbm_bo* bo) {
+    static const EGLint planeAttributes[4][5] = {
+        {
+            EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT,
+            EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT
+        },
+        {
+            EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT,
+            EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT
+        },
+        {
+            EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT,
+            EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT
+        },
+        {
+            EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT,
+            EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT
+        }
+    };
+
+    const uint64_t modifier = gbm_bo_get_modifier(bo);
+    const int planesCount = gbm_bo_get_plane_count(bo);
+
+    EGLint attributes[7 + 4 * 10] = {
+        EGL_WIDTH, gbm_bo_get_width(bo),
+        EGL_HEIGHT, gbm_bo_get_height(bo),
+        EGL_LINUX_DRM_FOURCC_EXT, gbm_bo_get_format(bo)
+    };
+    int attributesCount = 6;
+    int fds[4] = { -1, -1, -1, -1 };
+
+    EGLImageKHR image = EGL_NO_IMAGE_KHR;
+
+    for (int i = 0; i < planesCount && i < 4; ++i) {
+        fds[i] = gbm_bo_get_fd_for_plane(bo, i);
+        if (fds[i] < 0) {
+            fprintf(stderr, "Failed to export swapchain buffer plane %i: %s\n", i, strerror(errno));
+            goto out;
+        }
+
+        attributes[attributesCount++] = planeAttributes[i][0];
+        attributes[attributesCount++] = fds[i];
+        attributes[attributesCount++] = planeAttributes[i][1];
+        attributes[attributesCount++] = gbm_bo_get_offset(bo, i);
+        attributes[attributesCount++] = planeAttributes[i][2];
+        attributes[attributesCount++] = gbm_bo_get_stride_for_plane(bo, i);
+
+        if (modifier != DRM_FORMAT_MOD_INVALID) {
+            attributes[attributesCount++] = planeAttributes[i][3];
+            attributes[attributesCount++] = modifier & 0xffffffff;
+            attributes[attributesCount++] = planeAttributes[i][4];
+            attributes[attributesCount++] = modifier >> 32;
+        }
+    }
+    attributes[attributesCount] = EGL_NONE;
+
+    image = swapchainFunctions.eglCreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attributes);
+    if (image == EGL_NO_IMAGE_KHR) {
+        fprintf(stderr, "Failed to create EGL image for swapchain buffer (error: 0x%x)\n", eglGetError());
+    }
+
+out:
+    // NB: EGL image holds its own references to the buffer.
+    for (int i = 0; i < 4; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    return image;
+}
+
+// Should be called with the context current.
+static int createSwapchainFramebuffers(Swapchain_t* swapchain, EGLDisplay display) {
+    if (!swapchainFunctions.eglCreateImageKHR) {
+        swapchainFunctions.eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
+        swapchainFunctions.eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC) eglGetProcAddress("eglDestroyImageKHR");
+        swapchainFunctions.glEGLImageTargetRenderbufferStorageOES = (PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC)
+                eglGetProcAddress("glEGLImageTargetRenderbufferStorageOES");
+        swapchainFunctions.glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+                eglGetProcAddress("glEGLImageTargetTexture2DOES");
+    }
+
+    if (!swapchainFunctions.eglCreateImageKHR ||
+            !swapchainFunctions.eglDestroyImageKHR ||
+            !swapchainFunctions.glEGLImageTargetRenderbufferStorageOES) {
+        fprintf(stderr, "EGL image functions are not available\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < swapchain->buffersCount; ++i) {
+        SwapchainBuffer_t* buffer = &swapchain->buffers[i];
+
+        buffer->image = createEglImage(display, buffer->bo);
+        if (buffer->image == EGL_NO_IMAGE_KHR) {
+            return -1;
+        }
+
+        glGenRenderbuffers(1, &buffer->colorRenderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, buffer->colorRenderbuffer);
+        swapchainFunctions.glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER, buffer->image);
+
+        glGenFramebuffers(1, &buffer->framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, buffer->framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, buffer->colorRenderbuffer);
+
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Swapchain framebuffer is incomplete (status: 0x%x)\n", status);
+            return -1;
+        }
+    }
+
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    return 0;
+}
+
+static void destroySwapchain(Swapchain_t* swapchain, EGLDisplay display) {
+    // NB: GL objects are destroyed along with the context.
+    for (uint32_t i = 0; i < swapchain->buffersCount; ++i) {
+        SwapchainBuffer_t* buffer = &swapchain->buffers[i];
+
+        if (buffer->image != EGL_NO_IMAGE_KHR && display != EGL_NO_DISPLAY) {
+            swapchainFunctions.eglDestroyImageKHR(display, buffer->image);
+        }
+
+        gbm_bo_destroy(buffer->bo);
+    }
+
+    swapchain->buffersCount = 0;
+}
+
+static const char scanoutBlitVertexShader[] =
+    "attribute vec2 position;\n"
+    "attribute vec2 texCoord;\n"
+    "varying vec2 fragTexCoord;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(position, 0.0, 1.0);\n"
+    "    fragTexCoord = texCoord;\n"
+    "}\n";
+
+static const char scanoutBlitFragmentShader[] =
+    "precision mediump float;\n"
+    "uniform sampler2D texture;\n"
+    "varying vec2 fragTexCoord;\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(texture, fragTexCoord);\n"
+    "}\n";
+
+static GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        fprintf(stderr, "Failed to compile scanout blit shader\n");
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+// Should be called with the context current.
+static int createScanoutBlit(ScanoutBlit_t* blit, Swapchain_t* swapchain, EGLDisplay display) {
+    // NB: Window surface buffers are sampled through dmabuf EGL images.
+    if (!hasExtension(eglQueryString(display, EGL_EXTENSIONS), "EGL_EXT_image_dma_buf_import")) {
+        fprintf(stderr, "EGL_EXT_image_dma_buf_import is required for own swapchain\n");
+        return -1;
+    }
+
+    // NB: Renderer expects framebuffer binding it had, swapchain framebuffers are only bound during the blit.
+    GLint boundFramebuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &boundFramebuffer);
+    const int result = createSwapchainFramebuffers(swapchain, display);
+    glBindFramebuffer(GL_FRAMEBUFFER, boundFramebuffer);
+    if (result) {
+        return -1;
+    }
+
+    if (!swapchainFunctions.glEGLImageTargetTexture2DOES) {
+        fprintf(stderr, "glEGLImageTargetTexture2DOES is not available\n");
+        return -1;
+    }
+
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, scanoutBlitVertexShader);
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, scanoutBlitFragmentShader);
+    if (!vertexShader || !fragmentShader) {
+        return -1;
+    }
+
+    blit->program = glCreateProgram();
+    glAttachShader(blit->program, vertexShader);
+    glAttachShader(blit->program, fragmentShader);
+    glBindAttribLocation(blit->program, 0, "position");
+    glBindAttribLocation(blit->program, 1, "texCoord");
+    glLinkProgram(blit->program);
+
+    // NB: Shaders are freed along with the program.
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(blit->program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        fprintf(stderr, "Failed to link scanout blit program\n");
+        return -1;
+    }
+
+    blit->created = 1;
+    return 0;
+}
+
+static void destroyScanoutBlit(ScanoutBlit_t* blit, EGLDisplay display) {
+    // NB: GL objects are destroyed along with the context.
+    for (int i = 0; i < MAX_SCANOUT_BLIT_SOURCES; ++i) {
+        if (blit->sources[i].image != EGL_NO_IMAGE_KHR && display != EGL_NO_DISPLAY) {
+            swapchainFunctions.eglDestroyImageKHR(display, blit->sources[i].image);
+        }
+    }
+}
+
+// Returns texture of window surface buffer |bo|, or zero on failure. Should be called with the context current.
+static GLuint getScanoutBlitSource(DisplayHandle_t* handle, struct gbm_bo* bo) {
+    ScanoutBlit_t* blit = &handle->scanoutBlit;
+
+    for (int i = 0; i < MAX_SCANOUT_BLIT_SOURCES; ++i) {
+        if (blit->sources[i].bo == bo) {
+            return blit->sources[i].texture;
+        }
+    }
+
+    // NB: Surface keeps reusing the same few buffers, so the least recently created texture is evicted.
+    ScanoutBlitSource_t* source = &blit->sources[blit->nextSource];
+    blit->nextSource = (blit->nextSource + 1) % MAX_SCANOUT_BLIT_SOURCES;
+
+    if (source->image != EGL_NO_IMAGE_KHR) {
+        swapchainFunctions.eglDestroyImageKHR(handle->display, source->image);
+        glDeleteTextures(1, &source->texture);
+    }
+    memset(source, 0, sizeof (ScanoutBlitSource_t));
+
+    source->image = createEglImage(handle->display, bo);
+    if (source->image == EGL_NO_IMAGE_KHR) {
+        return 0;
+    }
+
+    source->bo = bo;
+    glGenTextures(1, &source->texture);
+    glBindTexture(GL_TEXTURE_2D, source->texture);
+    swapchainFunctions.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, source->image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    return source->texture;
+}
+
+// Draws window surface buffer |bo| to swapchain buffer |framebuffer|, rotating it by screen rotation. Should be called
+//  with the context current.
+static int drawScanoutBlit(DisplayHandle_t* handle, struct gbm_bo* bo, GLuint framebuffer) {
+    ScanoutBlit_t* blit = &handle->scanoutBlit;
+    DynamicResolution_t* dynamicResolution = &handle->dynamicResolution;
+
+    // NB: Frame is rotated counter-clockwise, so each corner samples the point rotated clockwise. Target buffer is
+    //  scanned out from its first row, which is at the bottom of GL viewport, so display top is at y = -1. Window
+    //  surface buffer has its first row at the top of the frame, and dynamic resolution levels use its bottom-left
+    //  part.
+    static const int cosines[] = { 1, 0, -1, 0 };
+    static const int sines[] = { 0, 1, 0, -1 };
+    const int cosine = cosines[handle->rotation / 90];
+    const int sine = sines[handle->rotation / 90];
+    const float scaleX = (float) dynamicResolution->widths[dynamicResolution->level] / handle->width;
+    const float scaleY = (float) dynamicResolution->heights[dynamicResolution->level] / handle->height;
+
+    static const GLfloat positions[] = { -1.f, -1.f, 1.f, -1.f, -1.f, 1.f, 1.f, 1.f };
+    GLfloat texCoords[8];
+    for (int i = 0; i < 4; ++i) {
+        const GLfloat x = positions[i * 2];
+        const GLfloat y = -positions[i * 2 + 1];
+        texCoords[i * 2] = (cosine * x + sine * y + 1.f) / 2.f * scaleX;
+        texCoords[i * 2 + 1] = 1.f - (cosine * y - sine * x + 1.f) / 2.f * scaleY;
+    }
+
+    // NB: Renderer caches GL state, so everything that is changed here is restored afterwards. Vertex attribute
+    //  pointers are set by the renderer before each draw, so only their enabled state is kept.
+    GLint program, activeTexture, texture, arrayBuffer, boundFramebuffer, viewport[4], attributesEnabled[2];
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &texture);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &arrayBuffer);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &boundFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_ENABLED, &attributesEnabled[0]);
+    glGetVertexAttribiv(1, GL_VERTEX_ATTRIB_ARRAY_ENABLED, &attributesEnabled[1]);
+
+    const GLuint sourceTexture = getScanoutBlitSource(handle, bo);
+    if (!sourceTexture) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glActiveTexture(activeTexture);
+        return -1;
+    }
+
+    static const GLenum capabilities[] = { GL_BLEND, GL_SCISSOR_TEST, GL_DEPTH_TEST, GL_STENCIL_TEST, GL_CULL_FACE };
+    GLboolean capabilitiesEnabled[5];
+    for (int i = 0; i < 5; ++i) {
+        capabilitiesEnabled[i] = glIsEnabled(capabilities[i]);
+        glDisable(capabilities[i]);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, handle->surfaceWidth, handle->surfaceHeight);
+    glUseProgram(blit->program);
+    glBindTexture(GL_TEXTURE_2D, sourceTexture);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, positions);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texCoords);
+
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    for (int i = 0; i < 2; ++i) {
+        if (!attributesEnabled[i]) {
+            glDisableVertexAttribArray(i);
+        }
+    }
+    for (int i = 0; i < 5; ++i) {
+        if (capabilitiesEnabled[i]) {
+            glEnable(capabilities[i]);
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, boundFramebuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, arrayBuffer);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glActiveTexture(activeTexture);
+    glUseProgram(program);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    return 0;
+}
+
+/**
+ * Enable the specified EGL system
+ */
+jboolean doEglMakeCurrent(jlong eglDisplay, jlong eglDrawSurface, jlong eglReadSurface, jlong eglContext) {
+    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
+    if (!handle) {
+        return JNI_FALSE;
+    }
+
+    EGLSurface drawSurface = (EGLDisplay) eglDrawSurface;
+    EGLSurface readSurface = (EGLDisplay) eglReadSurface;
+    EGLContext context = (EGLContext) eglContext;
+
+    EGLBoolean result = eglMakeCurrent(handle->display, drawSurface, readSurface, context);
+    if (result == EGL_FALSE) {
+        fprintf(stderr, "eglMakeCurrent failed\n");
+        freeDisplayHandle(handle);
+        return result;
+    }
+
+    // NB: Window surface stays the default framebuffer for the renderer, own swapchain is only drawn to on swap.
+    ScanoutBlit_t* blit = &handle->scanoutBlit;
+    if (context != EGL_NO_CONTEXT && drawSurface != EGL_NO_SURFACE && handle->swapchain.buffersCount &&
+            !blit->created && createScanoutBlit(blit, &handle->swapchain, handle->display)) {
+        fprintf(stderr, "Failed to create scanout blit\n");
+        freeDisplayHandle(handle);
+        return EGL_FALSE;
+    }
+
+    return result;
+}
+
+static int addProperty(
+        drmModeAtomicReqPtr request,
+        DrmProperties_t* properties,
+        uint32_t objectId,
+        const char *name,
+        uint64_t value) {
+    const uint32_t propertyId = getPropertyId(properties, name);
+
+    if (!propertyId) {
+        fprintf(stderr, "Failed to find property \"%s\" for object id %i\n", name, objectId);
+        return -1;
+    }
+
+    if (drmModeAtomicAddProperty(request, objectId, propertyId, value) < 0) {
+        fprintf(stderr, "Failed to set property \"%s\" (id: %i) for object id %i: %s\n",
+                name, propertyId, objectId, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int addPlaneProperties(
+        drmModeAtomicReqPtr request,
+        DisplayHandle_t* handle,
+        uint32_t framebufferId,
+        uint32_t srcWidth,
+        uint32_t srcHeight) {
+    DrmProperties_t* properties = handle->planeProperties;
+    const uint32_t planeId = handle->planeId;
+
+    if (handle->swapchain.buffersCount) {
+        // NB: Scanout blit scales rendered part of the frame to the whole desktop on its own.
+        srcWidth = handle->mode.hdisplay;
+        srcHeight = handle->mode.vdisplay;
+    }
+
+    // NB: Source rectangle is anchored to the bottom-left corner, which is GL viewport origin. Scanout blit keeps this
+    //  layout in swapchain buffers.
+    const uint32_t srcY = handle->surfaceHeight - srcHeight;
+
+    int result = 0;
+
+    result |= addProperty(request, properties, planeId, "FB_ID", framebufferId);
+    result |= addProperty(request, properties, planeId, "CRTC_ID", handle->crtcId);
+    result |= addProperty(request, properties, planeId, "SRC_X", 0);
+    result |= addProperty(request, properties, planeId, "SRC_Y", (uint64_t) srcY << 16);
+    result |= addProperty(request, properties, planeId, "SRC_W", (uint64_t) srcWidth << 16);
+    result |= addProperty(request, properties, planeId, "SRC_H", (uint64_t) srcHeight << 16);
+    result |= addProperty(request, properties, planeId, "CRTC_X", 0);
+    result |= addProperty(request, properties, planeId, "CRTC_Y", 0);
+    result |= addProperty(request, properties, planeId, "CRTC_W", handle->mode.hdisplay);
+    result |= addProperty(request, properties, planeId, "CRTC_H", handle->mode.vdisplay);
+
+    if (handle->planeRotation) {
+        result |= addProperty(request, properties, planeId, "rotation", handle->planeRotation);
+    }
+
+    return result;
+}
+
+// Sets |mode| on |crtcId| driving |connectorId|. Mode blob is destroyed by |onModesetCommitted|.
+static int addModesetProperties(
+        drmModeAtomicReqPtr request,
+        DisplayHandle_t* handle,
+        uint32_t connectorId,
+        DrmProperties_t* connectorProperties,
+        uint32_t crtcId,
+        DrmProperties_t* crtcProperties,
+        drmModeModeInfoPtr mode) {
+    uint32_t blobId;
+    if (handle->modeBlobsCount == MAX_OUTPUTS ||
+            drmModeCreatePropertyBlob(handle->fd, mode, sizeof (drmModeModeInfo), &blobId) != 0) {
+        fprintf(stderr, "Failed to create mode blob for CRTC with id %i: %s\n", crtcId, strerror(errno));
+        return -1;
+    }
+    handle->modeBlobIds[handle->modeBlobsCount++] = blobId;
+
+    int result = 0;
+    result |= addProperty(request, connectorProperties, connectorId, "CRTC_ID", crtcId);
+    result |= addProperty(request, crtcProperties, crtcId, "MODE_ID", blobId);
+    result |= addProperty(request, crtcProperties, crtcId, "ACTIVE", 1);
+
+    // NB: Link that failed after replug (like DP link training failure) is retrained by modeset that resets its status.
+    if (getPropertyId(connectorProperties, "link-status")) {
+        result |= addProperty(request, connectorProperties, connectorId, "link-status", DRM_MODE_LINK_STATUS_GOOD);
+    }
+
+    return result;
+}
+
+// Forgets modeset of the last commit, successful or not. CRTCs keep references to their mode blobs.
+static void onModesetCommitted(DisplayHandle_t* handle, int committed) {
+    for (uint32_t i = 0; i < handle->modeBlobsCount; ++i) {
+        drmModeDestroyPropertyBlob(handle->fd, handle->modeBlobIds[i]);
+    }
+    handle->modeBlobsCount = 0;
+
+    if (!committed) {
+        return;
+    }
+
+    handle->doModeset = 0;
+    for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+        handle->outputs[i].doModeset = 0;
+    }
+}
+
+// Whether the next UI commit sets up or disables any CRTC.
+static int needsModeset(DisplayHandle_t* handle) {
+    int result = handle->doModeset;
+    for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+        result |= handle->outputs[i].doModeset;
+    }
+
+    return result;
+}
+
+// Shows parts of |framebufferId| on additional displays, or its rendered |srcWidth|x|srcHeight| part on mirroring ones.
+//  Sets their modes too, if |handle| needs modeset.
+static int addOutputsProperties(
+        drmModeAtomicReqPtr request,
+        DisplayHandle_t* handle,
+        uint32_t framebufferId,
+        uint32_t srcWidth,
+        uint32_t srcHeight) {
+    if (handle->swapchain.buffersCount) {
+        srcWidth = handle->mode.hdisplay;
+        srcHeight = handle->mode.vdisplay;
+    }
+
+    int result = 0;
+
+    for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+        Output_t* output = &handle->outputs[i];
+        DrmProperties_t* properties = &output->plane->properties;
+        const uint32_t planeId = output->plane->planeId;
+
+        if (!output->connected) {
+            if (output->doModeset) {
+                result |= addProperty(request, &output->connectorProperties, output->connectorId, "CRTC_ID", 0);
+                result |= addProperty(request, &output->crtcProperties, output->crtcId, "MODE_ID", 0);
+                result |= addProperty(request, &output->crtcProperties, output->crtcId, "ACTIVE", 0);
+                result |= addProperty(request, properties, planeId, "FB_ID", 0);
+                result |= addProperty(request, properties, planeId, "CRTC_ID", 0);
+            }
+            continue;
+        }
+
+        if (handle->doModeset || output->doModeset) {
+            result |= addModesetProperties(request, handle, output->connectorId, &output->connectorProperties,
+                                           output->crtcId, &output->crtcProperties, &output->mode);
+        }
+
+        const uint32_t width = handle->cloneOutputs ? srcWidth : output->mode.hdisplay;
+        const uint32_t height = handle->cloneOutputs ? srcHeight : output->mode.vdisplay;
+        // NB: See |addPlaneProperties|, displays are aligned to the bottom of the desktop.
+        const uint32_t srcY = handle->surfaceHeight - height;
+
+        result |= addProperty(request, properties, planeId, "FB_ID", framebufferId);
+        result |= addProperty(request, properties, planeId, "CRTC_ID", output->crtcId);
+        result |= addProperty(request, properties, planeId, "SRC_X", (uint64_t) output->x << 16);
+        result |= addProperty(request, properties, planeId, "SRC_Y", (uint64_t) srcY << 16);
+        result |= addProperty(request, properties, planeId, "SRC_W", (uint64_t) width << 16);
+        result |= addProperty(request, properties, planeId, "SRC_H", (uint64_t) height << 16);
+        result |= addProperty(request, properties, planeId, "CRTC_X", output->crtcX);
+        result |= addProperty(request, properties, planeId, "CRTC_Y", output->crtcY);
+        result |= addProperty(request, properties, planeId, "CRTC_W", output->crtcWidth);
+        result |= addProperty(request, properties, planeId, "CRTC_H", output->crtcHeight);
+
+        if (handle->planeRotation) {
+            result |= addProperty(request, properties, planeId, "rotation", handle->planeRotation);
+        }
+    }
+
+    return result;
+}
+
+// Frames in dynamic resolution measurement window.
+#define DYNAMIC_RESOLUTION_WINDOW 30
+// Missed frames in measurement window that trigger switch to lower level.
+#define DYNAMIC_RESOLUTION_MISSES_TO_DOWNSCALE 4
+// Consecutive frames with headroom that trigger switch to higher level.
+#define DYNAMIC_RESOLUTION_FRAMES_TO_UPSCALE 180
+
+// Checks with TEST_ONLY commit that |srcWidth|x|srcHeight| part of |framebufferId| can be shown on every display,
+//  scaled by mirroring planes as well, with pending modesets. Should be called with |commitMutex| held.
+static int testPlaneSource(DisplayHandle_t* handle, uint32_t framebufferId, uint32_t srcWidth, uint32_t srcHeight) {
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+    if (!request) {
+        return -1;
+    }
+
+    int result = 0;
+    if (handle->doModeset) {
+        result |= addModesetProperties(request, handle, handle->connectorId, &handle->connectorProperties,
+                                       handle->crtcId, &handle->crtcProperties, &handle->mode);
+    }
+
+    result |= addPlaneProperties(request, handle, framebufferId, srcWidth, srcHeight);
+    result |= addOutputsProperties(request, handle, framebufferId, srcWidth, srcHeight);
+
+    if (!result) {
+        const int flags = DRM_MODE_ATOMIC_TEST_ONLY | (needsModeset(handle) ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0);
+        result = drmModeAtomicCommit(handle->fd, request, flags, NULL);
+    }
+
+    onModesetCommitted(handle, 0);
+    drmModeAtomicFree(request);
+    return result;
+}
+
+// Gives up additional displays that are being set up, after a modeset commit failed. Displays are taken out newest
+//  first, until |srcWidth|x|srcHeight| part of |framebufferId| passes TEST_ONLY commit without them. Mirroring
+//  displays are removed along with their CRTCs and planes, extending ones keep their place (and plane) on the desktop.
+//  Either is set up again once plugged again. Only modeset of the main display is left to be retried by the next
+//  commit. Should be called with |commitMutex| held.
+static void dropFailedOutputs(
+        DisplayHandle_t* handle,
+        uint32_t framebufferId,
+        uint32_t srcWidth,
+        uint32_t srcHeight) {
+    for (uint32_t i = handle->outputsCount; i-- > 0;) {
+        Output_t* output = &handle->outputs[i];
+        if (!output->connected || !output->doModeset) {
+            continue;
+        }
+
+        fprintf(stderr, "Display of connector with id %d can't be set up along with the other ones, it is not used "
+                "until it is plugged again (display id: %s)\n", output->connectorId, handle->displayId);
+        output->connected = 0;
+        output->doModeset = 0;
+
+        if (handle->cloneOutputs) {
+            releasePlane(output->plane);
+            freeOutputs(output, 1);
+            memmove(output, output + 1, sizeof (Output_t) * (handle->outputsCount - i - 1));
+            --handle->outputsCount;
+        }
+
+        if (!testPlaneSource(handle, framebufferId, srcWidth, srcHeight)) {
+            return;
+        }
+    }
+}
+
+// Accounts frame that GPU finished rendering at |frameDoneNs|.
+static void updateDynamicResolution(DisplayHandle_t* handle, uint32_t framebufferId, uint64_t frameDoneNs) {
+    DynamicResolution_t* dynamicResolution = &handle->dynamicResolution;
+
+    const uint64_t frameStartNs = dynamicResolution->frameStartNs;
+    dynamicResolution->frameStartNs = 0;
+
+    if (!frameStartNs || frameDoneNs < frameStartNs) {
+        // Renderer did not query render scale for this frame.
+        return;
+    }
+
+    // NB: Frame is timed from the moment the renderer started it till GPU finished it, so the time renderer waits for
+    //  the next pulse (or for the scene to change) is not counted.
+    const uint64_t budgetNs = dynamicResolution->budgetNs;
+    const uint64_t frameNs = frameDoneNs - frameStartNs;
+    const int missed = frameNs > budgetNs;
+
+    ++dynamicResolution->windowFrames;
+    if (missed) {
+        ++dynamicResolution->missedFrames;
+        dynamicResolution->headroomFrames = 0;
+    } else if (frameNs < budgetNs / 2) {
+        ++dynamicResolution->headroomFrames;
+    } else {
+        dynamicResolution->headroomFrames = 0;
+    }
+
+    const uint32_t level = dynamicResolution->level;
+
+    if (dynamicResolution->windowFrames >= DYNAMIC_RESOLUTION_WINDOW) {
+        if (dynamicResolution->missedFrames >= DYNAMIC_RESOLUTION_MISSES_TO_DOWNSCALE &&
+                level + 1 < dynamicResolution->levelsCount) {
+            const uint32_t width = dynamicResolution->widths[level + 1];
+            const uint32_t height = dynamicResolution->heights[level + 1];
+
+            // NB: Hotplug changes displays with commit mutex held.
+            pthread_mutex_lock(&handle->commitMutex);
+            const int rejected =
+                    !handle->swapchain.buffersCount && testPlaneSource(handle, framebufferId, width, height);
+            pthread_mutex_unlock(&handle->commitMutex);
+
+            if (rejected) {
+                fprintf(stderr, "Display planes can't scale %ix%i source, limiting dynamic resolution ladder\n",
+                        width, height);
+                dynamicResolution->levelsCount = level + 1;
+            } else {
+                dynamicResolution->level = level + 1;
+            }
+        }
+
+        dynamicResolution->windowFrames = 0;
+        dynamicResolution->missedFrames = 0;
+    }
+
+    if (dynamicResolution->headroomFrames >= DYNAMIC_RESOLUTION_FRAMES_TO_UPSCALE && level > 0) {
+        dynamicResolution->level = level - 1;
+        dynamicResolution->headroomFrames = 0;
+        dynamicResolution->windowFrames = 0;
+        dynamicResolution->missedFrames = 0;
+    }
+}
+
+// Adds |clips| back to front buffer damage, which is taken when it can't be sent yet. Should be called with
+//  |commitMutex| held.
+static void restoreDamage(DisplayHandle_t* handle, const Damage_t* clips) {
+    Damage_t* damage = &handle->damage;
+
+    damage->overflow |= clips->overflow;
+    for (uint32_t i = 0; i < clips->count && !damage->overflow; ++i) {
+        if (damage->count == MAX_DAMAGE_CLIPS) {
+            damage->overflow = 1;
+        } else {
+            damage->clips[damage->count++] = clips->clips[i];
+        }
+    }
+}
+
+// Reports |damage| of front buffer with |framebufferId| by "FB_DAMAGE_CLIPS". Returns EBUSY if previous report is
+//  still pending.
+static int commitDamageClips(DisplayHandle_t* handle, uint32_t framebufferId, const Damage_t* damage) {
+    uint32_t blobId;
+    if (drmModeCreatePropertyBlob(handle->fd, damage->clips, sizeof (damage->clips[0]) * damage->count, &blobId)) {
+        fprintf(stderr, "Failed to create damage clips property blob: %s\n", strerror(errno));
+        return -1;
+    }
+
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+
+    int result = -1;
+
+    if (addProperty(request, handle->planeProperties, handle->planeId, "FB_ID", framebufferId) ||
+            addProperty(request, handle->planeProperties, handle->planeId, "FB_DAMAGE_CLIPS", blobId)) {
+        goto out;
+    }
+
+    // NB: Do not wait for vblank, this is what this mode is about.
+    pthread_mutex_lock(&handle->commitMutex);
+    result = drmModeAtomicCommit(handle->fd, request, DRM_MODE_ATOMIC_NONBLOCK, NULL) ? errno : 0;
+    pthread_mutex_unlock(&handle->commitMutex);
+
+    if (result && result != EBUSY) {
+        fprintf(stderr, "Failed to commit front buffer damage: %s\n", strerror(result));
+    }
+
+out:
+    drmModeAtomicFree(request);
+    // NB: Kernel holds its own reference to committed blob.
+    drmModeDestroyPropertyBlob(handle->fd, blobId);
+    return result;
+}
+
+// Reports |damage| of front buffer with |framebufferId| to drivers of manual update displays (like DSI command mode
+//  panels, SPI and USB displays), which only refresh what they are told is dirty.
+static int flushDirtyFramebuffer(DisplayHandle_t* handle, uint32_t framebufferId, const Damage_t* damage) {
+    if (handle->dirtyFramebufferUnsupported) {
+        return 0;
+    }
+
+    drmModeClip clips[MAX_DAMAGE_CLIPS];
+    for (uint32_t i = 0; i < damage->count; ++i) {
+        clips[i].x1 = damage->clips[i].x1;
+        clips[i].y1 = damage->clips[i].y1;
+        clips[i].x2 = damage->clips[i].x2;
+        clips[i].y2 = damage->clips[i].y2;
+    }
+
+    const int result = drmModeDirtyFB(handle->fd, framebufferId, clips, damage->count);
+    if (result == -ENOSYS) {
+        // NB: Display scans out buffer memory directly, there is nothing to notify.
+        handle->dirtyFramebufferUnsupported = 1;
+        return 0;
+    }
+
+    if (result) {
+        fprintf(stderr, "Failed to flush dirty framebuffer: %s\n", strerror(-result));
+        return -1;
+    }
+
+    return 0;
+}
+
+static jboolean updateFrontBuffer(DisplayHandle_t* handle, Swapchain_t* swapchain) {
+    // NB: Buffer is scanned out while scanout blit draws to it, so just make sure blit commands reach GPU.
+    glFlush();
+
+    BoAndFramebuffer_t* boAndFramebuffer = getOrCreateBoAndFramebuffer(swapchain->buffers[0].bo);
+    if (!boAndFramebuffer) {
+        fprintf(stderr, "Failed to get framebuffer for buffer object\n");
+        return JNI_FALSE;
+    }
+
+    // NB: Damage is added from other threads, so it is taken under the mutex.
+    pthread_mutex_lock(&handle->commitMutex);
+    Damage_t damage = handle->damage;
+    handle->damage.count = 0;
+    handle->damage.overflow = 0;
+    pthread_mutex_unlock(&handle->commitMutex);
+
+    Damage_t clips = damage;
+    if (!clips.count || clips.overflow) {
+        clips.clips[0].x1 = 0;
+        clips.clips[0].y1 = 0;
+        clips.clips[0].x2 = handle->surfaceWidth;
+        clips.clips[0].y2 = handle->surfaceHeight;
+        clips.count = 1;
+        clips.overflow = 0;
+    }
+
+    int result;
+    if (getPropertyId(handle->planeProperties, "FB_DAMAGE_CLIPS")) {
+        result = commitDamageClips(handle, boAndFramebuffer->framebufferId, &clips);
+    } else {
+        result = flushDirtyFramebuffer(handle, boAndFramebuffer->framebufferId, &clips);
+    }
+
+    if (result == EBUSY) {
+        // Previous update is still pending. Keep damage, it'll be sent with the next update.
+        pthread_mutex_lock(&handle->commitMutex);
+        restoreDamage(handle, &damage);
+        pthread_mutex_unlock(&handle->commitMutex);
+        return JNI_TRUE;
+    }
+
+    return result ? JNI_FALSE : JNI_TRUE;
+}
+
+static int isUiIdle(DisplayHandle_t* handle) {
+    return getTimeNs() - handle->lastCommitNs > 2 * handle->frameBudgetNs;
+}
+
+static int releaseCursorOverlayPlane(DisplayHandle_t* handle);
+
+static int findVideoPlane(DisplayHandle_t* handle, uint32_t format) {
+    VideoLayer_t* video = &handle->video;
+
+    PlaneInfo_t* plane =
+            allocatePlane(&handle->planes, handle->crtcIndex, handle->crtcId, DRM_PLANE_TYPE_OVERLAY, format,
+                          PLANE_OWNER_VIDEO);
+    if (!plane && !releaseCursorOverlayPlane(handle)) {
+        plane = allocatePlane(&handle->planes, handle->crtcIndex, handle->crtcId, DRM_PLANE_TYPE_OVERLAY, format,
+                              PLANE_OWNER_VIDEO);
+    }
+    if (!plane) {
+        fprintf(stderr, "Failed to find overlay plane for video format 0x%08x\n", format);
+        return -1;
+    }
+
+    video->plane = plane;
+    video->format = format;
+
+    // NB: UI plane is expected to be transparent where video is, so video should be placed below it if possible.
+    if (choosePlaneZpos(plane, handle->uiPlane, 0, &video->setZpos, &video->zpos)) {
+        fprintf(stderr, "Can't place video plane with id %i below UI plane, UI won't be visible over video\n",
+                plane->planeId);
+    }
+
+    return 0;
+}
+
+static uint16_t getOpacity(Opacity_t* opacity, uint64_t now) {
+    if (now >= opacity->startNs + opacity->durationNs) {
+        return opacity->to;
+    }
+
+    const int64_t delta = (int64_t) opacity->to - opacity->from;
+    return opacity->from + delta * (int64_t) (now - opacity->startNs) / (int64_t) opacity->durationNs;
+}
+
+static int isOpacityAnimated(Opacity_t* opacity, uint64_t now) {
+    return now < opacity->startNs + opacity->durationNs;
+}
+
+// Returns opacity of layer plane, which is layer own opacity (if any) multiplied by the display one.
+static uint16_t getLayerOpacity(DisplayHandle_t* handle, Opacity_t* layerOpacity, uint64_t now) {
+    const uint32_t opacity = getOpacity(&handle->opacity, now);
+    if (!layerOpacity) {
+        return opacity;
+    }
+
+    return opacity * getOpacity(layerOpacity, now) / OPAQUE;
+}
+
+static void addPlaneAlpha(drmModeAtomicReqPtr request, PlaneInfo_t* plane, uint16_t alpha) {
+    if (plane->hasAlpha) {
+        addProperty(request, &plane->properties, plane->planeId, "alpha", alpha);
+    }
+}
+
+static void addLayerPlaneProperties(
+        drmModeAtomicReqPtr request,
+        DisplayHandle_t* handle,
+        PlaneInfo_t* plane,
+        uint8_t visible,
+        uint32_t framebufferId,
+        uint32_t srcWidth,
+        uint32_t srcHeight,
+        int32_t x,
+        int32_t y,
+        uint32_t width,
+        uint32_t height,
+        uint8_t setZpos,
+        uint64_t zpos) {
+    DrmProperties_t* properties = &plane->properties;
+    const uint32_t planeId = plane->planeId;
+
+    if (!visible) {
+        addProperty(request, properties, planeId, "FB_ID", 0);
+        addProperty(request, properties, planeId, "CRTC_ID", 0);
+        return;
+    }
+
+    // NB: Layer bounds are in rotated screen coordinates. Layer contents are rotated only if its plane is able to.
+    rotateRect(handle->rotation, handle->width, handle->height, &x, &y, &width, &height);
+
+    addProperty(request, properties, planeId, "FB_ID", framebufferId);
+    addProperty(request, properties, planeId, "CRTC_ID", handle->crtcId);
+    addProperty(request, properties, planeId, "SRC_X", 0);
+    addProperty(request, properties, planeId, "SRC_Y", 0);
+    addProperty(request, properties, planeId, "SRC_W", (uint64_t) srcWidth << 16);
+    addProperty(request, properties, planeId, "SRC_H", (uint64_t) srcHeight << 16);
+    addProperty(request, properties, planeId, "CRTC_X", (uint64_t) (int64_t) x);
+    addProperty(request, properties, planeId, "CRTC_Y", (uint64_t) (int64_t) y);
+    addProperty(request, properties, planeId, "CRTC_W", width);
+    addProperty(request, properties, planeId, "CRTC_H", height);
+
+    if (setZpos) {
+        addProperty(request, properties, planeId, "zpos", zpos);
+    }
+
+    const uint64_t planeRotation = getPlaneRotation(plane, handle->rotation);
+    if (handle->rotation && planeRotation) {
+        addProperty(request, properties, planeId, "rotation", planeRotation);
+    }
+}
+
+// Adds changed video and static layers to the request. Returns zero if nothing was changed.
+static int addLayersProperties(drmModeAtomicReqPtr request, DisplayHandle_t* handle) {
+    int result = 0;
+
+    VideoLayer_t* video = &handle->video;
+    if (video->dirty) {
+        addLayerPlaneProperties(request, handle, video->plane, video->visible, video->pendingFramebufferId,
+                                video->srcWidth, video->srcHeight, video->x, video->y, video->width, video->height,
+                                video->setZpos, video->zpos);
+        if (video->visible) {
+            addPlaneAlpha(request, video->plane, getLayerOpacity(handle, NULL, getTimeNs()));
+        }
+        result = 1;
+    }
+
+    for (int i = 0; i < MAX_STATIC_LAYERS; ++i) {
+        StaticLayer_t* layer = &handle->layers[i];
+        if (!layer->dirty) {
+            continue;
+        }
+
+        struct gbm_bo* bo = layer->pendingBo ? layer->pendingBo : layer->bo;
+        const uint32_t framebufferId = bo ? getOrCreateBoAndFramebuffer(bo)->framebufferId : 0;
+
+        addLayerPlaneProperties(request, handle, layer->plane, layer->visible && bo, framebufferId,
+                                layer->srcWidth, layer->srcHeight, layer->x, layer->y, layer->width, layer->height,
+                                layer->setZpos, layer->zpos);
+        if (layer->visible && bo) {
+            addPlaneAlpha(request, layer->plane, getLayerOpacity(handle, &layer->opacity, getTimeNs()));
+        }
+        result = 1;
+    }
+
+    return result;
+}
+
+// Adds current opacity of UI plane and of layers that are not changed to the request. Should be called before
+//  |addLayersProperties|. Returns zero if opacity was not changed.
+static int addOpacityProperties(drmModeAtomicReqPtr request, DisplayHandle_t* handle) {
+    if (!handle->opacityDirty) {
+        return 0;
+    }
+
+    const uint64_t now = getTimeNs();
+
+    addPlaneAlpha(request, handle->uiPlane, getOpacity(&handle->opacity, now));
+
+    VideoLayer_t* video = &handle->video;
+    if (video->plane && video->visible && !video->dirty) {
+        addPlaneAlpha(request, video->plane, getLayerOpacity(handle, NULL, now));
+    }
+
+    for (int i = 0; i < MAX_STATIC_LAYERS; ++i) {
+        StaticLayer_t* layer = &handle->layers[i];
+        if (layer->plane && layer->bo && layer->visible && !layer->dirty) {
+            addPlaneAlpha(request, layer->plane, getLayerOpacity(handle, &layer->opacity, now));
+        }
+    }
+
+    return 1;
+}
+
+// Whether |bo| is scanned out, may still be scanned out until the next vblank, or is about to be scanned out. Should be
+//  called with commit mutex held.
+static int isCursorBoBusy(DisplayHandle_t* handle, struct gbm_bo* bo) {
+    if (bo == cursorState.cursorBo || bo == cursorState.committedBo) {
+        return 1;
+    }
+
+    // NB: Two frames, since it was replaced a bit before the ioctl that replaced it.
+    return bo == cursorState.replacedBo && getTimeNs() - cursorState.replacedNs <= 2 * handle->frameBudgetNs;
+}
+
+// Whether cursor is driven by legacy cursor API, as there is neither cursor plane nor overlay plane for it.
+static int usesLegacyCursor(DisplayHandle_t* handle) {
+    return !handle->cursorPlane && !handle->cursorOnOverlay;
+}
+
+// Takes overlay plane for cursor that is about to be shown. Returns non-zero if there is no free plane, cursor is not
+//  shown then. Should be called with commit mutex held.
+static int acquireCursorOverlayPlane(DisplayHandle_t* handle) {
+    if (handle->cursorPlane || !handle->cursorOnOverlay) {
+        return 0;
+    }
+
+    PlaneInfo_t* plane = allocateCursorOverlayPlane(
+                &handle->planes, handle->crtcIndex, handle->crtcId, handle->uiPlane, &handle->cursorSetZpos,
+                &handle->cursorZpos
+    );
+    if (!plane) {
+        fprintf(stderr, "Failed to find free overlay plane for cursor, it is not shown\n");
+        return -1;
+    }
+
+    handle->cursorPlane = plane;
+    handle->cursorBlendMode = chooseCursorBlendMode(plane, &handle->premultiplyCursor);
+    cursorState.dirty = 1;
+    return 0;
+}
+
+// Hands overlay plane of hidden cursor over to video or static layers, which are out of planes. Returns non-zero if
+//  there is no such plane. Should be called with commit mutex held.
+static int releaseCursorOverlayPlane(DisplayHandle_t* handle) {
+    // NB: Plane is released once hidden cursor is committed, so that it does not show up on the next owner's plane.
+    if (!handle->cursorOnOverlay || !handle->cursorPlane || cursorState.visible || cursorState.committedBo) {
+        return -1;
+    }
+
+    fprintf(stderr, "Handing overlay plane with id %i over from hidden cursor\n", handle->cursorPlane->planeId);
+    releasePlane(handle->cursorPlane);
+    handle->cursorPlane = NULL;
+    return 0;
+}
+
+static void destroyCursorBo(DisplayHandle_t* handle, struct gbm_bo* bo) {
+    if (usesLegacyCursor(handle)) {
+        // NB: Framebuffers are not created for legacy cursor API, so memory is accounted here.
+        subtractDisplayBuffersBytes(getBoSize(bo));
+    }
+    gbm_bo_destroy(bo);
+}
+
+#define RETIRED_CURSOR_BOS 4
+
+// Cursor buffer objects that are not used anymore, but may still be scanned out. NULL for empty entries.
+static struct gbm_bo* retiredCursorBos[RETIRED_CURSOR_BOS];
+
+// Destroys retired cursor buffer objects that are not scanned out anymore. Should be called with commit mutex held.
+static void collectRetiredCursorBos(DisplayHandle_t* handle) {
+    for (int i = 0; i < RETIRED_CURSOR_BOS; ++i) {
+        if (retiredCursorBos[i] && !isCursorBoBusy(handle, retiredCursorBos[i])) {
+            destroyCursorBo(handle, retiredCursorBos[i]);
+            retiredCursorBos[i] = NULL;
+        }
+    }
+}
+
+// Destroys |bo| once it is not scanned out anymore. Should be called with commit mutex held.
+static void retireCursorBo(DisplayHandle_t* handle, struct gbm_bo* bo) {
+    if (!isCursorBoBusy(handle, bo)) {
+        destroyCursorBo(handle, bo);
+        return;
+    }
+
+    for (int i = 0; i < RETIRED_CURSOR_BOS; ++i) {
+        if (!retiredCursorBos[i]) {
+            retiredCursorBos[i] = bo;
+            return;
+        }
+    }
+
+    // NB: Never happens, since at most three buffer objects are busy at once.
+    fprintf(stderr, "Destroying cursor buffer object that may be scanned out\n");
+    destroyCursorBo(handle, bo);
+}
+
+#define MAX_CURSOR_ANIMATION_FRAMES 32
+
+// Cursor animation set by |doSetCursorAnimation|. Frames are uploaded once and flipped by commit thread.
+static struct CursorAnimation {
+    struct gbm_bo* frames[MAX_CURSOR_ANIMATION_FRAMES];
+    // Zero if cursor is not animated.
+    uint32_t framesCount;
+    uint32_t boWidth;
+    uint32_t boHeight;
+    uint64_t frameDurationNs;
+    uint64_t startNs;
+} cursorAnimation = {
+    .framesCount = 0
+};
+
+// Returns cursor animation frame that should be shown at |now|, or NULL if animated cursor is not shown.
+static struct gbm_bo* getCursorAnimationFrame(uint64_t now) {
+    if (!cursorAnimation.framesCount || !cursorState.visible) {
+        return NULL;
+    }
+
+    const uint64_t frame = (now - cursorAnimation.startNs) / cursorAnimation.frameDurationNs;
+    return cursorAnimation.frames[frame % cursorAnimation.framesCount];
+}
+
+// Returns nanoseconds until the next cursor animation frame, or zero if animated cursor is not shown.
+static uint64_t getCursorAnimationTimeoutNs(uint64_t now) {
+    if (!getCursorAnimationFrame(now)) {
+        return 0;
+    }
+
+    return cursorAnimation.frameDurationNs - (now - cursorAnimation.startNs) % cursorAnimation.frameDurationNs;
+}
+
+// Makes cursor show animation frame for |now|. Returns zero if it is shown already. Should be called with commit mutex
+//  held.
+static int advanceCursorAnimation(uint64_t now) {
+    struct gbm_bo* frame = getCursorAnimationFrame(now);
+    if (!frame || frame == cursorState.cursorBo) {
+        return 0;
+    }
+
+    cursorState.replacedBo = cursorState.cursorBo;
+    cursorState.replacedNs = now;
+    cursorState.cursorBo = frame;
+    cursorState.boWidth = cursorAnimation.boWidth;
+    cursorState.boHeight = cursorAnimation.boHeight;
+    cursorState.boHandle = gbm_bo_get_handle(frame).u32;
+    cursorState.dirty = 1;
+    return 1;
+}
+
+// Should be called with commit mutex held.
+static void stopCursorAnimation(DisplayHandle_t* handle) {
+    // NB: Retired buffer objects that are still busy are among the busy animation frames, so they all fit.
+    collectRetiredCursorBos(handle);
+
+    for (uint32_t i = 0; i < cursorAnimation.framesCount; ++i) {
+        retireCursorBo(handle, cursorAnimation.frames[i]);
+    }
+    cursorAnimation.framesCount = 0;
+}
+
+// Takes the latest position requested by |doSetLocation|. Returns zero and leaves |x| and |y| intact if position was
+//  not changed since it was taken last time.
+static int takeCursorPosition(int32_t* x, int32_t* y) {
+    if (!__atomic_exchange_n(&cursorState.positionPending, 0, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+
+    const uint64_t position = __atomic_load_n(&cursorState.pendingPosition, __ATOMIC_ACQUIRE);
+    *x = (int32_t) (uint32_t) (position >> 32);
+    *y = (int32_t) (uint32_t) position;
+
+    cursorState.dirty = 1;
+    return 1;
+}
+
+// Adds changed cursor state to the request. Returns zero if cursor was not changed.
+static int addCursorProperties(drmModeAtomicReqPtr request, DisplayHandle_t* handle) {
+    if (!handle->cursorPlane) {
+        return 0;
+    }
+
+    // NB: Position is kept in |cursorState| once taken, so that it is committed again if this commit fails.
+    takeCursorPosition(&cursorState.x, &cursorState.y);
+    advanceCursorAnimation(getTimeNs());
+    if (!cursorState.dirty) {
+        return 0;
+    }
+
+    PlaneInfo_t* plane = handle->cursorPlane;
+    DrmProperties_t* properties = &plane->properties;
+    const uint32_t planeId = plane->planeId;
+
+    BoAndFramebuffer_t* boAndFramebuffer =
+            cursorState.visible && cursorState.cursorBo ? getOrCreateBoAndFramebuffer(cursorState.cursorBo) : NULL;
+
+    if (!boAndFramebuffer) {
+        addProperty(request, properties, planeId, "FB_ID", 0);
+        addProperty(request, properties, planeId, "CRTC_ID", 0);
+        return 1;
+    }
+
+    addProperty(request, properties, planeId, "FB_ID", boAndFramebuffer->framebufferId);
+    addProperty(request, properties, planeId, "CRTC_ID", handle->crtcId);
+    addProperty(request, properties, planeId, "SRC_X", 0);
+    addProperty(request, properties, planeId, "SRC_Y", 0);
+    addProperty(request, properties, planeId, "SRC_W", (uint64_t) cursorState.boWidth << 16);
+    addProperty(request, properties, planeId, "SRC_H", (uint64_t) cursorState.boHeight << 16);
+    addProperty(request, properties, planeId, "CRTC_X", (uint64_t) (int64_t) cursorState.x);
+    addProperty(request, properties, planeId, "CRTC_Y", (uint64_t) (int64_t) cursorState.y);
+    addProperty(request, properties, planeId, "CRTC_W", cursorState.boWidth);
+    addProperty(request, properties, planeId, "CRTC_H", cursorState.boHeight);
+
+    if (handle->cursorSetZpos) {
+        addProperty(request, properties, planeId, "zpos", handle->cursorZpos);
+    }
+
+    if (handle->cursorBlendMode != PLANE_BLEND_MODES_COUNT) {
+        addProperty(request, properties, planeId, "pixel blend mode", plane->blendModeValues[handle->cursorBlendMode]);
+    }
+
+    return 1;
+}
+
+// Should be called with commit mutex held.
+static void onCursorCommitted(void) {
+    // NB: Buffers are owned by cursor cache. Commits are blocking, so replaced buffer is not scanned out anymore and
+    //  the cache is free to destroy it.
+    cursorState.committedBo = cursorState.visible ? cursorState.cursorBo : NULL;
+    cursorState.dirty = 0;
+}
+
+// Should be called with commit mutex held.
+static void onOpacityCommitted(DisplayHandle_t* handle) {
+    const uint64_t now = getTimeNs();
+
+    int animated = isOpacityAnimated(&handle->opacity, now);
+    for (int i = 0; i < MAX_STATIC_LAYERS; ++i) {
+        animated |= handle->layers[i].plane && isOpacityAnimated(&handle->layers[i].opacity, now);
+    }
+
+    // NB: Keep committing until the final value of each animation is committed.
+    handle->opacityDirty = animated;
+}
+
+// Should be called with commit mutex held.
+static void onLayersCommitted(DisplayHandle_t* handle) {
+    VideoLayer_t* video = &handle->video;
+
+    // NB: Commits are blocking, so previous buffers are not scanned out anymore.
+    if (video->dirty) {
+        if (video->framebufferId) {
+            drmModeRmFB(handle->fd, video->framebufferId);
+        }
+
+        video->framebufferId = video->pendingFramebufferId;
+        video->pendingFramebufferId = 0;
+        video->dirty = 0;
+    }
+
+    for (int i = 0; i < MAX_STATIC_LAYERS; ++i) {
+        StaticLayer_t* layer = &handle->layers[i];
+        if (!layer->dirty) {
+            continue;
+        }
+
+        if (layer->pendingBo || !layer->visible) {
+            if (layer->bo) {
+                gbm_bo_destroy(layer->bo);
+            }
+
+            layer->bo = layer->pendingBo;
+            layer->pendingBo = NULL;
+        }
+
+        layer->dirty = 0;
+    }
+}
+
+// Drops changes of video and static layers that display hardware rejected, so that they do not hold back UI frames.
+//  Changed layers are hidden, as their previous state may be rejected along with the rest of the display state too.
+//  Should be called with commit mutex held.
+static void dropLayersChanges(DisplayHandle_t* handle) {
+    VideoLayer_t* video = &handle->video;
+    if (video->dirty) {
+        fprintf(stderr, "Video layer was rejected by display hardware, hiding it\n");
+        if (video->pendingFramebufferId) {
+            drmModeRmFB(handle->fd, video->pendingFramebufferId);
+            video->pendingFramebufferId = 0;
+        }
+
+        // NB: Disabling a plane is always accepted, it is committed with the next UI frame.
+        video->visible = 0;
+        video->dirty = video->framebufferId != 0;
+    }
+
+    for (int i = 0; i < MAX_STATIC_LAYERS; ++i) {
+        StaticLayer_t* layer = &handle->layers[i];
+        if (!layer->dirty) {
+            continue;
+        }
+
+        fprintf(stderr, "Static layer %i was rejected by display hardware, hiding it\n", i);
+        if (layer->pendingBo) {
+            gbm_bo_destroy(layer->pendingBo);
+            layer->pendingBo = NULL;
+        }
+
+        layer->visible = 0;
+        layer->dirty = layer->bo != NULL;
+    }
+}
+
+// Commits changed video and static layers, opacity and cursor on their own. Should be called with commit mutex held.
+static int commitLayers(DisplayHandle_t* handle) {
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+    if (!request) {
+        return -1;
+    }
+
+    const int opacityChanged = addOpacityProperties(request, handle);
+    addLayersProperties(request, handle);
+    const int cursorChanged = addCursorProperties(request, handle);
+
+    int result = drmModeAtomicCommit(handle->fd, request, 0, NULL);
+    if (result) {
+        fprintf(stderr, "Failed to commit layers: %s\n", strerror(errno));
+    } else {
+        onLayersCommitted(handle);
+        if (opacityChanged) {
+            onOpacityCommitted(handle);
+        }
+        if (cursorChanged) {
+            onCursorCommitted();
+        }
+    }
+
+    drmModeAtomicFree(request);
+    return result;
+}
+
+// Commits changed video layer on its own. Should be called with video and commit mutexes held. Commit mutex is released
+//  while the commit is blocked, so that UI frames and cursor updates are not held back by video.
+static int commitVideo(DisplayHandle_t* handle) {
+    VideoLayer_t* video = &handle->video;
+    if (!video->dirty) {
+        return 0;
+    }
+
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+    if (!request) {
+        return -1;
+    }
+
+    addLayerPlaneProperties(request, handle, video->plane, video->visible, video->pendingFramebufferId,
+                            video->srcWidth, video->srcHeight, video->x, video->y, video->width, video->height,
+                            video->setZpos, video->zpos);
+    if (video->visible) {
+        addPlaneAlpha(request, video->plane, getLayerOpacity(handle, NULL, getTimeNs()));
+    }
+
+    // NB: Layer is not dirty while being committed, so UI commits leave its plane alone. Video mutex keeps other
+    //  threads from changing it meanwhile.
+    const uint32_t framebufferId = video->pendingFramebufferId;
+    video->pendingFramebufferId = 0;
+    video->dirty = 0;
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    const int result = drmModeAtomicCommit(handle->fd, request, 0, NULL);
+    const int error = errno;
+    pthread_mutex_lock(&handle->commitMutex);
+
+    drmModeAtomicFree(request);
+
+    if (result) {
+        fprintf(stderr, "Failed to commit video layer: %s\n", strerror(error));
+        video->pendingFramebufferId = framebufferId;
+        video->dirty = 1;
+        return result;
+    }
+
+    // NB: Commits are blocking, so previous buffer is not scanned out anymore.
+    if (video->framebufferId) {
+        drmModeRmFB(handle->fd, video->framebufferId);
+    }
+    video->framebufferId = framebufferId;
+
+    return 0;
+}
+
+static uint32_t importDmabuf(
+        int fd,
+        uint32_t format,
+        uint32_t width,
+        uint32_t height,
+        int planesCount,
+        const jint* fds,
+        const jint* offsets,
+        const jint* pitches,
+        uint64_t modifier) {
+    uint32_t handles[4] = {0};
+    uint32_t planeOffsets[4] = {0};
+    uint32_t planePitches[4] = {0};
+    uint64_t modifiers[4] = {0};
+
+    uint32_t framebufferId = 0;
+
+    for (int i = 0; i < planesCount; ++i) {
+        if (drmPrimeFDToHandle(fd, fds[i], &handles[i])) {
+            fprintf(stderr, "Failed to import dmabuf plane %i: %s\n", i, strerror(errno));
+            goto out;
+        }
+
+        planeOffsets[i] = offsets[i];
+        planePitches[i] = pitches[i];
+        modifiers[i] = modifier;
+    }
+
+    const uint32_t flags = modifier != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0;
+
+    if (drmModeAddFB2WithModifiers(fd, width, height, format, handles, planePitches, planeOffsets, modifiers,
+                                   &framebufferId, flags)) {
+        fprintf(stderr, "Failed to create framebuffer for dmabuf: %s\n", strerror(errno));
+        framebufferId = 0;
+    }
+
+out:
+    // NB: Framebuffer holds its own reference to buffer. Planes of the same dmabuf share the same handle.
+    for (int i = 0; i < planesCount; ++i) {
+        int closed = !handles[i];
+        for (int j = 0; j < i; ++j) {
+            closed |= handles[j] == handles[i];
+        }
+
+        if (!closed) {
+            drmCloseBufferHandle(fd, handles[i]);
+        }
+    }
+
+    return framebufferId;
+}
+
+/**
+ * Show a dmabuf video frame on an overlay plane
+ *
+ * This is not a part of Monocle EGL interface. |fds|, |offsets| and |pitches| describe |planesCount| (up to 4) planes
+ * of |width|x|height| frame of |format| DRM format with |modifier| layout (DRM_FORMAT_MOD_INVALID for implicit one).
+ * The frame is scaled to the destination rectangle, which is in screen coordinates. It is shown along with the next
+ * rendered frame, or right away if nothing is being rendered. Dmabuf file descriptors can be closed as soon as this
+ * returns. The UI is expected to leave the destination rectangle transparent.
+ */
+jboolean doSetVideoFrame(
+        jint format,
+        jint width,
+        jint height,
+        jint planesCount,
+        jint* fds,
+        jint* offsets,
+        jint* pitches,
+        jlong modifier,
+        jint x,
+        jint y,
+        jint destinationWidth,
+        jint destinationHeight) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle || planesCount < 1 || planesCount > 4) {
+        return JNI_FALSE;
+    }
+
+    pthread_mutex_lock(&handle->videoMutex);
+    pthread_mutex_lock(&handle->commitMutex);
+
+    VideoLayer_t* video = &handle->video;
+
+    if (video->plane && video->format != (uint32_t) format) {
+        // NB: Chosen plane may not support new format.
+        if (video->pendingFramebufferId) {
+            drmModeRmFB(handle->fd, video->pendingFramebufferId);
+            video->pendingFramebufferId = 0;
+        }
+
+        if (video->framebufferId) {
+            video->visible = 0;
+            video->dirty = 1;
+            if (commitVideo(handle)) {
+                // NB: Removing scanned out framebuffer disables the plane, so it is not leaked either way.
+                drmModeRmFB(handle->fd, video->framebufferId);
+            }
+        }
+
+        releasePlane(video->plane);
+        memset(video, 0, sizeof (VideoLayer_t));
+    }
+
+    if (!video->plane && findVideoPlane(handle, format)) {
+        pthread_mutex_unlock(&handle->commitMutex);
+        pthread_mutex_unlock(&handle->videoMutex);
+        return JNI_FALSE;
+    }
+
+    const uint32_t framebufferId =
+            importDmabuf(handle->fd, format, width, height, planesCount, fds, offsets, pitches, modifier);
+    if (!framebufferId) {
+        pthread_mutex_unlock(&handle->commitMutex);
+        pthread_mutex_unlock(&handle->videoMutex);
+        return JNI_FALSE;
+    }
+
+    if (video->pendingFramebufferId) {
+        // NB: Previous frame was never shown.
+        drmModeRmFB(handle->fd, video->pendingFramebufferId);
+    }
+
+    const float scale = SCALE_FACTOR;
+
+    video->pendingFramebufferId = framebufferId;
+    video->srcWidth = width;
+    video->srcHeight = height;
+    video->x = x * scale;
+    video->y = y * scale;
+    video->width = destinationWidth * scale;
+    video->height = destinationHeight * scale;
+    video->visible = 1;
+    video->dirty = 1;
+
+    int result = 0;
+
+    // NB: Do not wait for UI frame if UI is not being rendered.
+    if (isUiIdle(handle)) {
+        result = commitVideo(handle);
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    pthread_mutex_unlock(&handle->videoMutex);
+
+    return result ? JNI_FALSE : JNI_TRUE;
+}
+
+/**
+ * Hide video overlay plane
+ *
+ * This is not a part of Monocle EGL interface.
+ */
+void doHideVideo() {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return;
+    }
+
+    pthread_mutex_lock(&handle->videoMutex);
+    pthread_mutex_lock(&handle->commitMutex);
+
+    VideoLayer_t* video = &handle->video;
+
+    if (video->plane && video->visible) {
+        if (video->pendingFramebufferId) {
+            drmModeRmFB(handle->fd, video->pendingFramebufferId);
+            video->pendingFramebufferId = 0;
+        }
+
+        video->visible = 0;
+        video->dirty = 1;
+        commitVideo(handle);
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    pthread_mutex_unlock(&handle->videoMutex);
+}
+
+/**
+ * Create a static layer shown on its own plane below or above the UI
+ *
+ * This is not a part of Monocle EGL interface. Static layers are meant for rarely changing content (like background
+ * image or static chrome), so that it is not rendered each frame. Returns layer index, or -1 if there is no free plane
+ * that can be placed this way. The UI is expected to leave the area of layers below it transparent.
+ */
+jint doCreateStaticLayer(jboolean aboveUi) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&handle->commitMutex);
+
+    int index = 0;
+    while (index < MAX_STATIC_LAYERS && handle->layers[index].plane) {
+        ++index;
+    }
+
+    if (index == MAX_STATIC_LAYERS) {
+        fprintf(stderr, "Static layers limit (%i) reached\n", MAX_STATIC_LAYERS);
+        pthread_mutex_unlock(&handle->commitMutex);
+        return -1;
+    }
+
+    StaticLayer_t* layer = &handle->layers[index];
+
+    PlaneInfo_t* plane = allocateOverlayPlane(&handle->planes, handle->crtcIndex, handle->crtcId, handle->uiPlane,
+                                              aboveUi, PLANE_OWNER_LAYER, &layer->setZpos, &layer->zpos);
+    if (!plane && !releaseCursorOverlayPlane(handle)) {
+        plane = allocateOverlayPlane(&handle->planes, handle->crtcIndex, handle->crtcId, handle->uiPlane, aboveUi,
+                                     PLANE_OWNER_LAYER, &layer->setZpos, &layer->zpos);
+    }
+    if (!plane) {
+        fprintf(stderr, "Failed to find overlay plane for static layer %s UI plane\n", aboveUi ? "above" : "below");
+        pthread_mutex_unlock(&handle->commitMutex);
+        return -1;
+    }
+
+    layer->plane = plane;
+    layer->opacity.from = OPAQUE;
+    layer->opacity.to = OPAQUE;
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    return index;
+}
+
+/**
+ * Set static layer image and its bounds
+ *
+ * This is not a part of Monocle EGL interface. |img| is premultiplied BGRA |width|x|height| image, it is scaled to the
+ * destination rectangle, which is in screen coordinates.
+ */
+jboolean doSetStaticLayerImage(
+        jint index,
+        jbyte* img,
+        jint length,
+        jint width,
+        jint height,
+        jint x,
+        jint y,
+        jint destinationWidth,
+        jint destinationHeight) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle || index < 0 || index >= MAX_STATIC_LAYERS || !handle->layers[index].plane) {
+        return JNI_FALSE;
+    }
+
+    if (width <= 0 || height <= 0 || length < (int64_t) width * height * 4) {
+        fprintf(stderr, "Static layer image is too small\n");
+        return JNI_FALSE;
+    }
+
+    // NB: Layer is shown while next image is uploaded, so the image goes to a new buffer.
+    struct gbm_bo* bo = gbm_bo_create(handle->device, width, height, GBM_FORMAT_ARGB8888,
+                                      GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+    if (!bo) {
+        fprintf(stderr, "Failed to create static layer buffer object: %s\n", strerror(errno));
+        return JNI_FALSE;
+    }
+
+    uint32_t stride;
+    void* mapData = NULL;
+    char* map = gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_WRITE, &stride, &mapData);
+    if (!map) {
+        fprintf(stderr, "Failed to map static layer buffer object: %s\n", strerror(errno));
+        gbm_bo_destroy(bo);
+        return JNI_FALSE;
+    }
+
+    for (int i = 0; i < height; ++i) {
+        memcpy(&map[stride * i], &img[width * 4 * i], width * 4);
+    }
+
+    gbm_bo_unmap(bo, mapData);
+
+    if (!getOrCreateBoAndFramebuffer(bo)) {
+        gbm_bo_destroy(bo);
+        return JNI_FALSE;
+    }
+
+    pthread_mutex_lock(&handle->commitMutex);
+
+    StaticLayer_t* layer = &handle->layers[index];
+
+    if (layer->pendingBo) {
+        // NB: Previous image was never shown.
+        gbm_bo_destroy(layer->pendingBo);
+    }
+
+    const float scale = SCALE_FACTOR;
+
+    layer->pendingBo = bo;
+    layer->srcWidth = width;
+    layer->srcHeight = height;
+    layer->x = x * scale;
+    layer->y = y * scale;
+    layer->width = destinationWidth * scale;
+    layer->height = destinationHeight * scale;
+    layer->visible = 1;
+    layer->dirty = 1;
+
+    int result = 0;
+
+    // NB: Do not wait for UI frame if UI is not being rendered.
+    if (isUiIdle(handle)) {
+        result = commitLayers(handle);
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+
+    return result ? JNI_FALSE : JNI_TRUE;
+}
+
+/**
+ * Destroy static layer and free its plane
+ *
+ * This is not a part of Monocle EGL interface.
+ */
+void doDestroyStaticLayer(jint index) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle || index < 0 || index >= MAX_STATIC_LAYERS || !handle->layers[index].plane) {
+        return;
+    }
+
+    pthread_mutex_lock(&handle->commitMutex);
+
+    StaticLayer_t* layer = &handle->layers[index];
+
+    if (layer->pendingBo) {
+        gbm_bo_destroy(layer->pendingBo);
+        layer->pendingBo = NULL;
+    }
+
+    if (layer->bo) {
+        layer->visible = 0;
+        layer->dirty = 1;
+        commitLayers(handle);
+    }
+
+    if (layer->bo) {
+        // NB: Commit failed, buffer may still be scanned out, but there is nothing we can do about it.
+        gbm_bo_destroy(layer->bo);
+    }
+
+    releasePlane(layer->plane);
+    memset(layer, 0, sizeof (StaticLayer_t));
+
+    pthread_mutex_unlock(&handle->commitMutex);
+}
+
+// Whether there are opacity or cursor changes to commit.
+static int hasPendingChanges(DisplayHandle_t* handle) {
+    if (handle->opacityDirty) {
+        return 1;
+    }
+
+    if (!handle->cursorPlane) {
+        return 0;
+    }
+
+    struct gbm_bo* frame = getCursorAnimationFrame(getTimeNs());
+    return cursorState.dirty || __atomic_load_n(&cursorState.positionPending, __ATOMIC_ACQUIRE) ||
+            (frame && frame != cursorState.cursorBo);
+}
+
+static void signalCommitThread(DisplayHandle_t* handle) {
+    pthread_mutex_lock(&handle->wakeMutex);
+    handle->wakeRequested = 1;
+    pthread_cond_signal(&handle->commitCondition);
+    pthread_mutex_unlock(&handle->wakeMutex);
+}
+
+// Waits until commit thread is signalled, or for |timeoutNs| nanoseconds unless it is zero.
+static void waitForCommitThreadSignal(DisplayHandle_t* handle, uint64_t timeoutNs) {
+    const uint64_t wakeNs = getTimeNs() + timeoutNs;
+    struct timespec wakeTime = {
+        .tv_sec = wakeNs / 1000000000ull,
+        .tv_nsec = wakeNs % 1000000000ull
+    };
+
+    pthread_mutex_lock(&handle->wakeMutex);
+    while (!handle->wakeRequested) {
+        if (!timeoutNs) {
+            pthread_cond_wait(&handle->commitCondition, &handle->wakeMutex);
+        } else if (pthread_cond_timedwait(&handle->commitCondition, &handle->wakeMutex, &wakeTime) == ETIMEDOUT) {
+            break;
+        }
+    }
+    handle->wakeRequested = 0;
+    pthread_mutex_unlock(&handle->wakeMutex);
+}
+
+// Blocks until the next vertical blank of the display CRTC.
+static void waitForVBlank(DisplayHandle_t* handle) {
+    drmVBlank vblank = {
+        .request = {
+            .type = DRM_VBLANK_RELATIVE |
+                    ((handle->crtcIndex << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK),
+            .sequence = 1
+        }
+    };
+
+    if (drmWaitVBlank(handle->fd, &vblank)) {
+        // NB: Keep updates paced by display refresh anyway.
+        const struct timespec frame = {
+            .tv_sec = 0,
+            .tv_nsec = handle->frameBudgetNs
+        };
+        nanosleep(&frame, NULL);
+    }
+}
+
+static int switchToOverlayCursor(DisplayHandle_t* handle);
+
+// Moves cursor by legacy ioctl. Should be called without commit mutex held.
+static void moveLegacyCursor(DisplayHandle_t* handle, int32_t x, int32_t y) {
+    int error = drmModeMoveCursor(handle->fd, handle->crtcId, x, y);
+    if (error) {
+        fprintf(stderr, "Failed to move cursor: %s\n", strerror(errno));
+        switchToOverlayCursor(handle);
+    }
+}
+
+static void* commitThreadMain(void* data) {
+    DisplayHandle_t* handle = data;
+
+    pthread_mutex_lock(&handle->commitMutex);
+
+    while (!handle->commitThreadStop) {
+        collectRetiredCursorBos(handle);
+
+        // NB: Frames are only advanced while cursor is visible. Frame is set with commit mutex held, so that cursor
+        //  hidden meanwhile is not shown again by it.
+        if (usesLegacyCursor(handle) && advanceCursorAnimation(getTimeNs())) {
+            const int error = drmModeSetCursor(
+                        handle->fd, handle->crtcId, cursorState.boHandle, cursorState.boWidth, cursorState.boHeight
+            ) ? errno : 0;
+
+            if (error) {
+                fprintf(stderr, "Failed to update cursor image: %s\n", strerror(error));
+                pthread_mutex_unlock(&handle->commitMutex);
+                switchToOverlayCursor(handle);
+                pthread_mutex_lock(&handle->commitMutex);
+            }
+            continue;
+        }
+
+        int32_t x, y;
+        if (usesLegacyCursor(handle) && takeCursorPosition(&x, &y)) {
+            cursorState.x = x;
+            cursorState.y = y;
+            cursorState.dirty = 0;
+            pthread_mutex_unlock(&handle->commitMutex);
+
+            // NB: Positions reported in between are coalesced, so that cursor is moved at most once per refresh.
+            moveLegacyCursor(handle, x, y);
+            waitForVBlank(handle);
+
+            pthread_mutex_lock(&handle->commitMutex);
+            continue;
+        }
+
+        uint64_t timeoutNs = 0;
+        if (hasPendingChanges(handle)) {
+            if (isUiIdle(handle)) {
+                // NB: Commit is blocking, so animation frames and cursor updates are paced by display refresh.
+                if (commitLayers(handle)) {
+                    handle->opacityDirty = 0;
+                    cursorState.dirty = 0;
+                }
+
+                pthread_mutex_unlock(&handle->commitMutex);
+                pthread_mutex_lock(&handle->commitMutex);
+                continue;
+            }
+
+            // NB: Changes are committed along with UI frames while UI is being rendered.
+            timeoutNs = handle->frameBudgetNs;
+        } else {
+            // NB: Wake up for the next cursor animation frame.
+            timeoutNs = getCursorAnimationTimeoutNs(getTimeNs());
+        }
+
+        pthread_mutex_unlock(&handle->commitMutex);
+        waitForCommitThreadSignal(handle, timeoutNs);
+        pthread_mutex_lock(&handle->commitMutex);
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    return NULL;
+}
+
+// Makes commit thread commit pending changes if UI is not being rendered. Should be called with commit mutex held.
+static int wakeCommitThread(DisplayHandle_t* handle) {
+    if (!handle->commitThreadStarted) {
+        // NB: pthread_create returns error code instead of setting errno.
+        const int error = pthread_create(&handle->commitThread, NULL, commitThreadMain, handle);
+        if (error) {
+            fprintf(stderr, "Failed to start commit thread: %s\n", strerror(error));
+            return -1;
+        }
+
+        __atomic_store_n(&handle->commitThreadStarted, 1, __ATOMIC_RELEASE);
+    }
+
+    signalCommitThread(handle);
+    return 0;
+}
+
+/**
+ * Animate opacity of the whole display or of a static layer
+ *
+ * This is not a part of Monocle EGL interface. Opacity is changed from its current value to |opacity| (in [0, 1] range)
+ * during |duration| milliseconds by display hardware through plane "alpha" property, so fades cost no rendering and
+ * keep going while the renderer is busy. |layer| is static layer index, or -1 for the whole display (UI, video and
+ * static layers planes, which fades to black). Returns false if UI or layer plane has no "alpha" property.
+ */
+jboolean doAnimateOpacity(jint layer, jfloat opacity, jint duration) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return JNI_FALSE;
+    }
+
+    if (layer >= MAX_STATIC_LAYERS || layer < -1 || (layer >= 0 && !handle->layers[layer].plane)) {
+        return JNI_FALSE;
+    }
+
+    PlaneInfo_t* plane = layer >= 0 ? handle->layers[layer].plane : handle->uiPlane;
+    if (!plane->hasAlpha) {
+        fprintf(stderr, "Plane with id %i has no alpha property\n", plane->planeId);
+        return JNI_FALSE;
+    }
+
+    pthread_mutex_lock(&handle->commitMutex);
+
+    if (wakeCommitThread(handle)) {
+        pthread_mutex_unlock(&handle->commitMutex);
+        return JNI_FALSE;
+    }
+
+    Opacity_t* animation = layer >= 0 ? &handle->layers[layer].opacity : &handle->opacity;
+    const uint64_t now = getTimeNs();
+
+    opacity = opacity < 0.f ? 0.f : opacity > 1.f ? 1.f : opacity;
+
+    // NB: Animation starts from the current value, so that it can be changed midway.
+    animation->from = getOpacity(animation, now);
+    animation->to = opacity * OPAQUE + .5f;
+    animation->startNs = now;
+    animation->durationNs = duration > 0 ? duration * 1000000ull : 0;
+
+    handle->opacityDirty = 1;
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    return JNI_TRUE;
+}
+
+/**
+ * Swap buffers (and render frontbuffer)
+ */
+jboolean doEglSwapBuffers(jlong eglDisplay, jlong eglSurface) {
+    DisplayHandle_t* handle = (DisplayHandle_t*) eglDisplay;
+    if (!handle) {
+        return JNI_FALSE;
+    }
+
+    EGLSurface surface = (EGLSurface) eglSurface;
+    if (eglSwapBuffers(handle->display, surface) == EGL_FALSE) {
+        fprintf(stderr, "eglSwapBuffers failed\n");
+        return JNI_FALSE;
+    }
+
+    struct gbm_bo* nextBo = gbm_surface_lock_front_buffer(handle->surface);
+    if (!nextBo) {
+        fprintf(stderr, "Failed to lock surface front buffer: %s\n", strerror(errno));
+        return JNI_FALSE;
+    }
+
+    Swapchain_t* swapchain = NULL;
+    if (handle->swapchain.buffersCount) {
+        swapchain = &handle->swapchain;
+        const int result = drawScanoutBlit(handle, nextBo, swapchain->buffers[swapchain->backBuffer].framebuffer);
+
+        // NB: Blit is ordered before rendering of the next frame by the context, so the buffer is free already.
+        gbm_surface_release_buffer(handle->surface, nextBo);
+        if (result) {
+            fprintf(stderr, "Failed to draw frame to swapchain buffer\n");
+            return JNI_FALSE;
+        }
+
+        if (swapchain->buffersCount == 1 && !handle->doModeset) {
+            return updateFrontBuffer(handle, swapchain);
+        }
+
+        // NB: No need to wait for rendering to finish, atomic commit waits for buffer implicit fences.
+        glFlush();
+        nextBo = swapchain->buffers[swapchain->backBuffer].bo;
+    }
+
+    // NB: Blocking commit waits for rendering to finish anyway, so waiting for it here does not delay the frame.
+    DynamicResolution_t* dynamicResolution = &handle->dynamicResolution;
+    uint64_t frameDoneNs = 0;
+    if (dynamicResolution->enabled && dynamicResolution->rendererOptedIn) {
+        glFinish();
+        frameDoneNs = getTimeNs();
+    }
+
+    BoAndFramebuffer_t* boAndFramebuffer = getOrCreateBoAndFramebuffer(nextBo);
+    if (!boAndFramebuffer) {
+        fprintf(stderr, "Failed to get framebuffer for buffer object\n");
+        goto err_release_buffer;
+    }
+
+    pthread_mutex_lock(&handle->commitMutex);
+
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+
+    int flags = needsModeset(handle) ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0;
+    if (handle->doModeset && addModesetProperties(request, handle, handle->connectorId, &handle->connectorProperties,
+                                                  handle->crtcId, &handle->crtcProperties, &handle->mode) < 0) {
+        goto err_free_request;
+    }
+
+    addPlaneProperties(
+                request,
+                handle,
+                boAndFramebuffer->framebufferId,
+                dynamicResolution->widths[dynamicResolution->level],
+                dynamicResolution->heights[dynamicResolution->level]
+    );
+
+    // NB: All the displays scan out the same buffer, so they flip together. Otherwise a buffer could be rendered to
+    //  while one of the displays still shows it.
+    if (addOutputsProperties(
+                request,
+                handle,
+                boAndFramebuffer->framebufferId,
+                dynamicResolution->widths[dynamicResolution->level],
+                dynamicResolution->heights[dynamicResolution->level]) < 0) {
+        goto err_free_request;
+    }
+
+    // NB: Video and static layers changes, opacity animation frames and cursor updates are shown along with UI frame.
+    const int opacityChanged = addOpacityProperties(request, handle);
+    const int layersCursor = drmModeAtomicGetCursor(request);
+    int layersChanged = addLayersProperties(request, handle);
+
+    // NB: Layers configuration may be rejected (scaling limits, bandwidth, format and plane combinations), which should
+    //  not make UI frames fail. Layers are dropped only if UI frame is accepted without them.
+    if (layersChanged && drmModeAtomicCommit(handle->fd, request, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL)) {
+        const int error = errno;
+        drmModeAtomicSetCursor(request, layersCursor);
+        if (drmModeAtomicCommit(handle->fd, request, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL)) {
+            addLayersProperties(request, handle);
+        } else {
+            fprintf(stderr, "Failed to commit layers along with UI frame: %s\n", strerror(error));
+            dropLayersChanges(handle);
+            layersChanged = addLayersProperties(request, handle);
+        }
+    }
+
+    const int cursorChanged = addCursorProperties(request, handle);
+
+    if (drmModeAtomicCommit(handle->fd, request, flags, NULL)) {
+        fprintf(stderr, "Failed to commit DRM mode: %s\n", strerror(errno));
+        if (flags) {
+            // NB: See |commitHotplugModeset|.
+            onModesetCommitted(handle, 0);
+            dropFailedOutputs(
+                        handle,
+                        boAndFramebuffer->framebufferId,
+                        dynamicResolution->widths[dynamicResolution->level],
+                        dynamicResolution->heights[dynamicResolution->level]
+            );
+        }
+        goto err_free_request;
+    }
+
+    onModesetCommitted(handle, 1);
+    handle->lastCommitNs = getTimeNs();
+    handle->scanoutFramebufferId = boAndFramebuffer->framebufferId;
+    handle->scanoutWidth = dynamicResolution->widths[dynamicResolution->level];
+    handle->scanoutHeight = dynamicResolution->heights[dynamicResolution->level];
+
+    if (layersChanged) {
+        onLayersCommitted(handle);
+    }
+    if (opacityChanged) {
+        onOpacityCommitted(handle);
+    }
+    if (cursorChanged) {
+        onCursorCommitted();
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+
+    drmModeAtomicFree(request);
+
+    if (frameDoneNs) {
+        updateDynamicResolution(handle, boAndFramebuffer->framebufferId, frameDoneNs);
+    }
+
+    if (swapchain) {
+        // NB: Commit is blocking, so previous front buffer is not scanned out anymore. Reuse buffers in round-robin
+        //  order, so that the buffer that was released first is rendered to first.
+        swapchain->frontBuffer = swapchain->backBuffer;
+        swapchain->backBuffer = (swapchain->backBuffer + 1) % swapchain->buffersCount;
+        return JNI_TRUE;
+    }
+
+    // NB: Commit is blocking, so previous front buffer is off screen and goes back to the surface right away. Surface
+    //  never needs more than two buffers this way.
+    if (handle->previousBo) {
+        gbm_surface_release_buffer(handle->surface, handle->previousBo);
+    }
+    handle->previousBo = nextBo;
+    return JNI_TRUE;
+
+err_free_request:
+    onModesetCommitted(handle, 0);
+    pthread_mutex_unlock(&handle->commitMutex);
+    drmModeAtomicFree(request);
+err_release_buffer:
+    if (!swapchain) {
+        gbm_surface_release_buffer(handle->surface, nextBo);
+    }
+    return JNI_FALSE;
+}
+
+/**
+ * Add a rectangle to the region of the screen changed since the last swap
+ *
+ * This is not a part of Monocle EGL interface. It is only used in front buffer rendering mode, where damaged region is
+ * reported to display hardware instead of flipping buffers. Whole screen is considered damaged if no rectangles were
+ * added.
+ */
+void doAddDamageRect(jint x, jint y, jint width, jint height) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return;
+    }
+
+    Damage_t* damage = &handle->damage;
+
+    const float scale = SCALE_FACTOR;
+    int32_t x1 = x * scale;
+    int32_t y1 = y * scale;
+    int32_t x2 = (x + width) * scale + .5f;
+    int32_t y2 = (y + height) * scale + .5f;
+
+    x1 = x1 < 0 ? 0 : x1;
+    y1 = y1 < 0 ? 0 : y1;
+    x2 = x2 > (int32_t) handle->width ? (int32_t) handle->width : x2;
+    y2 = y2 > (int32_t) handle->height ? (int32_t) handle->height : y2;
+
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    // NB: Clips are in coordinates of the scanned out buffer, which scanout blit draws frames to rotated.
+    int32_t clipX = x1;
+    int32_t clipY = y1;
+    uint32_t clipWidth = x2 - x1;
+    uint32_t clipHeight = y2 - y1;
+    rotateRect(handle->rotation, handle->width, handle->height, &clipX, &clipY, &clipWidth, &clipHeight);
+
+    struct drm_mode_rect clip = {
+        .x1 = clipX,
+        .y1 = clipY,
+        .x2 = clipX + (int32_t) clipWidth,
+        .y2 = clipY + (int32_t) clipHeight
+    };
+
+    // NB: Damage is taken by the rendering thread, while it may be added from any thread.
+    pthread_mutex_lock(&handle->commitMutex);
+    if (damage->count == MAX_DAMAGE_CLIPS) {
+        damage->overflow = 1;
+    } else if (!damage->overflow) {
+        damage->clips[damage->count++] = clip;
+    }
+    pthread_mutex_unlock(&handle->commitMutex);
+}
+
+// Whether |a| and |b| are the same mode, regardless of their names and types.
+static int isSameMode(const drmModeModeInfo* a, const drmModeModeInfo* b) {
+    return a->clock == b->clock &&
+            a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start && a->hsync_end == b->hsync_end &&
+            a->htotal == b->htotal && a->hskew == b->hskew &&
+            a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start && a->vsync_end == b->vsync_end &&
+            a->vtotal == b->vtotal && a->vscan == b->vscan && a->flags == b->flags;
+}
+
+// Chooses mode of re-probed |connector|: |current| one if it is still there, otherwise the preferred one, or any mode
+//  of the same size. Size may change only if |anySize| is set. Returns NULL if there is no such mode.
+static drmModeModeInfoPtr findHotplugMode(drmModeConnectorPtr connector, const drmModeModeInfo* current, int anySize) {
+    for (int i = 0; i < connector->count_modes; ++i) {
+        if (isSameMode(&connector->modes[i], current)) {
+            return &connector->modes[i];
+        }
+    }
+
+    drmModeModeInfoPtr preferred = findPreferredMode(connector);
+    if (preferred && (anySize ||
+            (preferred->hdisplay == current->hdisplay && preferred->vdisplay == current->vdisplay))) {
+        return preferred;
+    }
+
+    for (int i = 0; i < connector->count_modes; ++i) {
+        if (connector->modes[i].hdisplay == current->hdisplay && connector->modes[i].vdisplay == current->vdisplay) {
+            return &connector->modes[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Whether the link of re-probed |connector| failed and should be retrained by modeset.
+static int isLinkBroken(drmModeConnectorPtr connector, DrmProperties_t* properties) {
+    const uint32_t propertyId = getPropertyId(properties, "link-status");
+
+    for (int i = 0; propertyId && i < connector->count_props; ++i) {
+        if (connector->props[i] == propertyId) {
+            return connector->prop_values[i] == DRM_MODE_LINK_STATUS_BAD;
+        }
+    }
+
+    return 0;
+}
+
+// Sets up or disables CRTCs after hotplug, keeping the last UI frame on screen. Modeset before the first UI frame is
+//  left to that frame.
+static void commitHotplugModeset(DisplayHandle_t* handle) {
+    pthread_mutex_lock(&handle->commitMutex);
+
+    if (!handle->scanoutFramebufferId || !needsModeset(handle)) {
+        pthread_mutex_unlock(&handle->commitMutex);
+        return;
+    }
+
+    drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+    if (!request) {
+        fprintf(stderr, "Failed to allocate atomic request\n");
+        pthread_mutex_unlock(&handle->commitMutex);
+        return;
+    }
+
+    int result = 0;
+    if (handle->doModeset) {
+        result |= addModesetProperties(request, handle, handle->connectorId, &handle->connectorProperties,
+                                       handle->crtcId, &handle->crtcProperties, &handle->mode);
+    }
+
+    result |= addPlaneProperties(
+                request, handle, handle->scanoutFramebufferId, handle->scanoutWidth, handle->scanoutHeight);
+    result |= addOutputsProperties(
+                request, handle, handle->scanoutFramebufferId, handle->scanoutWidth, handle->scanoutHeight);
+
+    if (!result && drmModeAtomicCommit(handle->fd, request, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL)) {
+        fprintf(stderr, "Failed to commit DRM mode after hotplug: %s\n", strerror(errno));
+        result = -1;
+    }
+
+    onModesetCommitted(handle, !result);
+    if (result) {
+        // NB: Otherwise every UI frame would fail along with the new display. Next UI frame sets up the rest.
+        dropFailedOutputs(handle, handle->scanoutFramebufferId, handle->scanoutWidth, handle->scanoutHeight);
+    }
+    handle->lastCommitNs = getTimeNs();
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    drmModeAtomicFree(request);
+}
+
+// Whether |connector| may drive an additional display, that is it is named by JFX_EGL_DRM_CONNECTOR environment
+//  variable, or the variable is not set.
+static int isConnectorChosen(drmModeConnectorPtr connector) {
+    char names[256] = "";
+    const char* value = getenv("JFX_EGL_DRM_CONNECTOR");
+    if (!value) {
+        return 1;
+    }
+    snprintf(names, sizeof (names), "%s", value);
+
+    char* state = NULL;
+    for (char* name = strtok_r(names, ",", &state); name; name = strtok_r(NULL, ",", &state)) {
+        if (isConnectorNamed(connector, name)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Whether |connectorId| drives the main display or one of additional ones.
+static int isOutputConnector(DisplayHandle_t* handle, uint32_t connectorId) {
+    if (handle->connectorId == connectorId) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+        if (handle->outputs[i].connectorId == connectorId) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Starts mirroring the main display on a display of |connectorId| connector that was not connected at startup. Only
+//  mirroring displays are added, extending ones would change the desktop reported to Monocle. Returns non-zero if the
+//  display is not used.
+static int addHotplugOutput(DisplayHandle_t* handle, drmModeResPtr resources, uint32_t connectorId) {
+    // NB: Front buffer is flushed to the main display only, see |getNativeWindowHandle|.
+    if (!handle->cloneOutputs || handle->outputsCount == MAX_OUTPUTS - 1 || handle->swapchain.buffersCount == 1) {
+        return -1;
+    }
+
+    drmModeConnectorPtr connector = drmModeGetConnector(handle->fd, connectorId);
+    if (!connector) {
+        return -1;
+    }
+
+    if (connector->connection != DRM_MODE_CONNECTED || !connector->count_modes || !isConnectorChosen(connector)) {
+        goto err_free_connector;
+    }
+
+    uint32_t usedCrtcs = 1u << handle->crtcIndex;
+    for (uint32_t i = 0; i < handle->outputsCount; ++i) {
+        usedCrtcs |= 1u << handle->outputs[i].crtcIndex;
+    }
+
+    const int crtcIndex = findFreeCrtc(handle->displayId, handle->fd, resources, connector, usedCrtcs);
+    if (crtcIndex < 0) {
+        fprintf(stderr, "No free CRTC for connector with id %d (display id: %s)\n", connectorId, handle->displayId);
+        goto err_free_connector;
+    }
+
+    Output_t output;
+    memset(&output, 0, sizeof (Output_t));
+    output.connectorId = connectorId;
+    output.crtcId = resources->crtcs[crtcIndex];
+    output.crtcIndex = crtcIndex;
+
+    if (getProperties(handle->displayId, handle->fd, connectorId, DRM_MODE_OBJECT_CONNECTOR,
+                      &output.connectorProperties)) {
+        goto err_free_connector;
+    }
+    if (getProperties(handle->displayId, handle->fd, output.crtcId, DRM_MODE_OBJECT_CRTC, &output.crtcProperties)) {
+        goto err_free_connector_properties;
+    }
+
+    if (handle->lowMemory) {
+        compactDrmProperties(&output.connectorProperties);
+        compactDrmProperties(&output.crtcProperties);
+    }
+
+    // NB: Plane inventory is shared with video and static layers, which allocate planes with commit mutex held.
+    pthread_mutex_lock(&handle->commitMutex);
+
+    PlaneInfo_t* plane = allocatePlane(&handle->planes, output.crtcIndex, output.crtcId, DRM_PLANE_TYPE_PRIMARY,
+                                       DRM_FORMAT_ARGB8888, PLANE_OWNER_UI);
+
+    // NB: See |getNativeWindowHandle|, mirroring planes transform the picture the way the main display plane does,
+    //  and have to scale it along with the main one when resolution is lowered.
+    if (plane && ((handle->planeRotation && (plane->rotations & handle->planeRotation) != handle->planeRotation) ||
+            (handle->dynamicResolution.enabled && !plane->mayScaleByType))) {
+        releasePlane(plane);
+        plane = NULL;
+    }
+
+    drmModeModeInfoPtr mode = plane ? findHotplugMode(connector, &handle->mode, plane->mayScaleByType) : NULL;
+    if (!mode) {
+        if (plane) {
+            releasePlane(plane);
+        }
+        pthread_mutex_unlock(&handle->commitMutex);
+
+        fprintf(stderr, "Display of connector with id %d can't mirror the main display (display id: %s)\n",
+                connectorId, handle->displayId);
+        goto err_free_crtc_properties;
+    }
+
+    memcpy(&output.mode, mode, sizeof (drmModeModeInfo));
+    output.plane = plane;
+    output.connected = 1;
+    output.doModeset = 1;
+    placeOutputPicture(&output, 1, handle->mode.hdisplay, handle->mode.vdisplay);
+
+    handle->outputs[handle->outputsCount++] = output;
+
+    // NB: Plane type only tells that the plane may scale, supported ratios are known from TEST_ONLY commit. The first
+    //  UI frame sets modes of all the displays, if there is no frame yet.
+    if (handle->scanoutFramebufferId &&
+            testPlaneSource(handle, handle->scanoutFramebufferId, handle->scanoutWidth, handle->scanoutHeight)) {
+        --handle->outputsCount;
+        releasePlane(plane);
+        pthread_mutex_unlock(&handle->commitMutex);
+
+        fprintf(stderr, "Display of connector with id %d can't mirror the main display at %ux%u (display id: %s)\n",
+                connectorId, mode->hdisplay, mode->vdisplay, handle->displayId);
+        goto err_free_crtc_properties;
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    drmModeFreeConnector(connector);
+
+    return 0;
+
+err_free_crtc_properties:
+    freeDrmProperties(&output.crtcProperties);
+err_free_connector_properties:
+    freeDrmProperties(&output.connectorProperties);
+err_free_connector:
+    drmModeFreeConnector(connector);
+    return -1;
+}
+
+// Mirrors the main display on connected displays of |connectorId| connector, or of every connector if it is zero,
+//  that do not drive any display yet. Returns non-zero if no display was added.
+static int addHotplugOutputs(DisplayHandle_t* handle, uint32_t connectorId) {
+    if (!handle->cloneOutputs) {
+        return -1;
+    }
+
+    drmModeResPtr resources = drmModeGetResources(handle->fd);
+    if (!resources) {
+        fprintf(stderr, "drmModeGetResources for %s failed: %s\n", handle->displayId, strerror(errno));
+        return -1;
+    }
+
+    int result = -1;
+    for (int i = 0; i < resources->count_connectors; ++i) {
+        const uint32_t id = resources->connectors[i];
+        if ((!connectorId || connectorId == id) && !isOutputConnector(handle, id)) {
+            result &= addHotplugOutput(handle, resources, id);
+        }
+    }
+
+    drmModeFreeResources(resources);
+    return result;
+}
+
+// Re-probes display of |connectorId| connector, or every display if it is zero. Reconnected displays get their modes
+//  set again, disconnected additional displays are disabled. Newly connected displays are added when they mirror the
+//  main display. GBM and EGL objects are kept, and displays keep their size and place on the desktop, so screens
+//  reported to Monocle stay the same. The main display has to be connected at startup. Returns non-zero if no display
+//  of |handle| is driven by |connectorId|.
+static int handleHotplug(DisplayHandle_t* handle, uint32_t connectorId) {
+    int found = 0;
+    int changed = 0;
+
+    pthread_mutex_lock(&handle->hotplugMutex);
+
+    for (int i = -1; i < (int) handle->outputsCount; ++i) {
+        Output_t* output = i < 0 ? NULL : &handle->outputs[i];
+        const uint32_t id = output ? output->connectorId : handle->connectorId;
+        if (connectorId && connectorId != id) {
+            continue;
+        }
+        found = 1;
+
+        // NB: Forced probe reads EDID and takes tens of milliseconds, commits are not blocked meanwhile.
+        drmModeConnectorPtr connector = drmModeGetConnector(handle->fd, id);
+        const int connected = connector && connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0;
+
+        pthread_mutex_lock(&handle->commitMutex);
+
+        drmModeModeInfoPtr current = output ? &output->mode : &handle->mode;
+        DrmProperties_t* properties = output ? &output->connectorProperties : &handle->connectorProperties;
+        uint8_t* displayConnected = output ? &output->connected : &handle->connected;
+        uint8_t* doModeset = output ? &output->doModeset : &handle->doModeset;
+
+        // NB: Mirroring displays scale the picture, other ones would change the desktop by changing their size.
+        const int anySize = output && handle->cloneOutputs && output->plane->mayScaleByType;
+        drmModeModeInfoPtr mode = connected ? findHotplugMode(connector, current, anySize) : NULL;
+
+        if (connected && !mode) {
+            fprintf(stderr, "Display of connector with id %i has no %ux%u mode anymore, it is not used until restart\n",
+                    id, current->hdisplay, current->vdisplay);
+        }
+
+        if (mode && (!*displayConnected || !isSameMode(mode, current) || isLinkBroken(connector, properties))) {
+            memcpy(current, mode, sizeof (drmModeModeInfo));
+            *doModeset = 1;
+            changed = 1;
+
+            if (output) {
+                placeOutputPicture(output, handle->cloneOutputs, handle->mode.hdisplay, handle->mode.vdisplay);
+
+                // NB: Mirroring display may get a mode of another size, which its plane may be unable to scale to.
+                output->connected = 1;
+                if (handle->scanoutFramebufferId && testPlaneSource(handle, handle->scanoutFramebufferId,
+                                                                    handle->scanoutWidth, handle->scanoutHeight)) {
+                    fprintf(stderr, "Display of connector with id %i can't show the picture at %ux%u, it is not used "
+                            "until it is plugged again\n", id, mode->hdisplay, mode->vdisplay);
+                    mode = NULL;
+                }
+            } else {
+                handle->frameBudgetNs = getFrameDurationNs(&handle->mode);
+            }
+        } else if (!mode && *displayConnected && output) {
+            // NB: Main display keeps its CRTC, so that UI commits keep going with nothing connected.
+            *doModeset = 1;
+            changed = 1;
+        }
+        *displayConnected = mode != NULL;
+
+        pthread_mutex_unlock(&handle->commitMutex);
+
+        if (connector) {
+            drmModeFreeConnector(connector);
+        }
+    }
+
+    if ((!found || !connectorId) && !addHotplugOutputs(handle, connectorId)) {
+        found = 1;
+        changed = 1;
+    }
+
+    if (changed) {
+        commitHotplugModeset(handle);
+    }
+
+    pthread_mutex_unlock(&handle->hotplugMutex);
+
+    return !found;
+}
+
+// Parses kernel uevent of |length| bytes. Returns id of hotplugged connector of |device| (zero if any of its connectors
+//  might have changed), or -1 if it is not a hotplug event of |device|.
+static int64_t parseHotplugEvent(const char* event, size_t length, dev_t device) {
+    int drm = 0;
+    int hotplug = 0;
+    unsigned long major = 0;
+    unsigned long minor = 0;
+    int64_t connectorId = 0;
+
+    // NB: Event is "ACTION@DEVPATH" header followed by NUL separated KEY=VALUE fields.
+    for (size_t i = 0; i < length; i += strlen(&event[i]) + 1) {
+        const char* field = &event[i];
+
+        if (strcmp(field, "SUBSYSTEM=drm") == 0) {
+            drm = 1;
+        } else if (strcmp(field, "HOTPLUG=1") == 0) {
+            hotplug = 1;
+        } else if (strncmp(field, "MAJOR=", 6) == 0) {
+            major = strtoul(&field[6], NULL, 10);
+        } else if (strncmp(field, "MINOR=", 6) == 0) {
+            minor = strtoul(&field[6], NULL, 10);
+        } else if (strncmp(field, "CONNECTOR=", 10) == 0) {
+            connectorId = strtoul(&field[10], NULL, 10);
+        }
+    }
+
+    if (!drm || !hotplug || makedev(major, minor) != device) {
+        return -1;
+    }
+
+    return connectorId;
+}
+
+static void* hotplugThreadMain(void* data) {
+    DisplayHandle_t* handle = (DisplayHandle_t*) data;
+
+    struct stat deviceStat;
+    if (fstat(handle->fd, &deviceStat)) {
+        fprintf(stderr, "Failed to stat display device: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = handle->hotplugSocket, .events = POLLIN },
+        { .fd = handle->hotplugStopPipe[0], .events = POLLIN }
+    };
+
+    char event[8192];
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "Failed to wait for hotplug events: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        struct sockaddr_nl sender;
+        socklen_t senderLength = sizeof (sender);
+        const ssize_t length = recvfrom(
+                    handle->hotplugSocket, event, sizeof (event) - 1, 0, (struct sockaddr*) &sender, &senderLength);
+
+        if (length < 0) {
+            if (errno == ENOBUFS) {
+                // NB: Some events were dropped, so any display might have changed.
+                handleHotplug(handle, 0);
+            }
+            continue;
+        }
+
+        // NB: Only kernel sends events with zero port id.
+        if (senderLength != sizeof (sender) || sender.nl_pid != 0) {
+            continue;
+        }
+
+        event[length] = '\0';
+        const int64_t connectorId = parseHotplugEvent(event, length, deviceStat.st_rdev);
+        if (connectorId >= 0) {
+            handleHotplug(handle, connectorId);
+        }
+    }
+
+    return NULL;
+}
+
+// Starts reading DRM hotplug uevents, unless JFX_EGL_DRM_HOTPLUG is 0.
+static void startHotplugMonitor(DisplayHandle_t* handle) {
+    handle->hotplugThreadStarted = 0;
+    handle->hotplugSocket = -1;
+    handle->hotplugStopPipe[0] = -1;
+    handle->hotplugStopPipe[1] = -1;
+
+    if (!getEnvInt("JFX_EGL_DRM_HOTPLUG", 1)) {
+        return;
+    }
+
+    handle->hotplugSocket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (handle->hotplugSocket < 0) {
+        fprintf(stderr, "Failed to open uevent socket, display hotplug is not handled: %s\n", strerror(errno));
+        return;
+    }
+
+    // NB: Group 1 gets kernel uevents, the same ones udev daemon gets.
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof (address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+
+    if (bind(handle->hotplugSocket, (struct sockaddr*) &address, sizeof (address))) {
+        fprintf(stderr, "Failed to bind uevent socket, display hotplug is not handled: %s\n", strerror(errno));
+        goto err_close_socket;
+    }
+
+    if (pipe(handle->hotplugStopPipe)) {
+        fprintf(stderr, "Failed to create pipe, display hotplug is not handled: %s\n", strerror(errno));
+        goto err_close_socket;
+    }
+    fcntl(handle->hotplugStopPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(handle->hotplugStopPipe[1], F_SETFD, FD_CLOEXEC);
+
+    // NB: pthread_create returns error code instead of setting errno.
+    const int error = pthread_create(&handle->hotplugThread, NULL, hotplugThreadMain, handle);
+    if (error) {
+        fprintf(stderr, "Failed to start hotplug thread: %s\n", strerror(error));
+        goto err_close_pipe;
+    }
+
+    handle->hotplugThreadStarted = 1;
+    return;
+
+err_close_pipe:
+    close(handle->hotplugStopPipe[0]);
+    close(handle->hotplugStopPipe[1]);
+    handle->hotplugStopPipe[0] = -1;
+    handle->hotplugStopPipe[1] = -1;
+err_close_socket:
+    close(handle->hotplugSocket);
+    handle->hotplugSocket = -1;
+}
+
+static void stopHotplugMonitor(DisplayHandle_t* handle) {
+    if (!handle->hotplugThreadStarted) {
+        return;
+    }
+
+    const char stop = 1;
+    while (write(handle->hotplugStopPipe[1], &stop, 1) < 0 && errno == EINTR) {
+    }
+    pthread_join(handle->hotplugThread, NULL);
+    handle->hotplugThreadStarted = 0;
+
+    close(handle->hotplugStopPipe[0]);
+    close(handle->hotplugStopPipe[1]);
+    close(handle->hotplugSocket);
+}
+
+/**
+ * Re-probe display connector as if kernel reported its hotplug
+ *
+ * This is not a part of Monocle EGL interface. |connectorId| is DRM connector id, or 0 to re-probe every display. Lets
+ * tests and applications with their own device monitor drive hotplug handling, which is otherwise done on kernel
+ * uevents (unless |JFX_EGL_DRM_HOTPLUG| environment variable is 0). Returns false if no display is driven by the
+ * connector, even after it was probed as a new mirroring display.
+ */
+jboolean doHandleHotplug(jint connectorId) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle || connectorId < 0) {
+        return JNI_FALSE;
+    }
+
+    return handleHotplug(handle, connectorId) ? JNI_FALSE : JNI_TRUE;
+}
+
+/**
+ * Get amount of memory used by display buffers and display metadata, in bytes
+ *
+ * This is not a part of Monocle EGL interface.
+ */
+jlong doGetDisplayMemoryUsage() {
+    jlong result = getDisplayBuffersBytes();
+
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (handle) {
+        result += sizeof (DisplayHandle_t);
+        result += getDrmPropertiesSize(&handle->connectorProperties);
+        result += getDrmPropertiesSize(&handle->crtcProperties);
+        result += sizeof (PlaneInfo_t) * handle->planes.count;
+
+        for (uint32_t i = 0; i < handle->planes.count; ++i) {
+            result += getDrmPropertiesSize(&handle->planes.planes[i].properties);
+            result += sizeof (uint32_t) * handle->planes.planes[i].formatsCount;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Get the number of native screens in the current configuration
+ */
+jint doGetNumberOfScreens() {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return 1;
+    }
+
+    // NB: Screen 0 is the main display, additional displays follow in desktop order. Mirroring displays are not
+    //  screens of their own.
+    return handle->cloneOutputs ? 1 : 1 + handle->outputsCount;
+}
+
+/**
+ * Get screen handle
+ */
+jlong doGetHandle(jint idx) {
+    // This one is used to determine screen uniqueness. We can use this to expose pointer to |DisplayHandle_t| to Java
+    //  and pass it around. This also can be used to implement display hotplug support. Just return display index as
+    //  handle for now.
+    return idx;
+}
+
+// Gets position and size of screen |idx| on the desktop, in pixels. Returns non-zero if there is no such screen.
+static int getScreenRect(jint idx, uint32_t* x, uint32_t* y, uint32_t* width, uint32_t* height) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle || idx < 0 || idx >= doGetNumberOfScreens()) {
+        return -1;
+    }
+
+    if (idx == 0) {
+        *x = 0;
+        *y = handle->offsetY;
+        *width = handle->width;
+        *height = handle->height;
+        return 0;
+    }
+
+    Output_t* output = &handle->outputs[idx - 1];
+    *x = output->x;
+    *y = output->y;
+    *width = output->mode.hdisplay;
+    *height = output->mode.vdisplay;
+    return 0;
+}
+
+/**
  * Get screen depth
  */
 jint doGetDepth(jint idx) {
-    if (idx > 0) {
+    if (idx >= doGetNumberOfScreens()) {
         return 0;
     }
 
@@ -931,59 +6276,55 @@ jfloat doGetScale(jint idx);
  * Get screen width
  */
 jint doGetWidth(jint idx) {
-    if (idx > 0) {
-        return 0;
-    }
-
-    DisplayHandle_t* handle = currentDisplayHandle;
-    if (!handle) {
+    uint32_t x, y, width, height;
+    if (getScreenRect(idx, &x, &y, &width, &height)) {
         return 0;
     }
 
-    return (float) handle->mode.hdisplay / doGetScale(idx);
+    return (float) width / doGetScale(idx);
 }
 
 /**
  * Get screen height
  */
 jint doGetHeight(jint idx) {
-    if (idx > 0) {
-        return 0;
-    }
-
-    DisplayHandle_t* handle = currentDisplayHandle;
-    if (!handle) {
+    uint32_t x, y, width, height;
+    if (getScreenRect(idx, &x, &y, &width, &height)) {
         return 0;
     }
 
-    return (float) handle->mode.vdisplay / doGetScale(idx);
+    return (float) height / doGetScale(idx);
 }
 
 /**
  * Get screen offset for X axis
  */
 jint doGetOffsetX(jint idx) {
-    (void) idx;
+    uint32_t x, y, width, height;
+    if (getScreenRect(idx, &x, &y, &width, &height)) {
+        return 0;
+    }
 
-    // Offset os always 0 for screen 0.
-    return 0;
+    return (float) x / doGetScale(idx);
 }
 
 /*
  * Get screen offset for Y axis
  */
 jint doGetOffsetY(jint idx) {
-    (void) idx;
+    uint32_t x, y, width, height;
+    if (getScreenRect(idx, &x, &y, &width, &height)) {
+        return 0;
+    }
 
-    // Offset os always 0 for screen 0.
-    return 0;
+    return (float) y / doGetScale(idx);
 }
 
 /**
  * Get screen DPI
  */
 jint doGetDpi(jint idx) {
-    if (idx > 0) {
+    if (idx >= doGetNumberOfScreens()) {
         return 0;
     }
 
@@ -995,7 +6336,7 @@ jint doGetDpi(jint idx) {
  * Get screen native format
  */
 jint doGetNativeFormat(jint idx) {
-    if (idx > 0) {
+    if (idx >= doGetNumberOfScreens()) {
         return 0;
     }
 
@@ -1013,22 +6354,295 @@ jfloat doGetScale(jint idx) {
     return SCALE_FACTOR;
 }
 
-// TODO: We can actually implement cursor ourelves using free plane. This will allow us to show cursor on systems
-//  without cursor plane. But there is DRM side cursor handling implementation which is simplier to use. Use DRM side
-//  cursor handling for now.
-static struct CursorState {
-    uint32_t width;
-    uint32_t height;
-    struct gbm_bo* cursorBo;
-    uint32_t boHandle;
-    uint8_t visible;
-} cursorState = {
-    .width = 0,
-    .height = 0,
-    .cursorBo = NULL,
-    .boHandle = 0,
-    .visible = 0
-};
+/**
+ * Get the fraction of the screen size the next frame should be rendered at
+ *
+ * This is not a part of Monocle EGL interface. When dynamic resolution scaling is enabled (by setting
+ * |JFX_EGL_DRM_DYNAMIC_RESOLUTION| environment variable to 1), the renderer is expected to query this before rendering
+ * each frame and to render it into the bottom-left part of the surface scaled by returned value. Plane scales that part
+ * up to the whole screen. Frames are rendered at full size until the renderer calls this, and frame time is measured
+ * from this call till GPU finishes the frame.
+ */
+jfloat doGetRenderScale(jint idx) {
+    if (idx > 0) {
+        return 1.f;
+    }
+
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return 1.f;
+    }
+
+    DynamicResolution_t* dynamicResolution = &handle->dynamicResolution;
+    dynamicResolution->rendererOptedIn = 1;
+
+    // NB: Renderer queries render scale before each frame, this is where frame time is measured from.
+    if (!dynamicResolution->frameStartNs) {
+        dynamicResolution->frameStartNs = getTimeNs();
+    }
+
+    return dynamicResolutionLadder[dynamicResolution->level] / 100.f;
+}
+
+#define CURSOR_CACHE_SIZE 8
+
+// Uploaded cursor image. Cursor shapes change all the time (while hovering over text fields, buttons, etc.), so
+//  switching back to a recently used one should not upload it again.
+typedef struct CursorCacheEntry {
+    uint64_t hash;
+    // NULL for an empty entry.
+    struct gbm_bo* bo;
+    uint32_t boWidth;
+    uint32_t boHeight;
+    // Value of |cursorCacheClock| when the entry was used last time.
+    uint64_t lastUse;
+} CursorCacheEntry_t;
+
+static CursorCacheEntry_t cursorCache[CURSOR_CACHE_SIZE];
+static uint64_t cursorCacheClock = 0;
+
+// 64-bit FNV-1a over 8 byte words of the image, followed by its size and by |variant| of its upload.
+static uint64_t hashCursorImage(const jbyte* img, int length, uint32_t width, uint32_t height, uint64_t variant) {
+    static const uint64_t prime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, &img[i], 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < length; ++i) {
+        hash = (hash ^ (uint8_t) img[i]) * prime;
+    }
+
+    hash = (hash ^ ((uint64_t) width << 32 | height)) * prime;
+    hash = (hash ^ variant) * prime;
+
+    // NB: Multiplication moves entropy to the upper bits only.
+    return hash ^ (hash >> 32);
+}
+
+static CursorCacheEntry_t* findCursorCacheEntry(uint64_t hash) {
+    for (int i = 0; i < CURSOR_CACHE_SIZE; ++i) {
+        if (cursorCache[i].bo && cursorCache[i].hash == hash) {
+            cursorCache[i].lastUse = ++cursorCacheClock;
+            return &cursorCache[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Makes room for a new |width|x|height| cursor image by evicting the least recently used entry that is not busy, unless
+//  the cache has a free entry. Returns evicted buffer object if it has the same size, so that it is recycled instead
+//  of being destroyed. Should be called with commit mutex held.
+static struct gbm_bo* evictCursorCacheEntry(DisplayHandle_t* handle, uint32_t width, uint32_t height) {
+    CursorCacheEntry_t* entry = NULL;
+
+    for (int i = 0; i < CURSOR_CACHE_SIZE; ++i) {
+        CursorCacheEntry_t* candidate = &cursorCache[i];
+        if (!candidate->bo) {
+            return NULL;
+        }
+
+        if (isCursorBoBusy(handle, candidate->bo)) {
+            continue;
+        }
+
+        if (!entry || candidate->lastUse < entry->lastUse) {
+            entry = candidate;
+        }
+    }
+
+    if (!entry) {
+        return NULL;
+    }
+
+    struct gbm_bo* bo = entry->bo;
+    entry->bo = NULL;
+
+    if (usesLegacyCursor(handle)) {
+        subtractDisplayBuffersBytes(getBoSize(bo));
+    }
+
+    // NB: Recycled buffer object keeps its framebuffer, so neither allocation nor framebuffer creation is needed.
+    if (entry->boWidth == width && entry->boHeight == height) {
+        return bo;
+    }
+
+    gbm_bo_destroy(bo);
+    return NULL;
+}
+
+// Should be called with commit mutex held, after |evictCursorCacheEntry|. Returns NULL if the cache is full.
+static CursorCacheEntry_t* addCursorCacheEntry(
+        DisplayHandle_t* handle,
+        uint64_t hash,
+        struct gbm_bo* bo,
+        uint32_t width,
+        uint32_t height) {
+    CursorCacheEntry_t* entry = NULL;
+
+    for (int i = 0; i < CURSOR_CACHE_SIZE && !entry; ++i) {
+        if (!cursorCache[i].bo) {
+            entry = &cursorCache[i];
+        }
+    }
+
+    if (!entry) {
+        return NULL;
+    }
+
+    if (usesLegacyCursor(handle)) {
+        // NB: Framebuffers are not created for legacy cursor API, so memory is accounted here.
+        addDisplayBuffersBytes(getBoSize(bo));
+    }
+
+    entry->hash = hash;
+    entry->bo = bo;
+    entry->boWidth = width;
+    entry->boHeight = height;
+    entry->lastUse = ++cursorCacheClock;
+    return entry;
+}
+
+// Whether cursor buffer objects should have hardware cursor size, which is the case for cursor plane and for legacy
+//  cursor API. Overlay planes take buffer objects of any size.
+static int hasHardwareCursorSize(DisplayHandle_t* handle) {
+    return usesLegacyCursor(handle) || (handle->cursorPlane && handle->cursorPlane->type == DRM_PLANE_TYPE_CURSOR);
+}
+
+// Scales cursor size by display scale, so that cursor is as large as the rest of UI, but not larger than hardware
+//  cursor.
+static void updateCursorSize(DisplayHandle_t* handle) {
+    const float scale = doGetScale(0);
+    uint32_t width = cursorState.width * scale + .5f;
+    uint32_t height = cursorState.height * scale + .5f;
+
+    if (hasHardwareCursorSize(handle) && width && height) {
+        // NB: Image is rotated before it is written to buffer object.
+        const int swap = handle->rotation == 90 || handle->rotation == 270;
+        const uint32_t maxWidth = swap ? handle->cursorHeight : handle->cursorWidth;
+        const uint32_t maxHeight = swap ? handle->cursorWidth : handle->cursorHeight;
+
+        if ((uint64_t) width * maxHeight > (uint64_t) height * maxWidth) {
+            if (width > maxWidth) {
+                height = (uint64_t) height * maxWidth / width;
+                width = maxWidth;
+            }
+        } else if (height > maxHeight) {
+            width = (uint64_t) width * maxHeight / height;
+            height = maxHeight;
+        }
+    }
+
+    cursorState.scaledWidth = width;
+    cursorState.scaledHeight = height;
+}
+
+static void freeCursorBos(DisplayHandle_t* handle) {
+    for (uint32_t i = 0; i < cursorAnimation.framesCount; ++i) {
+        destroyCursorBo(handle, cursorAnimation.frames[i]);
+    }
+    cursorAnimation.framesCount = 0;
+
+    for (int i = 0; i < RETIRED_CURSOR_BOS; ++i) {
+        if (retiredCursorBos[i]) {
+            destroyCursorBo(handle, retiredCursorBos[i]);
+            retiredCursorBos[i] = NULL;
+        }
+    }
+
+    for (int i = 0; i < CURSOR_CACHE_SIZE; ++i) {
+        if (cursorCache[i].bo) {
+            destroyCursorBo(handle, cursorCache[i].bo);
+            cursorCache[i].bo = NULL;
+        }
+    }
+
+    cursorState.cursorBo = NULL;
+    cursorState.committedBo = NULL;
+    cursorState.replacedBo = NULL;
+    cursorState.boHandle = 0;
+}
+
+// Moves cursor to a free overlay plane after legacy cursor API failed. Returns zero on success.
+static int switchToOverlayCursor(DisplayHandle_t* handle) {
+    pthread_mutex_lock(&handle->commitMutex);
+
+    // NB: Both commit thread and input thread may fail legacy ioctls.
+    if (!usesLegacyCursor(handle)) {
+        pthread_mutex_unlock(&handle->commitMutex);
+        return 0;
+    }
+
+    PlaneInfo_t* plane = allocateCursorOverlayPlane(
+                &handle->planes, handle->crtcIndex, handle->crtcId, handle->uiPlane, &handle->cursorSetZpos,
+                &handle->cursorZpos
+    );
+    if (!plane) {
+        pthread_mutex_unlock(&handle->commitMutex);
+        return -1;
+    }
+
+    fprintf(stderr, "Showing cursor on overlay plane with id %i instead\n", plane->planeId);
+
+    // NB: Buffers memory is accounted along with their framebuffers from now on.
+    for (int i = 0; i < CURSOR_CACHE_SIZE; ++i) {
+        if (cursorCache[i].bo) {
+            subtractDisplayBuffersBytes(getBoSize(cursorCache[i].bo));
+        }
+    }
+    for (uint32_t i = 0; i < cursorAnimation.framesCount; ++i) {
+        subtractDisplayBuffersBytes(getBoSize(cursorAnimation.frames[i]));
+    }
+    for (int i = 0; i < RETIRED_CURSOR_BOS; ++i) {
+        if (retiredCursorBos[i]) {
+            subtractDisplayBuffersBytes(getBoSize(retiredCursorBos[i]));
+        }
+    }
+
+    handle->cursorPlane = plane;
+    handle->cursorOnOverlay = 1;
+    handle->cursorBlendMode = chooseCursorBlendMode(plane, &handle->premultiplyCursor);
+    updateCursorSize(handle);
+    cursorState.dirty = 1;
+    wakeCommitThread(handle);
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    return 0;
+}
+
+// Returns |width|x|height| BGRA image rotated by |rotation| degrees counter-clockwise. Pixels missing from |img| are
+//  transparent.
+static jbyte* rotateImage(jbyte* img, int length, uint32_t width, uint32_t height, uint32_t rotation) {
+    jbyte* result = calloc(width * height, 4);
+    if (!result) {
+        return NULL;
+    }
+
+    const uint32_t resultWidth = rotation == 180 ? width : height;
+
+    for (uint32_t i = 0; i < height; ++i) {
+        for (uint32_t j = 0; j < width; ++j) {
+            const uint32_t offset = (width * i + j) * 4;
+            if (offset + 4 > (uint32_t) length) {
+                return result;
+            }
+
+            int32_t x = j;
+            int32_t y = i;
+            uint32_t pixelWidth = 1;
+            uint32_t pixelHeight = 1;
+            rotateRect(rotation, width, height, &x, &y, &pixelWidth, &pixelHeight);
+
+            memcpy(&result[(resultWidth * y + x) * 4], &img[offset], 4);
+        }
+    }
+
+    return result;
+}
 
 /**
  * Initialize a hardware cursor with specified dimensions
@@ -1036,6 +6650,12 @@ static struct CursorState {
 void doInitCursor(jint width, jint height) {
     cursorState.width = width;
     cursorState.height = height;
+    cursorState.boWidth = width;
+    cursorState.boHeight = height;
+
+    if (currentDisplayHandle) {
+        updateCursorSize(currentDisplayHandle);
+    }
 }
 
 /**
@@ -1047,12 +6667,39 @@ void doSetCursorVisibility(jboolean visible) {
         return;
     }
 
+    if (!usesLegacyCursor(handle)) {
+        pthread_mutex_lock(&handle->commitMutex);
+        cursorState.visible = visible;
+        cursorState.dirty = 1;
+        if (visible) {
+            acquireCursorOverlayPlane(handle);
+        }
+        wakeCommitThread(handle);
+        pthread_mutex_unlock(&handle->commitMutex);
+        return;
+    }
+
+    // NB: Legacy cursor ioctls are made with commit mutex held, so that commit thread does not show animation frame
+    //  of the cursor that is being hidden.
+    pthread_mutex_lock(&handle->commitMutex);
+
     cursorState.visible = visible;
-    uint32_t boHandle = visible ? cursorState.boHandle : 0;
+    const uint32_t boHandle = visible ? cursorState.boHandle : 0;
+
+    if (cursorAnimation.framesCount) {
+        // NB: Commit thread flips animation frames only while cursor is visible.
+        wakeCommitThread(handle);
+    }
+
+    const int error = drmModeSetCursor(
+                handle->fd, handle->crtcId, boHandle, cursorState.boWidth, cursorState.boHeight
+    ) ? errno : 0;
+
+    pthread_mutex_unlock(&handle->commitMutex);
 
-    int error = drmModeSetCursor(handle->fd, handle->crtcId, boHandle, cursorState.width, cursorState.height);
     if (error) {
-        fprintf(stderr, "Failed to set cursor visibility: %s\n", strerror(errno));
+        fprintf(stderr, "Failed to set cursor visibility: %s\n", strerror(error));
+        switchToOverlayCursor(handle);
     }
 }
 
@@ -1068,84 +6715,315 @@ void doSetLocation(jint x, jint y) {
     x *= doGetScale(0);
     y *= doGetScale(0);
 
-    int error = drmModeMoveCursor(handle->fd, handle->crtcId, x, y);
-    if (error) {
-        fprintf(stderr, "Failed to move cursor: %s\n", strerror(errno));
+    // NB: Position is given in desktop coordinates, cursor is shown on the main display only.
+    y -= handle->offsetY;
+
+    // NB: Cursor is not rotated by the plane, its image is rotated when set.
+    uint32_t width = cursorState.scaledWidth;
+    uint32_t height = cursorState.scaledHeight;
+    rotateRect(handle->rotation, handle->width, handle->height, &x, &y, &width, &height);
+
+    // NB: Only the latest position is kept. It is committed along with the next UI frame, or pushed by commit thread
+    //  once per display refresh, so the caller never waits for DRM calls.
+    const uint64_t position = (uint64_t) (uint32_t) x << 32 | (uint32_t) y;
+    __atomic_store_n(&cursorState.pendingPosition, position, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&cursorState.positionPending, 1, __ATOMIC_ACQ_REL)) {
+        // NB: Commit thread was woken by previous position already.
+        return;
     }
-}
 
-/**
- * use the specified image as cursor image
- */
-void doSetCursorImage(jbyte* img, int length) {
-    DisplayHandle_t* handle = currentDisplayHandle;
-    if (!handle) {
+    if (__atomic_load_n(&handle->commitThreadStarted, __ATOMIC_ACQUIRE)) {
+        signalCommitThread(handle);
         return;
     }
 
-    struct gbm_bo* cursorBo = gbm_bo_create(handle->device, cursorState.width, cursorState.height, GBM_FORMAT_ARGB8888,
-                                            GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
-    if (!cursorBo) {
+    pthread_mutex_lock(&handle->commitMutex);
+    wakeCommitThread(handle);
+    pthread_mutex_unlock(&handle->commitMutex);
+}
+
+// Size of cursor buffer objects: hardware cursor size, or size of rotated cursor image shown on overlay plane.
+static void getCursorBoSize(DisplayHandle_t* handle, uint32_t* width, uint32_t* height) {
+    if (hasHardwareCursorSize(handle)) {
+        *width = handle->cursorWidth;
+        *height = handle->cursorHeight;
+    } else if (handle->rotation == 90 || handle->rotation == 270) {
+        *width = cursorState.scaledHeight;
+        *height = cursorState.scaledWidth;
+    } else {
+        *width = cursorState.scaledWidth;
+        *height = cursorState.scaledHeight;
+    }
+}
+
+// Writes cursor image into |bo|, or into a new buffer object if |bo| is NULL. Image is scaled, rotated and
+//  premultiplied as needed. Returns NULL on failure, |bo| is destroyed then.
+static struct gbm_bo* uploadCursorImage(DisplayHandle_t* handle, jbyte* img, int length, struct gbm_bo* bo) {
+    jbyte* scaledImg = NULL;
+    jbyte* rotatedImg = NULL;
+    uint32_t width = cursorState.scaledWidth;
+    uint32_t height = cursorState.scaledHeight;
+
+    // NB: Cursor is not rotated by the plane, so its image is rotated here.
+    if (handle->rotation == 90 || handle->rotation == 270) {
+        width = cursorState.scaledHeight;
+        height = cursorState.scaledWidth;
+    }
+
+    uint32_t boWidth;
+    uint32_t boHeight;
+    getCursorBoSize(handle, &boWidth, &boHeight);
+
+    // NB: Image is scaled once on upload, buffer object is shown as is afterwards.
+    if (cursorState.scaledWidth != cursorState.width || cursorState.scaledHeight != cursorState.height) {
+        const uint32_t srcLength = cursorState.width * cursorState.height * 4;
+        jbyte* srcImg = img;
+        if ((uint32_t) length < srcLength) {
+            // NB: Pixels missing from |img| are transparent.
+            srcImg = calloc(srcLength, 1);
+            if (srcImg) {
+                memcpy(srcImg, img, length);
+            }
+        }
+
+        scaledImg = malloc(cursorState.scaledWidth * cursorState.scaledHeight * 4);
+        if (!srcImg || !scaledImg ||
+                resampleImage((uint8_t*) scaledImg, cursorState.scaledWidth, cursorState.scaledHeight,
+                              (const uint8_t*) srcImg, cursorState.width, cursorState.height)) {
+            fprintf(stderr, "Failed to scale cursor image\n");
+            if (srcImg != img) {
+                free(srcImg);
+            }
+            goto err_destroy_bo;
+        }
+
+        if (srcImg != img) {
+            free(srcImg);
+        }
+
+        img = scaledImg;
+        length = cursorState.scaledWidth * cursorState.scaledHeight * 4;
+    }
+
+    if (handle->rotation) {
+        rotatedImg = rotateImage(img, length, cursorState.scaledWidth, cursorState.scaledHeight, handle->rotation);
+        if (!rotatedImg) {
+            fprintf(stderr, "Failed to allocate rotated cursor image\n");
+            goto err_destroy_bo;
+        }
+
+        img = rotatedImg;
+        length = width * height * 4;
+    }
+
+    if (!bo) {
+        bo = gbm_bo_create(handle->device, boWidth, boHeight, GBM_FORMAT_ARGB8888,
+                           GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+    }
+    if (!bo) {
         fprintf(stderr, "Failed to create cursor buffer object: %s\n", strerror(errno));
-        return;
+        goto err_free;
     }
 
     uint32_t stride;
     void* mapData = NULL;
     char* map =
-            gbm_bo_map(cursorBo, 0, 0, cursorState.width, cursorState.height, GBM_BO_TRANSFER_WRITE, &stride, &mapData);
+            gbm_bo_map(bo, 0, 0, boWidth, boHeight, GBM_BO_TRANSFER_WRITE, &stride, &mapData);
 
     if (!map) {
         fprintf(stderr, "Failed to map cursor buffer object: %s\n", strerror(errno));
         goto err_destroy_bo;
     }
 
-    for (uint32_t i = 0; i < cursorState.height; ++i) {
-        // TODO: Check cursor plane for pre-multiplication requirements.
-#ifndef PRE_MULTIPLY_CURSOR
-        if (cursorState.width * 4 * (i + 1) >= (uint32_t) length) {
-            goto outer_break;
+    for (uint32_t i = 0; i < boHeight; ++i) {
+        char* row = &map[stride * i];
+
+        const int available = i < height ? (length - (int) (width * 4 * i)) / 4 : 0;
+        const uint32_t count = available <= 0 ? 0 : (uint32_t) available < width ? (uint32_t) available : width;
+
+        if (count && handle->premultiplyCursor) {
+            // NB: Pre-multiply incoming image to make it blend correctly.
+            premultiplyPixels((uint8_t*) row, (const uint8_t*) &img[width * 4 * i], count);
+        } else if (count) {
+            memcpy(row, &img[width * 4 * i], count * 4);
         }
 
-        memcpy(&map[stride * i], &img[cursorState.width * 4 * i], cursorState.width * 4);
-#else
-        // NB: Pre-multiply incoming image to make it blend correctly.
-        for (uint32_t j = 0; j < cursorState.width; ++j) {
-            // Do a sanity check
-            if (cursorState.width * 4 * i + j * 4 + 3 >= (uint32_t) length) {
-                goto outer_break;
-            }
+        // NB: Hardware cursor may be larger than the image, and recycled buffer object holds the previous image.
+        memset(&row[count * 4], 0, (boWidth - count) * 4);
+    }
 
-            double alpha = ((uint8_t)img[cursorState.width * 4 * i + j * 4 + 3]) / 255.;
+    gbm_bo_unmap(bo, mapData);
 
-            map[stride * i + j * 4    ] = ((uint8_t)img[cursorState.width * 4 * i + j * 4    ]) * alpha;
-            map[stride * i + j * 4 + 1] = ((uint8_t)img[cursorState.width * 4 * i + j * 4 + 1]) * alpha;
-            map[stride * i + j * 4 + 2] = ((uint8_t)img[cursorState.width * 4 * i + j * 4 + 2]) * alpha;
-            map[stride * i + j * 4 + 3] = img[cursorState.width * 4 * i + j * 4 + 3];
-        }
-#endif
+    // NB: Framebuffer is created here, so that commits do not wait for it.
+    if (!usesLegacyCursor(handle) && !getOrCreateBoAndFramebuffer(bo)) {
+        goto err_destroy_bo;
+    }
+
+    free(rotatedImg);
+    free(scaledImg);
+    return bo;
+
+err_destroy_bo:
+    if (bo) {
+        gbm_bo_destroy(bo);
+    }
+err_free:
+    free(rotatedImg);
+    free(scaledImg);
+    return NULL;
+}
+
+/**
+ * use the specified image as cursor image
+ */
+void doSetCursorImage(jbyte* img, int length) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return;
     }
 
-outer_break:
-    gbm_bo_unmap(cursorBo, mapData);
+    updateCursorSize(handle);
+
+    uint32_t boWidth;
+    uint32_t boHeight;
+    getCursorBoSize(handle, &boWidth, &boHeight);
+
+    // NB: Uploads of the same image differ by scale, buffer object size and premultiplication.
+    const uint64_t variant = (uint64_t) boWidth << 48 | (uint64_t) boHeight << 32 |
+            (uint64_t) (cursorState.scaledWidth & 0x7fff) << 17 | (uint64_t) (cursorState.scaledHeight & 0x7fff) << 1 |
+            handle->premultiplyCursor;
+    const uint64_t hash = hashCursorImage(img, length, cursorState.width, cursorState.height, variant);
+
+    CursorCacheEntry_t* entry = findCursorCacheEntry(hash);
+    if (!entry) {
+        // NB: Evicted buffer object is not scanned out anymore, so the image is written right into it when it fits.
+        //  Buffer objects that are still scanned out are never destroyed, so shape changes do not wait for display
+        //  hardware.
+        pthread_mutex_lock(&handle->commitMutex);
+        struct gbm_bo* cursorBo = evictCursorCacheEntry(handle, boWidth, boHeight);
+        pthread_mutex_unlock(&handle->commitMutex);
+
+        cursorBo = uploadCursorImage(handle, img, length, cursorBo);
+        if (!cursorBo) {
+            return;
+        }
+
+        pthread_mutex_lock(&handle->commitMutex);
+        entry = addCursorCacheEntry(handle, hash, cursorBo, boWidth, boHeight);
+        pthread_mutex_unlock(&handle->commitMutex);
 
-    if (cursorState.cursorBo) {
-        gbm_bo_destroy(cursorState.cursorBo);
+        if (!entry) {
+            fprintf(stderr, "Failed to cache cursor buffer object\n");
+            gbm_bo_destroy(cursorBo);
+            return;
+        }
     }
 
-    cursorState.cursorBo = cursorBo;
-    cursorState.boHandle = gbm_bo_get_handle(cursorBo).u32;
+    pthread_mutex_lock(&handle->commitMutex);
+
+    stopCursorAnimation(handle);
 
+    if (entry->bo != cursorState.cursorBo) {
+        cursorState.replacedBo = cursorState.cursorBo;
+        cursorState.replacedNs = getTimeNs();
+    }
+    cursorState.cursorBo = entry->bo;
+    cursorState.boWidth = entry->boWidth;
+    cursorState.boHeight = entry->boHeight;
+    cursorState.boHandle = gbm_bo_get_handle(entry->bo).u32;
+
+    if (!usesLegacyCursor(handle)) {
+        cursorState.dirty = 1;
+        if (cursorState.visible) {
+            acquireCursorOverlayPlane(handle);
+        }
+        wakeCommitThread(handle);
+        pthread_mutex_unlock(&handle->commitMutex);
+        return;
+    }
+
+    // NB: Visibility is checked and image is set with commit mutex held, see |doSetCursorVisibility|.
+    int error = 0;
     if (cursorState.visible) {
-        int error = drmModeSetCursor(
-                    handle->fd, handle->crtcId, cursorState.boHandle, cursorState.width, cursorState.height
+        error = drmModeSetCursor(
+                    handle->fd, handle->crtcId, cursorState.boHandle, cursorState.boWidth, cursorState.boHeight
+        ) ? errno : 0;
+    }
+
+    pthread_mutex_unlock(&handle->commitMutex);
+
+    if (error) {
+        fprintf(stderr, "Failed to update cursor image: %s\n", strerror(error));
+        switchToOverlayCursor(handle);
+    }
+}
+
+/**
+ * Animate the hardware cursor
+ *
+ * This is not a part of Monocle EGL interface. |img| holds |count| cursor images one after another, each of the size
+ * given to |doInitCursor|. They are shown in a loop for |duration| milliseconds each. Frames are uploaded once, and
+ * then flipped by the library on display refresh, without copies or calls from Java. Animation is stopped by
+ * |doSetCursorImage| or replaced by another one. Returns false if frames could not be uploaded.
+ */
+jboolean doSetCursorAnimation(jbyte* img, jint length, jint count, jint duration) {
+    DisplayHandle_t* handle = currentDisplayHandle;
+    if (!handle) {
+        return JNI_FALSE;
+    }
+
+    if (count <= 0 || count > MAX_CURSOR_ANIMATION_FRAMES || duration <= 0) {
+        fprintf(stderr, "Invalid cursor animation of %i frames, %i ms each\n", count, duration);
+        return JNI_FALSE;
+    }
+
+    updateCursorSize(handle);
+
+    struct gbm_bo* frames[MAX_CURSOR_ANIMATION_FRAMES] = {NULL};
+    const int frameLength = cursorState.width * cursorState.height * 4;
+
+    for (jint i = 0; i < count; ++i) {
+        const int available = length - frameLength * i;
+        frames[i] = uploadCursorImage(
+                    handle,
+                    &img[frameLength * i],
+                    available < 0 ? 0 : available > frameLength ? frameLength : available,
+                    NULL
         );
-        if (error) {
-            fprintf(stderr, "Failed to update cursor image: %s\n", strerror(errno));
+        if (!frames[i]) {
+            goto err_destroy_frames;
         }
     }
 
-    return;
-err_destroy_bo:
-    gbm_bo_destroy(cursorBo);
+    pthread_mutex_lock(&handle->commitMutex);
+
+    stopCursorAnimation(handle);
+
+    for (jint i = 0; i < count; ++i) {
+        cursorAnimation.frames[i] = frames[i];
+        if (usesLegacyCursor(handle)) {
+            // NB: Framebuffers are not created for legacy cursor API, so memory is accounted here.
+            addDisplayBuffersBytes(getBoSize(frames[i]));
+        }
+    }
+    cursorAnimation.framesCount = count;
+    getCursorBoSize(handle, &cursorAnimation.boWidth, &cursorAnimation.boHeight);
+    cursorAnimation.frameDurationNs = duration * 1000000ull;
+    cursorAnimation.startNs = getTimeNs();
+
+    if (cursorState.visible) {
+        acquireCursorOverlayPlane(handle);
+    }
+
+    // NB: Commit thread shows the first frame right away.
+    const int result = wakeCommitThread(handle);
+
+    pthread_mutex_unlock(&handle->commitMutex);
+    return result ? JNI_FALSE : JNI_TRUE;
+
+err_destroy_frames:
+    for (jint i = 0; i < count && frames[i]; ++i) {
+        gbm_bo_destroy(frames[i]);
+    }
+    return JNI_FALSE;
 }
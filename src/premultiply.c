@@ -0,0 +1,169 @@
+#include "premultiply.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// NB: Exact (x + 127) / 255 for x = c * a, without division.
+static inline uint8_t premultiplyComponent(uint32_t component, uint32_t alpha) {
+    const uint32_t x = component * alpha + 127;
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+void premultiplyPixelsScalar(uint8_t* dst, const uint8_t* src, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint32_t alpha = src[i * 4 + 3];
+
+        dst[i * 4    ] = premultiplyComponent(src[i * 4    ], alpha);
+        dst[i * 4 + 1] = premultiplyComponent(src[i * 4 + 1], alpha);
+        dst[i * 4 + 2] = premultiplyComponent(src[i * 4 + 2], alpha);
+        dst[i * 4 + 3] = alpha;
+    }
+}
+
+#if defined(__SSE2__)
+
+// Premultiplies 16-bit components of two pixels. Alpha is multiplied by 255, which keeps it intact.
+static inline __m128i premultiplySse2(__m128i pixels) {
+    const __m128i alphaMask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    const __m128i alpha255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_or_si128(_mm_andnot_si128(alphaMask, alpha), alpha255);
+
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(pixels, alpha), _mm_set1_epi16(127));
+    x = _mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8));
+    return _mm_srli_epi16(x, 8);
+}
+
+static void premultiplyPixelsSse2(uint8_t* dst, const uint8_t* src, uint32_t count) {
+    const __m128i zero = _mm_setzero_si128();
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i pixels = _mm_loadu_si128((const __m128i*) &src[i * 4]);
+
+        const __m128i low = premultiplySse2(_mm_unpacklo_epi8(pixels, zero));
+        const __m128i high = premultiplySse2(_mm_unpackhi_epi8(pixels, zero));
+
+        _mm_storeu_si128((__m128i*) &dst[i * 4], _mm_packus_epi16(low, high));
+    }
+
+    premultiplyPixelsScalar(&dst[i * 4], &src[i * 4], count - i);
+}
+
+PremultiplyFunction_t getPremultiplyPixelsSse2(void) {
+    return premultiplyPixelsSse2;
+}
+
+#else
+
+PremultiplyFunction_t getPremultiplyPixelsSse2(void) {
+    return NULL;
+}
+
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+__attribute__((target("avx2")))
+static inline __m256i premultiplyAvx2(__m256i pixels) {
+    const __m256i alphaMask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+    const __m256i alpha255 = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+
+    __m256i alpha =
+            _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm256_or_si256(_mm256_andnot_si256(alphaMask, alpha), alpha255);
+
+    __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(pixels, alpha), _mm256_set1_epi16(127));
+    x = _mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8));
+    return _mm256_srli_epi16(x, 8);
+}
+
+__attribute__((target("avx2")))
+static void premultiplyPixelsAvx2(uint8_t* dst, const uint8_t* src, uint32_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i pixels = _mm256_loadu_si256((const __m256i*) &src[i * 4]);
+
+        // NB: Unpacking and packing both work within 128-bit lanes, so pixels order is preserved.
+        const __m256i low = premultiplyAvx2(_mm256_unpacklo_epi8(pixels, zero));
+        const __m256i high = premultiplyAvx2(_mm256_unpackhi_epi8(pixels, zero));
+
+        _mm256_storeu_si256((__m256i*) &dst[i * 4], _mm256_packus_epi16(low, high));
+    }
+
+    premultiplyPixelsScalar(&dst[i * 4], &src[i * 4], count - i);
+}
+
+PremultiplyFunction_t getPremultiplyPixelsAvx2(void) {
+    return __builtin_cpu_supports("avx2") ? premultiplyPixelsAvx2 : NULL;
+}
+
+#else
+
+PremultiplyFunction_t getPremultiplyPixelsAvx2(void) {
+    return NULL;
+}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+static inline uint8x8_t premultiplyNeon(uint8x8_t component, uint8x8_t alpha) {
+    uint16x8_t x = vaddq_u16(vmull_u8(component, alpha), vdupq_n_u16(127));
+    x = vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8));
+    return vshrn_n_u16(x, 8);
+}
+
+static void premultiplyPixelsNeon(uint8_t* dst, const uint8_t* src, uint32_t count) {
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t pixels = vld4_u8(&src[i * 4]);
+
+        pixels.val[0] = premultiplyNeon(pixels.val[0], pixels.val[3]);
+        pixels.val[1] = premultiplyNeon(pixels.val[1], pixels.val[3]);
+        pixels.val[2] = premultiplyNeon(pixels.val[2], pixels.val[3]);
+
+        vst4_u8(&dst[i * 4], pixels);
+    }
+
+    premultiplyPixelsScalar(&dst[i * 4], &src[i * 4], count - i);
+}
+
+PremultiplyFunction_t getPremultiplyPixelsNeon(void) {
+    return premultiplyPixelsNeon;
+}
+
+#else
+
+PremultiplyFunction_t getPremultiplyPixelsNeon(void) {
+    return NULL;
+}
+
+#endif
+
+static PremultiplyFunction_t premultiplyFunction = NULL;
+
+void premultiplyPixels(uint8_t* dst, const uint8_t* src, uint32_t count) {
+    if (!premultiplyFunction) {
+        PremultiplyFunction_t function = getPremultiplyPixelsAvx2();
+        if (!function) {
+            function = getPremultiplyPixelsSse2();
+        }
+        if (!function) {
+            function = getPremultiplyPixelsNeon();
+        }
+
+        // NB: Racing threads would choose the same function anyway.
+        premultiplyFunction = function ? function : premultiplyPixelsScalar;
+    }
+
+    premultiplyFunction(dst, src, count);
+}
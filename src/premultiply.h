@@ -0,0 +1,22 @@
+#ifndef JFX_EGL_DRM_PREMULTIPLY_H
+#define JFX_EGL_DRM_PREMULTIPLY_H
+
+#include <stdint.h>
+
+typedef void (*PremultiplyFunction_t)(uint8_t* dst, const uint8_t* src, uint32_t count);
+
+/**
+ * Multiply color components of |count| BGRA pixels by their alpha
+ *
+ * Each component is rounded as (c * a + 127) / 255. |dst| and |src| may be the same buffer. The fastest implementation
+ * supported by the CPU is chosen on the first call.
+ */
+void premultiplyPixels(uint8_t* dst, const uint8_t* src, uint32_t count);
+
+// Implementations, exposed for benchmarking. NULL when not available on this CPU or for this architecture.
+void premultiplyPixelsScalar(uint8_t* dst, const uint8_t* src, uint32_t count);
+PremultiplyFunction_t getPremultiplyPixelsSse2(void);
+PremultiplyFunction_t getPremultiplyPixelsAvx2(void);
+PremultiplyFunction_t getPremultiplyPixelsNeon(void);
+
+#endif
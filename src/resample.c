@@ -0,0 +1,220 @@
+#include "resample.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "premultiply.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Source pixels and 8-bit weight of the second one for a destination column or row.
+typedef struct Sample {
+    uint32_t first;
+    uint32_t second;
+    uint32_t weight;
+} Sample_t;
+
+// Maps |dstSize| pixel centers to |srcSize| pixels, so that the image is neither shifted nor cut.
+static void computeSamples(Sample_t* samples, uint32_t dstSize, uint32_t srcSize) {
+    for (uint32_t i = 0; i < dstSize; ++i) {
+        // NB: 24.8 fixed point of (i + 0.5) * srcSize / dstSize - 0.5.
+        int64_t position = ((2 * (int64_t) i + 1) * srcSize * 256) / (2 * (int64_t) dstSize) - 128;
+        if (position < 0) {
+            position = 0;
+        }
+
+        samples[i].first = position >> 8;
+        samples[i].weight = position & 0xff;
+        if (samples[i].first >= srcSize - 1) {
+            samples[i].first = srcSize - 1;
+            samples[i].weight = 0;
+        }
+        samples[i].second = samples[i].weight ? samples[i].first + 1 : samples[i].first;
+    }
+}
+
+// NB: Horizontal and vertical interpolations are rounded separately, the same way in every implementation.
+static inline uint32_t interpolate(uint32_t first, uint32_t second, uint32_t weight) {
+    return (first * (256 - weight) + second * weight + 128) >> 8;
+}
+
+#if defined(__SSE2__)
+
+static inline __m128i loadPixelSse2(const uint8_t* pixel) {
+    int32_t value;
+    memcpy(&value, pixel, 4);
+    return _mm_unpacklo_epi8(_mm_cvtsi32_si128(value), _mm_setzero_si128());
+}
+
+// Interpolates 32-bit components of |first| and |second| pixels interleaved as 16-bit values.
+static inline __m128i interpolateSse2(__m128i interleaved, uint32_t weight) {
+    const __m128i weights = _mm_set1_epi32((int32_t) (weight << 16 | (256 - weight)));
+    const __m128i x = _mm_add_epi32(_mm_madd_epi16(interleaved, weights), _mm_set1_epi32(128));
+    return _mm_srli_epi32(x, 8);
+}
+
+static void resampleRowSse2(
+        uint8_t* dst,
+        const uint8_t* top,
+        const uint8_t* bottom,
+        uint32_t weight,
+        const Sample_t* columns,
+        uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint32_t first = columns[i].first * 4;
+        const uint32_t second = columns[i].second * 4;
+
+        const __m128i topValue = interpolateSse2(
+                    _mm_unpacklo_epi16(loadPixelSse2(&top[first]), loadPixelSse2(&top[second])), columns[i].weight
+        );
+        const __m128i bottomValue = interpolateSse2(
+                    _mm_unpacklo_epi16(loadPixelSse2(&bottom[first]), loadPixelSse2(&bottom[second])),
+                    columns[i].weight
+        );
+
+        const __m128i packed = _mm_packs_epi32(topValue, bottomValue);
+        const __m128i value = interpolateSse2(_mm_unpacklo_epi16(packed, _mm_srli_si128(packed, 8)), weight);
+
+        const __m128i pixel = _mm_packus_epi16(_mm_packs_epi32(value, value), _mm_setzero_si128());
+        const int32_t result = _mm_cvtsi128_si32(pixel);
+        memcpy(&dst[i * 4], &result, 4);
+    }
+}
+
+#define resampleRow resampleRowSse2
+
+#elif defined(__ARM_NEON)
+
+// Interpolates 16-bit components of |first| pixel (low half) and |second| one (high half).
+static inline uint16x4_t interpolateNeon(uint16x8_t pixels, uint32_t weight) {
+    const uint16x8_t weights = vcombine_u16(vdup_n_u16(256 - weight), vdup_n_u16(weight));
+    const uint16x8_t x = vmulq_u16(pixels, weights);
+    return vrshr_n_u16(vadd_u16(vget_low_u16(x), vget_high_u16(x)), 8);
+}
+
+static inline uint16x8_t loadPixelsNeon(const uint8_t* first, const uint8_t* second) {
+    uint32_t values[2];
+    memcpy(&values[0], first, 4);
+    memcpy(&values[1], second, 4);
+    return vmovl_u8(vreinterpret_u8_u32(vld1_u32(values)));
+}
+
+static void resampleRowNeon(
+        uint8_t* dst,
+        const uint8_t* top,
+        const uint8_t* bottom,
+        uint32_t weight,
+        const Sample_t* columns,
+        uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint32_t first = columns[i].first * 4;
+        const uint32_t second = columns[i].second * 4;
+
+        const uint16x4_t topValue = interpolateNeon(loadPixelsNeon(&top[first], &top[second]), columns[i].weight);
+        const uint16x4_t bottomValue =
+                interpolateNeon(loadPixelsNeon(&bottom[first], &bottom[second]), columns[i].weight);
+
+        const uint8x8_t pixel = vmovn_u16(vcombine_u16(interpolateNeon(vcombine_u16(topValue, bottomValue), weight),
+                                                       vdup_n_u16(0)));
+        const uint32_t result = vget_lane_u32(vreinterpret_u32_u8(pixel), 0);
+        memcpy(&dst[i * 4], &result, 4);
+    }
+}
+
+#define resampleRow resampleRowNeon
+
+#else
+
+static void resampleRowScalar(
+        uint8_t* dst,
+        const uint8_t* top,
+        const uint8_t* bottom,
+        uint32_t weight,
+        const Sample_t* columns,
+        uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t* topFirst = &top[columns[i].first * 4];
+        const uint8_t* topSecond = &top[columns[i].second * 4];
+        const uint8_t* bottomFirst = &bottom[columns[i].first * 4];
+        const uint8_t* bottomSecond = &bottom[columns[i].second * 4];
+
+        for (int c = 0; c < 4; ++c) {
+            dst[i * 4 + c] = interpolate(
+                        interpolate(topFirst[c], topSecond[c], columns[i].weight),
+                        interpolate(bottomFirst[c], bottomSecond[c], columns[i].weight),
+                        weight
+            );
+        }
+    }
+}
+
+#define resampleRow resampleRowScalar
+
+#endif
+
+// Divides color components by alpha.
+static void unpremultiplyPixels(uint8_t* pixels, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t* pixel = &pixels[i * 4];
+        const uint32_t alpha = pixel[3];
+
+        for (int c = 0; c < 3; ++c) {
+            const uint32_t value = alpha ? (pixel[c] * 255 + alpha / 2) / alpha : 0;
+            pixel[c] = value > 255 ? 255 : value;
+        }
+    }
+}
+
+int resampleImage(
+        uint8_t* dst,
+        uint32_t dstWidth,
+        uint32_t dstHeight,
+        const uint8_t* src,
+        uint32_t srcWidth,
+        uint32_t srcHeight) {
+    if (!dstWidth || !dstHeight) {
+        return 0;
+    }
+
+    if (!srcWidth || !srcHeight) {
+        memset(dst, 0, dstWidth * dstHeight * 4);
+        return 0;
+    }
+
+    // NB: Interpolation of premultiplied colors is what weights them by alpha.
+    uint8_t* premultiplied = malloc(srcWidth * srcHeight * 4);
+    Sample_t* columns = malloc(sizeof (Sample_t) * dstWidth);
+    Sample_t* rows = malloc(sizeof (Sample_t) * dstHeight);
+    if (!premultiplied || !columns || !rows) {
+        free(rows);
+        free(columns);
+        free(premultiplied);
+        return -1;
+    }
+
+    premultiplyPixels(premultiplied, src, srcWidth * srcHeight);
+    computeSamples(columns, dstWidth, srcWidth);
+    computeSamples(rows, dstHeight, srcHeight);
+
+    for (uint32_t i = 0; i < dstHeight; ++i) {
+        resampleRow(&dst[dstWidth * 4 * i],
+                    &premultiplied[srcWidth * 4 * rows[i].first],
+                    &premultiplied[srcWidth * 4 * rows[i].second],
+                    rows[i].weight,
+                    columns,
+                    dstWidth);
+    }
+
+    unpremultiplyPixels(dst, dstWidth * dstHeight);
+
+    free(rows);
+    free(columns);
+    free(premultiplied);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef JFX_EGL_DRM_RESAMPLE_H
+#define JFX_EGL_DRM_RESAMPLE_H
+
+#include <stdint.h>
+
+/**
+ * Resample |srcWidth|x|srcHeight| BGRA image with straight alpha to |dstWidth|x|dstHeight| by bilinear filtering
+ *
+ * Colors are weighted by alpha, so that transparent pixels do not darken image edges. Result has straight alpha as
+ * well. Returns non-zero if temporary memory could not be allocated.
+ */
+int resampleImage(
+        uint8_t* dst,
+        uint32_t dstWidth,
+        uint32_t dstHeight,
+        const uint8_t* src,
+        uint32_t srcWidth,
+        uint32_t srcHeight);
+
+#endif